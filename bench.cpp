@@ -0,0 +1,519 @@
+// Benchmarks for the compiler in parser.cpp. Generates synthetic programs of
+// increasing size and times each phase on its own and end to end; results
+// are printed as one JSON object per line.
+//
+//   g++ -std=c++17 -O2 -pthread -o bench bench.cpp
+//   ./bench [--sizes 1K,64K,4M,64M] [--seed N] [--min-time seconds] [--work-dir dir]
+//   ./bench --generate <size> <file>
+
+#define PARSER_NO_MAIN
+#include "parser.cpp"
+
+#include <random>
+
+// Writes random but valid programs using every construct the Parser accepts.
+// Every declaration gets a fresh name, so nothing is ever redeclared.
+class ProgramGenerator
+{
+private:
+    struct Variable
+    {
+        string name;
+        ValueType type;
+    };
+
+    mt19937_64 rng;
+    string out;
+    vector<vector<Variable>> scopes;
+    int nameCount = 0;
+    int depth = 0;
+
+    static const int MAX_DEPTH = 3;
+
+public:
+    ProgramGenerator(uint64_t seed) : rng(seed) {}
+
+    string generate(size_t targetBytes)
+    {
+        out.clear();
+        out.reserve(targetBytes + 4096);
+        scopes.assign(1, vector<Variable>());
+        nameCount = 0;
+        depth = 0;
+
+        // A few numeric globals so the first statements have something to use
+        for (int i = 0; i < 4; i++)
+            declaration(i % 2 ? VT_FLOAT : VT_INT);
+        while (out.size() < targetBytes)
+            statement();
+        return out;
+    }
+
+private:
+    size_t pick(size_t n)
+    {
+        return (size_t)(rng() % n);
+    }
+
+    void indent()
+    {
+        out.append(depth * 4, ' ');
+    }
+
+    string freshName(const char *prefix)
+    {
+        return prefix + to_string(nameCount++);
+    }
+
+    // A visible variable of a numeric type, "" if there is none
+    string numericVariable()
+    {
+        for (int tries = 0; tries < 4; tries++)
+        {
+            const vector<Variable> &scope = scopes[pick(scopes.size())];
+            if (scope.empty())
+                continue;
+            const Variable &v = scope[pick(scope.size())];
+            if (v.type == VT_INT || v.type == VT_FLOAT)
+                return v.name;
+        }
+        for (const Variable &v : scopes[0])
+        {
+            if (v.type == VT_INT || v.type == VT_FLOAT)
+                return v.name;
+        }
+        return "";
+    }
+
+    string operand()
+    {
+        string name = pick(3) ? numericVariable() : "";
+        if (!name.empty())
+            return name;
+        return pick(4) ? to_string(pick(1000)) : to_string(pick(100)) + "." + to_string(pick(100));
+    }
+
+    string expression()
+    {
+        static const char *const OPERATORS[] = {" + ", " - ", " * ", " / "};
+        string text = operand();
+        for (size_t terms = pick(3); terms > 0; terms--)
+            text += OPERATORS[pick(4)] + operand();
+        return text;
+    }
+
+    string condition()
+    {
+        static const char *const COMPARISONS[] = {" < ", " > ", " <= ", " >= ", " == ", " != "};
+        return operand() + COMPARISONS[pick(6)] + operand();
+    }
+
+    void declaration(ValueType type)
+    {
+        static const char *const WORDS[] = {"alpha", "beta", "gamma", "delta", "compiler", "token", "parser"};
+        string name = freshName("v");
+        indent();
+        switch (type)
+        {
+        case VT_INT:
+            out += "int " + name + " = " + expression() + ";\n";
+            break;
+        case VT_FLOAT:
+            out += (pick(2) ? "float " : "double ") + name + " = " + expression() + ";\n";
+            break;
+        case VT_STRING:
+            out += "string " + name + " = \"" + WORDS[pick(7)] + " " + to_string(pick(100)) + "\";\n";
+            break;
+        case VT_CHAR:
+            out += "char " + name + " = '" + (char)('a' + pick(26)) + "';\n";
+            break;
+        case VT_BOOL:
+            out += "bool " + name + " = " + (pick(2) ? "true" : condition()) + ";\n";
+            break;
+        }
+        scopes.back().push_back(Variable{name, type});
+    }
+
+    // `last` is an extra final statement, e.g. a loop step
+    void block(const string &last = "")
+    {
+        out += "{\n";
+        depth++;
+        scopes.emplace_back();
+        for (size_t count = 1 + pick(4); count > 0; count--)
+            statement();
+        if (!last.empty())
+        {
+            indent();
+            out += last + "\n";
+        }
+        scopes.pop_back();
+        depth--;
+        indent();
+        out += "}\n";
+    }
+
+    void statement()
+    {
+        // Compound statements get rarer with depth so blocks stay small
+        size_t choice = pick(depth < MAX_DEPTH ? 14 : 9);
+        switch (choice)
+        {
+        case 0:
+        case 1:
+            declaration(VT_INT);
+            break;
+        case 2:
+            declaration(pick(2) ? VT_FLOAT : VT_BOOL);
+            break;
+        case 3:
+            declaration(pick(2) ? VT_STRING : VT_CHAR);
+            break;
+        case 4:
+        case 5:
+        {
+            string target = numericVariable();
+            indent();
+            out += target + " = " + expression() + ";\n";
+            break;
+        }
+        case 6:
+            indent();
+            out += "print(" + operand() + ");\n";
+            break;
+        case 7:
+            indent();
+            out += "// " + freshName("note ") + ": generated comment\n";
+            break;
+        case 8:
+            indent();
+            out += pick(8) ? "print(\"" + freshName("line ") + "\");\n" : "return " + operand() + ";\n";
+            break;
+        case 9:
+        case 10:
+            indent();
+            out += (pick(2) ? "if (" : "agar (") + condition() + ") ";
+            block();
+            if (pick(2))
+            {
+                indent();
+                out += "else ";
+                block();
+            }
+            break;
+        case 11:
+        {
+            // Counted, so the optimizer cannot prove the loop endless and
+            // drop the rest of the program as unreachable
+            string counter = freshName("w");
+            indent();
+            out += "int " + counter + " = 0;\n";
+            scopes.back().push_back(Variable{counter, VT_INT});
+            indent();
+            out += "while (" + counter + " < " + to_string(1 + pick(100)) + ") ";
+            block(counter + " = " + counter + " + 1;");
+            break;
+        }
+        case 12:
+        {
+            // The loop variable lives in the for statement's own scope
+            string counter = freshName("i");
+            indent();
+            out += "for (int " + counter + " = 0; " + counter + " < " + to_string(1 + pick(100)) + "; " + counter + "++) ";
+            scopes.emplace_back();
+            scopes.back().push_back(Variable{counter, VT_INT});
+            block();
+            scopes.pop_back();
+            break;
+        }
+        default:
+        {
+            indent();
+            out += "switch (" + operand() + ") {\n";
+            depth++;
+            scopes.emplace_back();
+            for (size_t cases = 1 + pick(4), value = 0; cases > 0; cases--)
+            {
+                value += 1 + pick(3);
+                indent();
+                out += "case " + to_string(value) + ": ";
+                if (pick(3))
+                {
+                    out += "print(" + to_string(value) + ");\n";
+                }
+                else
+                {
+                    block();
+                }
+                if (pick(4))
+                {
+                    indent();
+                    out += "break;\n";
+                }
+            }
+            scopes.pop_back();
+            depth--;
+            indent();
+            out += "}\n";
+            break;
+        }
+        }
+    }
+};
+
+// Counts and drops everything written to it
+class DiscardBuffer : public streambuf
+{
+private:
+    size_t bytes = 0;
+
+public:
+    size_t count() const
+    {
+        return bytes;
+    }
+
+protected:
+    int overflow(int c) override
+    {
+        bytes++;
+        return c == EOF ? 0 : c;
+    }
+
+    streamsize xsputn(const char *, streamsize n) override
+    {
+        bytes += n;
+        return n;
+    }
+};
+
+struct Measurement
+{
+    vector<double> seconds;
+    size_t items = 0; // Tokens, nodes, instructions or bytes, depending on the benchmark
+};
+
+// Runs `body` (which returns the seconds it timed) until it has run at least
+// `minReps` times and `minTime` seconds in total, or `maxReps` times
+Measurement measure(double minTime, const function<double(size_t &items)> &body)
+{
+    const int minReps = 3;
+    const int maxReps = 50;
+    Measurement m;
+    double total = 0;
+    while ((int)m.seconds.size() < maxReps && ((int)m.seconds.size() < minReps || total < minTime))
+    {
+        double seconds = body(m.items);
+        m.seconds.push_back(seconds);
+        total += seconds;
+    }
+    sort(m.seconds.begin(), m.seconds.end());
+    return m;
+}
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void report(const string &bench, size_t sourceBytes, const char *itemName, const Measurement &m)
+{
+    double best = m.seconds.front();
+    double median = m.seconds[m.seconds.size() / 2];
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"bench\":\"%s\",\"size_bytes\":%zu,\"reps\":%zu,\"best_s\":%.6f,\"median_s\":%.6f,"
+             "\"mb_per_s\":%.2f,\"%s\":%zu,\"%s_per_s\":%.0f}",
+             bench.c_str(), sourceBytes, m.seconds.size(), best, median, sourceBytes / best / 1e6, itemName, m.items,
+             itemName, m.items / best);
+    cout << line << endl;
+    cerr << "  " << bench << ": " << sourceBytes / best / 1e6 << " MB/s" << endl;
+}
+
+void benchmarkSize(const string &program, const string &workDir, double minTime)
+{
+    size_t bytes = program.size();
+    cerr << bytes << " bytes" << endl;
+
+    report("tokenize", bytes, "tokens", measure(minTime, [&](size_t &items)
+    {
+        StringInterner strings;
+        Lexer lexer(program, strings);
+        auto start = chrono::steady_clock::now();
+        vector<Token> tokens = lexer.tokenize();
+        double seconds = secondsSince(start);
+        items = tokens.size();
+        return seconds;
+    }));
+
+    // Lexing is pulled by the parser, so this is lexing and parsing together
+    report("parse", bytes, "ast_nodes", measure(minTime, [&](size_t &items)
+    {
+        StringInterner strings;
+        Lexer lexer(program, strings);
+        SymbolTable symTable(strings);
+        AstArena ast;
+        Parser parser(lexer, symTable, ast);
+        auto start = chrono::steady_clock::now();
+        parser.parseProgram();
+        double seconds = secondsSince(start);
+        items = ast.size();
+        return seconds;
+    }));
+
+    // The back-end phases share one front-end run per repetition
+    Measurement lower;
+    Measurement optimize;
+    Measurement assemble;
+    double total = 0;
+    while ((int)lower.seconds.size() < 50 && ((int)lower.seconds.size() < 3 || total < minTime))
+    {
+        StringInterner strings;
+        Lexer lexer(program, strings);
+        SymbolTable symTable(strings);
+        IntermediateCodeGnerator icg(strings);
+        AstArena ast;
+        Parser parser(lexer, symTable, ast);
+        NodeId root = parser.parseProgram();
+
+        auto start = chrono::steady_clock::now();
+        AstLowering lowering(ast, icg);
+        lowering.lowerProgram(root);
+        lower.seconds.push_back(secondsSince(start));
+        lower.items = icg.instructions.size();
+
+        // The -O1 passes, in compileFile's order
+        start = chrono::steady_clock::now();
+        ConstantPropagation optimizer(icg);
+        optimizer.run();
+        GlobalValueNumbering valueNumbering(icg);
+        valueNumbering.run();
+        LoopOptimization loops(icg);
+        loops.run();
+        DeadCodeElimination deadCode(icg);
+        deadCode.run();
+        optimize.seconds.push_back(secondsSince(start));
+        optimize.items = lower.items;
+
+        // With register allocation and the peephole pass, as at -O1
+        DiscardBuffer sink;
+        ostream out(&sink);
+        start = chrono::steady_clock::now();
+        AssemblyGenerator asmGen(icg, out, true);
+        asmGen.generateAssembly();
+        assemble.seconds.push_back(secondsSince(start));
+        assemble.items = sink.count();
+        total += lower.seconds.back() + optimize.seconds.back() + assemble.seconds.back();
+    }
+    sort(lower.seconds.begin(), lower.seconds.end());
+    sort(optimize.seconds.begin(), optimize.seconds.end());
+    sort(assemble.seconds.begin(), assemble.seconds.end());
+    report("lower", bytes, "instructions", lower);
+    report("optimize", bytes, "instructions", optimize);
+    report("generate_assembly", bytes, "asm_bytes", assemble);
+
+    // Whole pipeline through compileFile: file in, file out
+    string sourcePath = (filesystem::path(workDir) / ("bench_" + to_string(bytes) + ".txt")).string();
+    string outputPath = (filesystem::path(workDir) / ("bench_" + to_string(bytes) + ".asm")).string();
+    {
+        ofstream source(sourcePath, ios::binary);
+        source << program;
+    }
+    CompileOptions options;
+    options.echoSource = false;
+    options.printIntermediate = false;
+    report("end_to_end", bytes, "instructions", measure(minTime, [&](size_t &items)
+    {
+        auto start = chrono::steady_clock::now();
+        unique_ptr<OutputSink> output = OutputSink::toFile(outputPath);
+        CompileStats stats = compileFile(sourcePath, *output, options);
+        output.reset();
+        double seconds = secondsSince(start);
+        items = stats.instructions;
+        return seconds;
+    }));
+    error_code ec;
+    filesystem::remove(sourcePath, ec);
+    filesystem::remove(outputPath, ec);
+}
+
+// "64K", "4M", "1G" or plain bytes
+size_t parseSize(const string &text)
+{
+    size_t value = stoull(text);
+    switch (text.empty() ? 0 : toupper((unsigned char)text.back()))
+    {
+    case 'K':
+        return value << 10;
+    case 'M':
+        return value << 20;
+    case 'G':
+        return value << 30;
+    default:
+        return value;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    vector<size_t> sizes = {1 << 10, 16 << 10, 256 << 10, 4 << 20, 32 << 20};
+    uint64_t seed = 1;
+    double minTime = 0.5;
+    string workDir = filesystem::temp_directory_path().string();
+
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--generate" && i + 2 < argc)
+            {
+                size_t size = parseSize(argv[i + 1]);
+                ofstream file(argv[i + 2], ios::binary);
+                if (!file.is_open())
+                {
+                    throw runtime_error("Could not open " + string(argv[i + 2]) + " file");
+                }
+                file << ProgramGenerator(seed).generate(size);
+                return 0;
+            }
+            else if (arg == "--sizes" && i + 1 < argc)
+            {
+                sizes.clear();
+                stringstream list(argv[++i]);
+                string item;
+                while (getline(list, item, ','))
+                    sizes.push_back(parseSize(item));
+            }
+            else if (arg == "--seed" && i + 1 < argc)
+            {
+                seed = stoull(argv[++i]);
+            }
+            else if (arg == "--min-time" && i + 1 < argc)
+            {
+                minTime = stod(argv[++i]);
+            }
+            else if (arg == "--work-dir" && i + 1 < argc)
+            {
+                workDir = argv[++i];
+            }
+            else
+            {
+                cerr << "Usage: " << argv[0] << " [--sizes 1K,64K,4M] [--seed N] [--min-time seconds] [--work-dir dir]" << endl;
+                cerr << "       " << argv[0] << " [--seed N] --generate <size> <file>" << endl;
+                return 1;
+            }
+        }
+
+        for (size_t size : sizes)
+        {
+            benchmarkSize(ProgramGenerator(seed).generate(size), workDir, minTime);
+        }
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,11 +1,44 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include <cctype>
-#include <map>
+#include <string_view>
+#include <array>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <fstream>
-#include <sstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <sstream>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <charconv>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define LEXER_SIMD
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+// --run compiles to machine code in memory, see JitCompiler
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X86_64
+#endif
 
 using namespace std;
 
@@ -35,6 +68,7 @@ enum TokenType
     T_FOR,
     T_SWITCH,
     T_CASE,
+    T_DEFAULT,
     T_BREAK,
     T_CONTINUE,
 
@@ -75,1093 +109,9934 @@ enum TokenType
     T_PRINT // Custom print function
 };
 
+// Token text is a view into the SourceFile buffer, which must outlive the tokens
 struct Token
 {
     TokenType type;
-    string value;
+    string_view value;
     int line;
-    Token(TokenType type, const string &value, int line) : type(type), value(value), line(line) {}
+    int symbol;   // StringInterner id for identifiers and literals, -1 otherwise
+    size_t start; // Offset of the first character (the quote for literals)
+    Token() : type(T_EOF), line(0), symbol(-1), start(0) {}
+    Token(TokenType type, string_view value, int line, int symbol = -1)
+        : type(type), value(value), line(line), symbol(symbol), start(0) {}
 };
 
-class SymbolTable
+// Whole source file in memory. Regular files are mapped read-only, anything
+// that cannot be mapped (pipes, empty files, Windows) is streamed into a string.
+class SourceFile
 {
 private:
-    map<string, string> symbolTable;
+    const char *mapped = nullptr;
+    size_t mappedSize = 0;
+    string buffer;
+
 public:
-    void declareVariable(const string &name, const string &type)
+    SourceFile() = default;
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    ~SourceFile()
     {
-        if (symbolTable.find(name) != symbolTable.end())
-        {
-            throw runtime_error("Semantic error: Variable '" + name + "' is already declared.");
-        }
-        symbolTable[name] = type;
+#ifndef _WIN32
+        if (mapped)
+            munmap((void *)mapped, mappedSize);
+#endif
     }
 
-    string getVariableType(const string &name)
+    bool load(const char *path)
     {
-        if (symbolTable.find(name) == symbolTable.end())
+#ifndef _WIN32
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
         {
-            throw runtime_error("Semantic error: Variable '" + name + "' is not declared.");
+            void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+                mapped = (const char *)data;
+                mappedSize = (size_t)st.st_size;
+                close(fd);
+                return true;
+            }
         }
-        return symbolTable[name];
-    }
-
-    bool isDeclared(const string &name) const
-    {
-        return symbolTable.find(name) != symbolTable.end();
+        close(fd);
+#endif
+        return readStream(path);
     }
-};
-
-class IntermediateCodeGnerator
-{
-public:
-    vector<string> instructions;
-    int tempCount = 0;
 
-    string newTemp()
+    string_view text() const
     {
-        return "t" + to_string(tempCount++);
+        return mapped ? string_view(mapped, mappedSize) : string_view(buffer);
     }
 
-    void addInstruction(const string &instr)
+private:
+    bool readStream(const char *path)
     {
-        instructions.push_back(instr);
-    }
+        FILE *file = fopen(path, "rb");
+        if (!file)
+            return false;
 
-    void printInstructions()
-    {
-        cout << "Intermediate Code Generated" << endl;
-        cout << "------------------------------------------------" << endl;
-        for (const auto &instr : instructions)
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
         {
-            cout << instr << endl;
+            buffer.append(chunk, n);
         }
-        cout << endl;
-    }
-
-    vector<string> getInstructions()
-    {
-        return this->instructions;
+        fclose(file);
+        return true;
     }
 };
 
-class Lexer
+// Maps every distinct identifier and literal text to a dense integer id.
+// The lexer interns as it scans, so later phases only compare and index
+// ints; names are looked up again only when printing TAC or assembly.
+class StringInterner
 {
 private:
-    string src;
-    size_t pos;
-    int line;
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    vector<string_view> names;
+    vector<uint32_t> hashes;
+    vector<int> slots; // Open addressing, -1 = empty, capacity is a power of two
+    vector<unique_ptr<char[]>> blocks; // Owned copies of the text, never moved
+    char *block = nullptr;
+    size_t blockUsed = BLOCK_SIZE;
 
 public:
-    Lexer(const string &src)
-    {
-        this->src = src;
-        this->pos = 0;
-        this->line = 1;
-    }
+    StringInterner() : slots(1024, -1) {}
+    StringInterner(const StringInterner &) = delete;
+    StringInterner &operator=(const StringInterner &) = delete;
 
-    vector<Token> tokenize()
+    int intern(string_view text)
     {
-        vector<Token> tokens;
-        while (pos < src.size())
+        uint32_t hash = hashOf(text);
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i] != -1)
         {
-            char current = src[pos];
-
-            // Handle whitespace and new lines
-            if (isspace(current))
-            {
-                if (current == '\n')
-                    line++;
-                pos++;
-                continue;
-            }
-
-            // Handle numeric literals
-            if (isdigit(current))
-            {
-                tokens.push_back(Token{T_NUM, consumeNumber(), line});
-                continue;
-            }
-
-            // Handle keywords and identifiers
-            if (isalpha(current))
-            {
-                string word = consumeWord();
-                if (word == "int")
-                    tokens.push_back(Token{T_INT, word, line});
-                else if (word == "float")
-                    tokens.push_back(Token{T_FLOAT, word, line});
-                else if (word == "double")
-                    tokens.push_back(Token{T_DOUBLE, word, line});
-                else if (word == "string")
-                    tokens.push_back(Token{T_STRING, word, line});
-                else if (word == "bool")
-                    tokens.push_back(Token{T_BOOL, word, line});
-                else if (word == "true")
-                    tokens.push_back(Token{T_TRUE, word, line});
-                else if (word == "false")
-                    tokens.push_back(Token{T_FALSE, word, line});
-                else if (word == "char")
-                    tokens.push_back(Token{T_CHAR, word, line});
-                else if (word == "if" || word == "agar")
-                    tokens.push_back(Token{T_IF, word, line});
-                else if (word == "else")
-                    tokens.push_back(Token{T_ELSE, word, line});
-                else if (word == "return")
-                    tokens.push_back(Token{T_RETURN, word, line});
-                else if (word == "while")
-                    tokens.push_back(Token{T_WHILE, word, line});
-                else if (word == "for")
-                    tokens.push_back(Token{T_FOR, word, line});
-                else if (word == "switch")
-                    tokens.push_back(Token{T_SWITCH, word, line});
-                else if (word == "case")
-                    tokens.push_back(Token{T_CASE, word, line});
-                else if (word == "break")
-                    tokens.push_back(Token{T_BREAK, word, line});
-                else if (word == "continue")
-                    tokens.push_back(Token{T_CONTINUE, word, line});
-                else if (word == "print")
-                    tokens.push_back(Token{T_PRINT, word, line});
-                else
-                    tokens.push_back(Token{T_ID, word, line});
-                continue;
-            }
-
-            // Handle string literals
-            if (current == '"')
-            {
-                tokens.push_back(Token{T_STRING, consumeStringLiteral(), line});
-                continue;
-            }
-
-            // Handle char literals
-            if (current == '\'')
-            {
-                tokens.push_back(Token{T_CHAR, consumeCharLiteral(), line});
-                continue;
-            }
-
-            // Handle comments
-            if (current == '/' && peekNext() == '/')
-            {
-                consumeComment();
-                continue;
-            }
-
-            // Handle operators and other symbols
-            switch (current)
-            {
-            case '=':
-                if (peekNext() == '=') // Handle ==
-                {
-                    pos++;
-                    tokens.push_back(Token{T_EQUAL_EQUAL, "==", line});
-                }
-                else
-                {
-                    tokens.push_back(Token{T_ASSIGN, "=", line});
-                }
-                break;
-            case '!':
-                if (peekNext() == '=') // Handle !=
-                {
-                    pos++;
-                    tokens.push_back(Token{T_NOT_EQUAL, "!=", line});
-                }
-                else
-                {
-                    cout << "Unexpected character " << current << " at line " << line << endl;
-                    exit(1);
-                }
-                break;
-            case '&':
-                if (peekNext() == '&') // Handle &&
-                {
-                    pos++;
-                    tokens.push_back(Token{T_AND, "&&", line});
-                }
-                else
-                {
-                    cout << "Unexpected character " << current << " at line " << line << endl;
-                    exit(1);
-                }
-                break;
-            case '|':
-                if (peekNext() == '|') // Handle ||
-                {
-                    pos++;
-                    tokens.push_back(Token{T_OR, "||", line});
-                }
-                else
-                {
-                    cout << "Unexpected character " << current << " at line " << line << endl;
-                    exit(1);
-                }
-                break;
-            case '>':
-                if (peekNext() == '=') // Handle >=
-                {
-                    pos++;
-                    tokens.push_back(Token{T_GREATER_EQUAL, ">=", line});
-                }
-                else
-                {
-                    tokens.push_back(Token{T_GREATER, ">", line});
-                }
-                break;
-            case '<':
-                if (peekNext() == '=') // Handle <=
-                {
-                    pos++;
-                    tokens.push_back(Token{T_LESS_EQUAL, "<=", line});
-                }
-                else
-                {
-                    tokens.push_back(Token{T_LESS, "<", line});
-                }
-                break;
-            case '+':
-                tokens.push_back(Token{T_PLUS, "+", line});
-                break;
-            case '-':
-                tokens.push_back(Token{T_MINUS, "-", line});
-                break;
-            case '*':
-                tokens.push_back(Token{T_MUL, "*", line});
-                break;
-            case '/':
-                tokens.push_back(Token{T_DIV, "/", line});
-                break;
-            case '(':
-                tokens.push_back(Token{T_LPAREN, "(", line});
-                break;
-            case ')':
-                tokens.push_back(Token{T_RPAREN, ")", line});
-                break;
-            case '{':
-                tokens.push_back(Token{T_LBRACE, "{", line});
-                break;
-            case '}':
-                tokens.push_back(Token{T_RBRACE, "}", line});
-                break;
-            case ';':
-                tokens.push_back(Token{T_SEMICOLON, ";", line});
-                break;
-            case ':':
-                tokens.push_back(Token{T_COLON, ":", line});
-                break;
-            default:
-                cout << "Unexpected character " << current << " at line " << line << endl;
-                exit(1);
-            }
-            pos++;
+            int id = slots[i];
+            if (hashes[id] == hash && names[id] == text)
+                return id;
+            i = (i + 1) & mask;
         }
 
-        tokens.push_back(Token{T_EOF, "", line});
-        return tokens;
+        int id = (int)names.size();
+        names.push_back(store(text));
+        hashes.push_back(hash);
+        slots[i] = id;
+        if (names.size() * 2 > slots.size())
+            grow();
+        return id;
     }
 
-    string consumeNumber()
+    string_view name(int id) const
     {
-        size_t start = pos;
-        while (pos < src.size() && isdigit(src[pos]))
-            pos++;
-        if (pos < src.size() && src[pos] == '.')
-        {
-            pos++;
-            while (pos < src.size() && isdigit(src[pos]))
-                pos++;
-        }
-        return src.substr(start, pos - start);
+        return names[id];
     }
 
-    string consumeWord()
+    int size() const
     {
-        size_t start = pos;
-        while (pos < src.size() && isalnum(src[pos]))
-            pos++;
-        return src.substr(start, pos - start);
+        return (int)names.size();
     }
 
-    string consumeStringLiteral()
+private:
+    static uint32_t hashOf(string_view text)
     {
-        pos++;
-        size_t start = pos;
-        while (pos < src.size() && src[pos] != '"')
-            pos++;
-        pos++;
-        return src.substr(start, pos - start - 1);
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (char ch : text)
+        {
+            hash ^= (unsigned char)ch;
+            hash *= 16777619u;
+        }
+        return hash;
     }
 
-    string consumeCharLiteral()
+    string_view store(string_view text)
     {
-        pos++;
-        if (pos >= src.size() || src[pos] == '\'')
+        if (text.empty())
+            return string_view();
+        if (text.size() > BLOCK_SIZE / 4)
         {
-            cout << "Syntax error: empty or invalid char literal at line " << line << endl;
-            exit(1);
+            blocks.emplace_back(new char[text.size()]);
+            memcpy(blocks.back().get(), text.data(), text.size());
+            return string_view(blocks.back().get(), text.size());
         }
-
-        char literal = src[pos];
-        pos++;
-
-        if (pos >= src.size() || src[pos] != '\'')
+        if (blockUsed + text.size() > BLOCK_SIZE)
         {
-            cout << "Syntax error: expected closing single quote at line " << line << endl;
-            exit(1);
+            blocks.emplace_back(new char[BLOCK_SIZE]);
+            block = blocks.back().get();
+            blockUsed = 0;
         }
-
-        pos++;
-        return string(1, literal);
+        char *dst = block + blockUsed;
+        memcpy(dst, text.data(), text.size());
+        blockUsed += text.size();
+        return string_view(dst, text.size());
     }
 
-    void consumeComment()
+    void grow()
     {
-        pos += 2;
-        while (pos < src.size() && src[pos] != '\n')
+        vector<int> bigger(slots.size() * 2, -1);
+        size_t mask = bigger.size() - 1;
+        for (int id = 0; id < (int)names.size(); id++)
         {
-            pos++;
+            size_t i = hashes[id] & mask;
+            while (bigger[i] != -1)
+                i = (i + 1) & mask;
+            bigger[i] = id;
         }
+        slots.swap(bigger);
     }
+};
 
-    char peekNext()
-    {
-        return pos + 1 < src.size() ? src[pos + 1] : '\0';
-    }
+enum ValueType
+{
+    VT_INT,
+    VT_FLOAT,
+    VT_STRING,
+    VT_CHAR,
+    VT_BOOL
 };
 
-class Parser
+// Block-scoped symbol table. Every declaration gets a dense variable id and
+// `innermost` maps an interned symbol straight to the declaration currently
+// visible, so a lookup is one array index. Leaving a scope only touches the
+// declarations made inside it. An inner declaration may shadow an outer one,
+// redeclaring in the same scope is an error.
+class SymbolTable
 {
 private:
-    vector<Token> tokens;
-    size_t pos;
-    SymbolTable &symTable;
-    IntermediateCodeGnerator &icg;
-
-public:
-    Parser(const vector<Token> &tokens, SymbolTable &symTable, IntermediateCodeGnerator &icg)
-        : tokens(tokens), pos(0), symTable(symTable), icg(icg) {}
+    struct Declaration
+    {
+        int symbol;
+        ValueType type;
+        int shadowed; // Declaration this one hides, -1 if none
+    };
 
-    void parseProgram()
+    struct Scope
     {
-        while (tokens[pos].type != T_EOF)
-        {
-            parseStatement();
-        }
-        cout << endl;
-        cout << "------------------------------------------------" << endl;
-        cout << "Parsing completed successfully! No Syntax Error" << endl;
-        cout << "------------------------------------------------" << endl;
+        size_t visibleStart;
+        int firstVariable;
+    };
+
+    const StringInterner &names;
+    vector<Declaration> declarations; // Indexed by variable id, never shrinks
+    vector<int> innermost;            // Indexed by symbol, -1 = not visible
+    vector<int> visible;              // Variable ids in scope, innermost scope last
+    vector<Scope> scopes;
+    vector<pair<int, int>> *lookupLog = nullptr;
+    int logBefore = 0;
 
-        icg.printInstructions();
+public:
+    SymbolTable(const StringInterner &names) : names(names)
+    {
+        pushScope(); // Global scope
     }
 
-    vector<string> getIntermediateCode()
+    void pushScope()
     {
-        return icg.getInstructions();
+        scopes.push_back(Scope{visible.size(), (int)declarations.size()});
     }
 
-private:
-    void parseStatement()
+    void popScope()
     {
-        if (tokens[pos].type == T_INT || tokens[pos].type == T_FLOAT || tokens[pos].type == T_DOUBLE ||
-            tokens[pos].type == T_STRING || tokens[pos].type == T_BOOL || tokens[pos].type == T_CHAR)
-        {
-            parseDeclaration();
-        }
-        else if (tokens[pos].type == T_ID)
-        {
-            parseAssignment();
-        }
-        else if (tokens[pos].type == T_IF)
-        {
-            parseIfStatement();
-        }
-        else if (tokens[pos].type == T_WHILE)
-        {
-            parseWhileStatement();
-        }
-        else if (tokens[pos].type == T_FOR)
+        size_t start = scopes.back().visibleStart;
+        scopes.pop_back();
+        while (visible.size() > start)
         {
-            parseForStatement();
+            const Declaration &decl = declarations[visible.back()];
+            innermost[decl.symbol] = decl.shadowed;
+            visible.pop_back();
         }
-        else if (tokens[pos].type == T_SWITCH)
+    }
+
+    // Returns the new variable id
+    int declareVariable(int symbol, ValueType type)
+    {
+        int current = lookup(symbol);
+        if (current >= scopes.back().firstVariable)
         {
-            parseSwitchStatement();
+            throw runtime_error("Semantic error: Variable '" + string(names.name(symbol)) + "' is already declared.");
         }
-        else if (tokens[pos].type == T_RETURN)
+        if (symbol >= (int)innermost.size())
         {
-            parseReturnStatement();
+            innermost.resize(symbol + 1, -1);
         }
-        else if (tokens[pos].type == T_PRINT)
+
+        int variable = (int)declarations.size();
+        declarations.push_back(Declaration{symbol, type, current});
+        innermost[symbol] = variable;
+        visible.push_back(variable);
+        return variable;
+    }
+
+    // Re-enters a global declaration from an earlier incremental run under
+    // its original variable id
+    void restoreGlobal(int variable, int symbol, ValueType type)
+    {
+        reserveVariables(variable + 1);
+        if (symbol >= (int)innermost.size())
         {
-            parsePrintStatement();
+            innermost.resize(symbol + 1, -1);
         }
-        else if (tokens[pos].type == T_LBRACE)
+        declarations[variable] = Declaration{symbol, type, innermost[symbol]};
+        innermost[symbol] = variable;
+        visible.push_back(variable);
+    }
+
+    // Makes the next declaration get an id of at least `count`
+    void reserveVariables(int count)
+    {
+        if (count > (int)declarations.size())
         {
-            parseBlock();
+            declarations.resize(count, Declaration{-1, VT_INT, -1});
         }
-        else
+    }
+
+    // Variable id visible for the symbol, -1 if none
+    int lookup(int symbol) const
+    {
+        int variable = symbol < (int)innermost.size() ? innermost[symbol] : -1;
+        if (lookupLog && variable < logBefore)
         {
-            cout << "Syntax error: unexpected token " << tokens[pos].value << " on line " << tokens[pos].line << endl;
-            exit(1);
+            lookupLog->push_back({symbol, variable});
         }
+        return variable;
     }
 
-    void parseWhileStatement()
+    // Appends (symbol, variable) to `log` for every lookup that does not
+    // resolve to a declaration made after this call; nullptr stops logging
+    void logLookups(vector<pair<int, int>> *log)
     {
-        expect(T_WHILE);
-        expect(T_LPAREN);
-        string condition = parseExpression();
-        expect(T_RPAREN);
-        expect(T_LBRACE);
-
-        string startLabel = icg.newTemp();
-        string endLabel = icg.newTemp();
-        icg.addInstruction(startLabel + ":");
+        lookupLog = log;
+        logBefore = (int)declarations.size();
+    }
 
-        icg.addInstruction("ifFalse " + condition + " goto " + endLabel);
+    ValueType getVariableType(int variable) const
+    {
+        return declarations[variable].type;
+    }
 
-        while (tokens[pos].type != T_RBRACE)
-        {
-            parseStatement();
-        }
+    int getVariableSymbol(int variable) const
+    {
+        return declarations[variable].symbol;
+    }
 
-        icg.addInstruction("goto " + startLabel);
-        icg.addInstruction(endLabel + ":");
+    bool shadows(int variable) const
+    {
+        return declarations[variable].shadowed != -1;
+    }
 
-        expect(T_RBRACE);
+    bool isDeclared(int symbol) const
+    {
+        return lookup(symbol) != -1;
     }
 
-    void parseForStatement()
+    size_t size() const
     {
-        expect(T_FOR);
-        expect(T_LPAREN);
+        return declarations.size();
+    }
+};
 
-        // Handle initialization: declaration, assignment, or empty
-        if (tokens[pos].type == T_INT || tokens[pos].type == T_FLOAT || tokens[pos].type == T_DOUBLE ||
-            tokens[pos].type == T_STRING || tokens[pos].type == T_BOOL || tokens[pos].type == T_CHAR)
-        {
-            parseDeclaration(); // Handle variable declaration
-        }
-        else if (tokens[pos].type == T_ID)
-        {
-            parseAssignment(); // Handle assignment to existing variable
-        }
-        else
-        {
-            expect(T_SEMICOLON); // Allow empty initialization
-        }
+// Operand kinds of a quadruple. Variables use their SymbolTable variable id,
+// constants index IntermediateCodeGnerator::constants, tables index
+// IntermediateCodeGnerator::jumpTables, temps and labels are just counters.
+enum OperandKind
+{
+    OPND_NONE,
+    OPND_TEMP,
+    OPND_VAR,
+    OPND_CONST,
+    OPND_LABEL,
+    OPND_TABLE
+};
 
-        // Parse the loop condition
-        string condition = parseExpression();
-        expect(T_SEMICOLON);
+struct Operand
+{
+    OperandKind kind;
+    int id;
+    Operand() : kind(OPND_NONE), id(-1) {}
+    Operand(OperandKind kind, int id) : kind(kind), id(id) {}
 
-        // Handle the increment part of the for loop
-        string increment;
-        if (tokens[pos].type != T_RPAREN)
-        {
-            // Special handling for i++ type of expressions
-            if (tokens[pos].type == T_ID && tokens[pos + 1].type == T_PLUS && tokens[pos + 2].type == T_PLUS)
-            {
-                increment = tokens[pos].value + tokens[pos + 1].value + tokens[pos + 2].value; // Handle i++
-                pos += 3;                                                                      // Skip the `i++`
-            }
-            else
-            {
-                increment = parseExpression(); // Parse regular expression if not i++
-            }
-        }
-        expect(T_RPAREN);
+    bool operator==(const Operand &other) const { return kind == other.kind && id == other.id; }
+    bool operator!=(const Operand &other) const { return !(*this == other); }
+};
 
-        // Parse the loop body
-        expect(T_LBRACE);
+enum OpCode
+{
+    OP_ASSIGN, // dst = src1
+
+    // dst = src1 op src2
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+
+    OP_LABEL,      // dst:
+    OP_GOTO,       // goto dst
+    OP_IF_FALSE,   // ifFalse src1 goto dst
+    OP_IF_NE,      // if (src1 != src2) goto dst
+    OP_JUMP_TABLE, // goto entry src1 - low of table src2, dst if out of range
+    OP_PRINT       // print src1
+};
 
-        string startLabel = icg.newTemp();
-        string endLabel = icg.newTemp();
-        icg.addInstruction(startLabel + ":");
+struct Quad
+{
+    OpCode op;
+    Operand dst;
+    Operand src1;
+    Operand src2;
+    Quad(OpCode op, Operand dst, Operand src1 = Operand(), Operand src2 = Operand())
+        : op(op), dst(dst), src1(src1), src2(src2) {}
+};
 
-        icg.addInstruction("ifFalse " + condition + " goto " + endLabel);
+struct Constant
+{
+    ValueType type;
+    int symbol; // Literal as written in the source, without quotes
+};
 
-        while (tokens[pos].type != T_RBRACE)
-        {
-            parseStatement();
-        }
+// Dense switch dispatch: entry i is the target for value low + i
+struct JumpTable
+{
+    int label; // Names the table in the assembly
+    int low;
+    vector<int> targets;
+};
 
-        // If there is an increment statement, add it to the instructions
-        if (!increment.empty())
-        {
-            icg.addInstruction(increment);
-        }
+inline bool isBinaryOp(OpCode op)
+{
+    return op >= OP_ADD && op <= OP_GE;
+}
 
-        icg.addInstruction("goto " + startLabel);
-        icg.addInstruction(endLabel + ":");
+inline bool isComparisonOp(OpCode op)
+{
+    return op >= OP_EQ && op <= OP_GE;
+}
 
-        expect(T_RBRACE);
-    }
+inline bool isJumpOp(OpCode op)
+{
+    return op == OP_GOTO || op == OP_IF_FALSE || op == OP_IF_NE || op == OP_JUMP_TABLE;
+}
 
-    void parseSwitchStatement()
-    {
-        expect(T_SWITCH); // Consume the 'switch' keyword
-        expect(T_LPAREN); // Consume the opening parenthesis for the expression
-
-        // Parse the switch expression (condition for the switch)
-        string switchCondition = parseExpression();
-        expect(T_RPAREN); // Consume the closing parenthesis
-
-        expect(T_LBRACE); // Consume the opening brace for the block
-
-        string endLabel = icg.newTemp(); // Label for end of switch statement
-        bool hasDefault = false;         // Track if we have a default case
-
-        // Parse case statements
-        while (tokens[pos].type == T_CASE)
-        {
-            parseCaseStatement(switchCondition, endLabel);
-        }
+// Jumps that never fall through to the next instruction
+inline bool isUnconditionalJump(OpCode op)
+{
+    return op == OP_GOTO || op == OP_JUMP_TABLE;
+}
 
-        icg.addInstruction(endLabel + ":"); // Jump to end label after all cases
+// Instructions that store into dst
+inline bool isDefinitionOp(OpCode op)
+{
+    return op == OP_ASSIGN || isBinaryOp(op);
+}
 
-        expect(T_RBRACE); // Consume the closing brace for the block
-    }
-    
-    void parseCaseStatement(const string &switchCondition, const string &endLabel)
+inline const char *opCodeToString(OpCode op)
+{
+    switch (op)
     {
-        expect(T_CASE); // Consume the 'case' keyword
-
-        string caseValue = parseExpression(); // Parse the value for the case
-        expect(T_COLON);                      // Expect the colon after the case value
+    case OP_ADD:
+        return "+";
+    case OP_SUB:
+        return "-";
+    case OP_MUL:
+        return "*";
+    case OP_DIV:
+        return "/";
+    case OP_EQ:
+        return "==";
+    case OP_NE:
+        return "!=";
+    case OP_LT:
+        return "<";
+    case OP_GT:
+        return ">";
+    case OP_LE:
+        return "<=";
+    case OP_GE:
+        return ">=";
+    default:
+        return "";
+    }
+}
 
-        string caseLabel = icg.newTemp();                                                          // Generate a label for this case
-        icg.addInstruction("if (" + switchCondition + " != " + caseValue + ") goto " + caseLabel); // Check if this case matches
-        icg.addInstruction("goto " + endLabel);                                                    // If it doesn't match, jump to the end
+class IntermediateCodeGnerator
+{
+public:
+    StringInterner &strings;
+    vector<Quad> instructions;
+    vector<int> variableSymbols;     // Indexed by variable id
+    vector<ValueType> variableTypes; // Indexed by variable id
+    vector<Constant> constants;
+    vector<JumpTable> jumpTables;
+    vector<ValueType> tempTypes;
+    vector<bool> tempUsed; // False for ids skipped by beginFragment
+    int tempCount = 0;
+    int labelCount = 0;
 
-        icg.addInstruction(caseLabel + ":"); // Label for this case
-        parseStatement();                    // Parse the statement(s) for this case
+    IntermediateCodeGnerator(StringInterner &strings) : strings(strings) {}
 
-        // Check for the break statement inside the case block
-        if (tokens[pos].type == T_BREAK)
-        {
-            expect(T_BREAK);                        // Consume 'break'
-            expect(T_SEMICOLON);                    // Consume the semicolon after the break
-            icg.addInstruction("goto " + endLabel); // Exit the switch after the break
-        }
-        icg.addInstruction("goto " + endLabel); // After case execution, jump to the end
+    Operand newTemp(ValueType type = VT_INT)
+    {
+        tempTypes.push_back(type);
+        tempUsed.push_back(true);
+        return Operand(OPND_TEMP, tempCount++);
     }
 
-    void parseCaseStatement()
+    Operand newLabel()
     {
-        expect(T_CASE);
-        parseExpression();
-        expect(T_COLON);
-        parseStatement();
+        return Operand(OPND_LABEL, labelCount++);
     }
 
-    void parseReturnStatement()
+    Operand newJumpTable(int low, vector<int> targets)
     {
-        expect(T_RETURN);
-        if (tokens[pos].type != T_SEMICOLON)
-        {
-            parseExpression();
-        }
-        expect(T_SEMICOLON);
+        jumpTables.push_back(JumpTable{newLabel().id, low, move(targets)});
+        return Operand(OPND_TABLE, (int)jumpTables.size() - 1);
     }
 
-    void parseIfStatement()
+    // Calls f with the label id of every place a jump may go to
+    template <typename F>
+    void forEachJumpTarget(const Quad &q, F f) const
     {
-        expect(T_IF);
-        expect(T_LPAREN);
-        string condition = parseExpression();
-        expect(T_RPAREN);
-        expect(T_LBRACE);
-
-        string elseLabel = icg.newTemp();
-        string endLabel = icg.newTemp();
-
-        icg.addInstruction("ifFalse " + condition + " goto " + elseLabel);
-
-        while (tokens[pos].type != T_RBRACE)
+        f(q.dst.id);
+        if (q.op == OP_JUMP_TABLE)
         {
-            parseStatement();
+            for (int target : jumpTables[q.src2.id].targets)
+                f(target);
         }
+    }
 
-        icg.addInstruction("goto " + endLabel);
-        icg.addInstruction(elseLabel + ":");
-
-        expect(T_RBRACE);
-
-        if (tokens[pos].type == T_ELSE)
+    Operand declareVariable(int variable, int symbol, ValueType type, bool shadows)
+    {
+        if (variable >= (int)variableSymbols.size())
         {
-            expect(T_ELSE);
-            expect(T_LBRACE);
-            while (tokens[pos].type != T_RBRACE)
-            {
-                parseStatement();
-            }
-            expect(T_RBRACE);
+            variableSymbols.resize(variable + 1, -1);
+            variableTypes.resize(variable + 1, VT_INT);
+            variableShadows.resize(variable + 1, false);
         }
+        variableSymbols[variable] = symbol;
+        variableTypes[variable] = type;
+        variableShadows[variable] = shadows;
+        return Operand(OPND_VAR, variable);
+    }
 
-        icg.addInstruction(endLabel + ":");
+    Operand variable(int variable) const
+    {
+        return Operand(OPND_VAR, variable);
     }
 
-    void parsePrintStatement()
+    int variableCount() const
     {
-        expect(T_PRINT);
-        expect(T_LPAREN);
-        string value = parseExpression();
-        expect(T_RPAREN);
-        expect(T_SEMICOLON);
+        return (int)variableSymbols.size();
+    }
 
-        icg.addInstruction("print " + value);
+    // For a variable no instruction refers to anymore; it gets no storage
+    void releaseVariable(int variable)
+    {
+        variableSymbols[variable] = -1;
     }
 
-    void parseBlock()
+    // A declaration that hides a visible one of the same name gets an id
+    // suffix (source identifiers cannot contain '_', so no clash with user
+    // names). Other same-named variables never overlap in lifetime and share
+    // the plain name.
+    string variableName(int variable) const
     {
-        expect(T_LBRACE);
-        while (tokens[pos].type != T_RBRACE)
-        {
-            parseStatement();
-        }
-        expect(T_RBRACE);
+        string name(strings.name(variableSymbols[variable]));
+        if (variableShadows[variable])
+            name += "_" + to_string(variable);
+        return name;
     }
-    
-    string parseStringOrCharLiteral()
+
+    // Starts numbering temps, labels and constants at the given ids and stops
+    // sharing constants with earlier code. Used by incremental compilation so
+    // a statement keeps its numbering while the statements around it change.
+    void beginFragment(int firstTemp, int firstLabel, int firstConstant)
     {
-        if (tokens[pos].type == T_STRING)
+        if (firstTemp > tempCount)
         {
-            string strValue = tokens[pos].value;
-            expect(T_STRING);
-            return "\"" + strValue + "\""; // Add quotes for string literals
-        }
-        else if (tokens[pos].type == T_CHAR)
-        {
-            string charValue = tokens[pos].value;
-            expect(T_CHAR);
-            return "'" + charValue + "'"; // Add quotes for char literals
+            tempTypes.resize(firstTemp, VT_INT);
+            tempUsed.resize(firstTemp, false);
+            tempCount = firstTemp;
         }
-        else
+        labelCount = max(labelCount, firstLabel);
+        if (firstConstant > (int)constants.size())
         {
-            cout << "Syntax error: expected string or char literal at line " << tokens[pos].line << endl;
-            exit(1);
+            constants.resize(firstConstant, Constant{VT_INT, -1});
         }
+        constantIds.clear();
     }
 
-    void parseDeclaration()
+    // Data needed by code that was generated in an earlier run
+    void restoreTemp(int id, ValueType type)
     {
-        TokenType varType = tokens[pos].type;
-        expect(varType); // Consume the data type token (e.g., T_INT, T_STRING)
-
-        // Store identifier token
-        Token idToken = tokens[pos];
-        expect(T_ID); // Consume the variable identifier
-
-        expect(T_ASSIGN); // Expect '=' for initialization
-
-        // Handle value assignment
-        string value;
-        if (varType == T_STRING || varType == T_CHAR)
-        {
-            value = parseStringOrCharLiteral(); // Parse string or char literal
-        }
-        else
+        if (id >= tempCount)
         {
-            value = parseExpression(); // Parse other types normally
+            tempTypes.resize(id + 1, VT_INT);
+            tempUsed.resize(id + 1, false);
+            tempCount = id + 1;
         }
-
-        // Create and insert symbol
-        symTable.declareVariable(idToken.value, value);
-        icg.addInstruction(idToken.value + " = " + value);
-
-        expect(T_SEMICOLON); // Ensure proper end of declaration
+        tempTypes[id] = type;
+        tempUsed[id] = true;
     }
 
-    string parseAssignment()
+    void restoreConstant(int id, ValueType type, int symbol)
     {
-        // Store identifier token
-        Token idToken = tokens[pos];
-        expect(T_ID);
-
-        // Check if variable exists
-        if (!symTable.isDeclared(idToken.value))
+        if (id >= (int)constants.size())
         {
-            cout << "Error: Variable '" << idToken.value << "' not declared at line "
-                 << idToken.line << endl;
-            exit(1);
+            constants.resize(id + 1, Constant{VT_INT, -1});
         }
+        constants[id] = Constant{type, symbol};
+    }
 
-        expect(T_ASSIGN);
+    Operand constant(ValueType type, int symbol)
+    {
+        int64_t key = (int64_t)symbol * 8 + type;
+        auto it = constantIds.find(key);
+        if (it != constantIds.end())
+            return Operand(OPND_CONST, it->second);
+        int id = (int)constants.size();
+        constants.push_back(Constant{type, symbol});
+        constantIds[key] = id;
+        return Operand(OPND_CONST, id);
+    }
 
-        // Store new value
-        string value = parseExpression();
+    Operand constant(ValueType type, string_view text)
+    {
+        return constant(type, strings.intern(text));
+    }
 
-        // Update symbol table
-        symTable.declareVariable(idToken.value, value);
+    // For a constant no instruction refers to anymore; it gets no storage
+    void releaseConstant(int id)
+    {
+        const Constant &c = constants[id];
+        auto it = constantIds.find((int64_t)c.symbol * 8 + c.type);
+        if (it != constantIds.end() && it->second == id)
+            constantIds.erase(it);
+        constants[id] = Constant{VT_INT, -1};
+    }
 
-        expect(T_SEMICOLON);
+    string_view constantText(int id) const
+    {
+        return strings.name(constants[id].symbol);
+    }
 
-        string instruction = idToken.value + " = " + value;
-        icg.addInstruction(instruction);
-        return instruction;
+    // The value of an int constant operand; false for anything else
+    bool intConstant(const Operand &operand, int64_t &value) const
+    {
+        if (operand.kind != OPND_CONST || constants[operand.id].type != VT_INT)
+            return false;
+        string_view text = constantText(operand.id);
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == errc() && result.ptr == text.data() + text.size();
     }
 
-    string parseExpression()
+    // An int division traps unless the divisor is a constant other than 0
+    // and -1 (INT_MIN / -1 overflows idiv)
+    bool mayFault(const Quad &q) const
     {
-        string left = parsePrimary();
+        if (q.op != OP_DIV || typeOf(q.src1) == VT_FLOAT || typeOf(q.src2) == VT_FLOAT)
+            return false;
+        int64_t divisor;
+        return !intConstant(q.src2, divisor) || divisor == 0 || divisor == -1;
+    }
 
-        while (pos < tokens.size() &&
-               (tokens[pos].type == T_PLUS ||
-                tokens[pos].type == T_MINUS ||
-                tokens[pos].type == T_MUL ||
-                tokens[pos].type == T_DIV ||
-                tokens[pos].type == T_EQUAL_EQUAL ||
-                tokens[pos].type == T_NOT_EQUAL ||
-                tokens[pos].type == T_LESS ||
-                tokens[pos].type == T_GREATER ||
-                tokens[pos].type == T_LESS_EQUAL ||
-                tokens[pos].type == T_GREATER_EQUAL))
+    ValueType typeOf(const Operand &operand) const
+    {
+        switch (operand.kind)
         {
-            TokenType op = tokens[pos].type;
-            expect(op);
-            string right = parsePrimary();
-
-            string temp = icg.newTemp();
-            icg.addInstruction(temp + " = " + left + " " + tokenTypeToString(op) + " " + right);
-            left = temp;
+        case OPND_TEMP:
+            return tempTypes[operand.id];
+        case OPND_VAR:
+            return variableTypes[operand.id];
+        case OPND_CONST:
+            return constants[operand.id].type;
+        default:
+            return VT_INT;
         }
+    }
 
-        return left;
+    void addInstruction(OpCode op, Operand dst, Operand src1 = Operand(), Operand src2 = Operand())
+    {
+        instructions.push_back(Quad(op, dst, src1, src2));
     }
 
-    string parsePrimary()
+    string operandToString(const Operand &operand) const
     {
-        if (tokens[pos].type == T_NUM ||
-            tokens[pos].type == T_ID ||
-            tokens[pos].type == T_TRUE ||
-            tokens[pos].type == T_FALSE ||
-            tokens[pos].type == T_STRING)
+        switch (operand.kind)
         {
-            string value = tokens[pos].value;
-            expect(tokens[pos].type);
-            return value;
+        case OPND_TEMP:
+            return "t" + to_string(operand.id);
+        case OPND_LABEL:
+            return "L" + to_string(operand.id);
+        case OPND_VAR:
+            return variableName(operand.id);
+        case OPND_CONST:
+        {
+            string text(constantText(operand.id));
+            if (constants[operand.id].type == VT_STRING)
+                return "\"" + text + "\"";
+            if (constants[operand.id].type == VT_CHAR)
+                return "'" + text + "'";
+            return text;
         }
-        else
+        default:
+            return "";
+        }
+    }
+
+    string instructionToString(const Quad &q) const
+    {
+        if (isBinaryOp(q.op))
+            return operandToString(q.dst) + " = " + operandToString(q.src1) + " " + opCodeToString(q.op) + " " + operandToString(q.src2);
+
+        switch (q.op)
+        {
+        case OP_ASSIGN:
+            return operandToString(q.dst) + " = " + operandToString(q.src1);
+        case OP_LABEL:
+            return operandToString(q.dst) + ":";
+        case OP_GOTO:
+            return "goto " + operandToString(q.dst);
+        case OP_IF_FALSE:
+            return "ifFalse " + operandToString(q.src1) + " goto " + operandToString(q.dst);
+        case OP_IF_NE:
+            return "if (" + operandToString(q.src1) + " != " + operandToString(q.src2) + ") goto " + operandToString(q.dst);
+        case OP_JUMP_TABLE:
         {
-            cout << "Syntax error in expression on line " << tokens[pos].line << endl;
-            exit(1);
+            const JumpTable &table = jumpTables[q.src2.id];
+            string text = "goto [";
+            for (size_t i = 0; i < table.targets.size(); i++)
+                text += (i ? ", L" : "L") + to_string(table.targets[i]);
+            return text + "][" + operandToString(q.src1) + " - " + to_string(table.low) + "] else " + operandToString(q.dst);
+        }
+        case OP_PRINT:
+            return "print " + operandToString(q.src1);
+        default:
+            return "";
         }
     }
 
-    void expect(TokenType type)
+    void writeInstructions(ostream &out) const
     {
-        if (tokens[pos].type != type)
+        for (const auto &instr : instructions)
         {
-            cout << "Syntax error: expected token of type " << type << ", but got " << tokens[pos].value << " on line: " << tokens[pos].line << endl;
-            exit(1);
+            out << instructionToString(instr) << '\n';
         }
-        pos++;
     }
 
-    string tokenTypeToString(TokenType type)
+    void printInstructions(ostream &out = cout)
     {
-        switch (type)
+        out << "Intermediate Code Generated\n";
+        out << "------------------------------------------------\n";
+        for (const auto &instr : instructions)
         {
-        case T_PLUS:
-            return "+";
-        case T_MINUS:
-            return "-";
-        case T_MUL:
-            return "*";
-        case T_DIV:
-            return "/";
-        case T_EQUAL_EQUAL:
-            return "==";
-        case T_NOT_EQUAL:
-            return "!=";
-        case T_LESS:
-            return "<";
-        case T_GREATER:
-            return ">";
-        case T_LESS_EQUAL:
-            return "<=";
-        case T_GREATER_EQUAL:
-            return ">=";
-        default:
-            return "";
+            out << instructionToString(instr) << '\n';
         }
+        out << '\n';
+    }
+
+    const vector<Quad> &getInstructions() const
+    {
+        return this->instructions;
     }
+
+private:
+    vector<bool> variableShadows; // Indexed by variable id
+    unordered_map<int64_t, int> constantIds;
 };
 
+// Syntax tree between Parser and AstLowering. Nodes live in one growing
+// array and refer to each other by 32-bit index, so a tree is a single
+// allocation that is dropped in one go with reset().
+typedef uint32_t NodeId;
+const NodeId NO_NODE = 0xFFFFFFFFu;
 
-class AssemblyGenerator
+enum NodeKind : uint8_t
+{
+    N_BLOCK,     // a = first statement, chained through next
+    N_DECL,      // subtype = ValueType, a = variable id, b = initializer, c = symbol, flags = DECL_SHADOWS
+    N_ASSIGN,    // a = variable id, b = value
+    N_IF,        // a = condition, b = then block, c = else block
+    N_WHILE,     // a = condition, b = body
+    N_FOR,       // a = init statement, b = condition, c = step, d = body
+    N_SWITCH,    // a = subject, b = first N_CASE, chained through next
+    N_CASE,      // a = value (NO_NODE for default), b = statement, flags = CASE_HAS_BREAK
+    N_RETURN,    // a = value
+    N_PRINT,     // a = value
+    N_INCREMENT, // a = variable id (the `i++` of a for loop)
+    N_BINARY,    // subtype = OpCode, a = left, b = right
+    N_VAR,       // a = variable id
+    N_LITERAL    // subtype = ValueType, a = symbol of the literal text
+};
+
+const uint8_t CASE_HAS_BREAK = 1;
+const uint8_t DECL_SHADOWS = 1; // N_DECL hides a visible declaration of the same name
+
+struct AstNode
+{
+    NodeKind kind;
+    uint8_t subtype;
+    uint8_t flags;
+    int line;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    NodeId next; // Next statement in a block or next case in a switch
+};
+
+class AstArena
 {
 private:
-    vector<string> intermediateCode;
-    unordered_map<string, string> variableTypes;
-    unordered_map<string, string> variableDeclarations;
-    ofstream outputFile;
-    int labelCounter;
-    int tempCounter;
+    vector<AstNode> nodes;
 
 public:
-    AssemblyGenerator(const vector<string> &icg)
-        : intermediateCode(icg), labelCounter(0), tempCounter(0)
+    NodeId add(NodeKind kind, int line, uint8_t subtype = 0)
     {
-        outputFile.open("output.asm");
-        if (!outputFile.is_open())
-        {
-            throw runtime_error("Could not open output.asm file");
-        }
+        nodes.push_back(AstNode{kind, subtype, 0, line, NO_NODE, NO_NODE, NO_NODE, NO_NODE, NO_NODE});
+        return (NodeId)(nodes.size() - 1);
     }
 
-    void generateAssembly()
+    AstNode &operator[](NodeId id)
     {
-        writeHeader();
-        writeDataSection();
-        writeCodeSection();
-        outputFile.close();
-        cout << "Assembly generated in output.asm file" << endl;
+        return nodes[id];
     }
 
-private:
-    void writeHeader()
+    const AstNode &operator[](NodeId id) const
     {
-        outputFile << ".586\n";
-        outputFile << ".model flat, c\n";
-        outputFile << ".stack 4096\n\n";
+        return nodes[id];
+    }
 
-        outputFile << "extern printf:near\n";
-        outputFile << "extern exit:near\n\n";
+    size_t size() const
+    {
+        return nodes.size();
     }
 
-    void writeDataSection()
+    // Drops every node but keeps the storage for the next compilation unit
+    void reset()
     {
-        outputFile << ".data\n";
+        nodes.clear();
+    }
+};
 
-        outputFile << "\t_printIntFormat BYTE \"%d\", 0\n";
-        outputFile << "\t_printFloatFormat BYTE \"%f\", 0\n";
-        outputFile << "\t_printStrFormat BYTE \"%s\", 0\n\n";
+// Character classes for the lexer, built at compile time so scanning never
+// goes through the locale-aware <cctype> functions
+enum CharClass : uint8_t
+{
+    CC_INVALID,
+    CC_SPACE,
+    CC_NEWLINE,
+    CC_DIGIT,
+    CC_ALPHA,
+    CC_DQUOTE,
+    CC_SQUOTE,
+    CC_SLASH,
+    CC_OPERATOR
+};
 
-        // Declare temporary variables and variables
-        for (const auto &decl : variableDeclarations)
-        {
-            const string &varName = decl.first;
-            const string &varType = decl.second;
+constexpr array<uint8_t, 256> makeCharClasses()
+{
+    array<uint8_t, 256> table{};
+    for (int c = 'a'; c <= 'z'; c++)
+        table[c] = CC_ALPHA;
+    for (int c = 'A'; c <= 'Z'; c++)
+        table[c] = CC_ALPHA;
+    for (int c = '0'; c <= '9'; c++)
+        table[c] = CC_DIGIT;
+    table[' '] = table['\t'] = table['\r'] = table['\v'] = table['\f'] = CC_SPACE;
+    table['\n'] = CC_NEWLINE;
+    table['"'] = CC_DQUOTE;
+    table['\''] = CC_SQUOTE;
+    table['/'] = CC_SLASH;
+    for (char c : string_view("=!&|<>+-*(){};:"))
+        table[(unsigned char)c] = CC_OPERATOR;
+    return table;
+}
+
+constexpr array<uint8_t, 256> CHAR_CLASS = makeCharClasses();
+
+inline bool isIdentifierChar(char c)
+{
+    uint8_t cls = CHAR_CLASS[(unsigned char)c];
+    return cls == CC_ALPHA || cls == CC_DIGIT;
+}
 
-            if (varType == "int")
-            {
-                outputFile << "\t" << varName << " DWORD 0\n";
-            }
-            else if (varType == "float" || varType == "double")
-            {
-                outputFile << "\t" << varName << " REAL4 0.0\n";
-            }
-        }
-        outputFile << "\n";
-    }
+inline bool isDigitChar(char c)
+{
+    return CHAR_CLASS[(unsigned char)c] == CC_DIGIT;
+}
 
-    void writeCodeSection()
-    {
-        outputFile << ".code\n";
-        outputFile << "main PROC\n";
+// Operator transitions: the token for the character alone, and the token
+// when it is followed by `second` (T_EOF marks "not allowed")
+struct OperatorRule
+{
+    TokenType single;
+    char second;
+    TokenType pair;
+};
 
-        for (const auto &instruction : intermediateCode)
-        {
-            processInstruction(instruction);
-        }
+constexpr array<OperatorRule, 256> makeOperatorRules()
+{
+    array<OperatorRule, 256> table{};
+    for (auto &rule : table)
+        rule = OperatorRule{T_EOF, '\0', T_EOF};
+    table['='] = OperatorRule{T_ASSIGN, '=', T_EQUAL_EQUAL};
+    table['!'] = OperatorRule{T_EOF, '=', T_NOT_EQUAL};
+    table['&'] = OperatorRule{T_EOF, '&', T_AND};
+    table['|'] = OperatorRule{T_EOF, '|', T_OR};
+    table['>'] = OperatorRule{T_GREATER, '=', T_GREATER_EQUAL};
+    table['<'] = OperatorRule{T_LESS, '=', T_LESS_EQUAL};
+    table['+'] = OperatorRule{T_PLUS, '\0', T_EOF};
+    table['-'] = OperatorRule{T_MINUS, '\0', T_EOF};
+    table['*'] = OperatorRule{T_MUL, '\0', T_EOF};
+    table['('] = OperatorRule{T_LPAREN, '\0', T_EOF};
+    table[')'] = OperatorRule{T_RPAREN, '\0', T_EOF};
+    table['{'] = OperatorRule{T_LBRACE, '\0', T_EOF};
+    table['}'] = OperatorRule{T_RBRACE, '\0', T_EOF};
+    table[';'] = OperatorRule{T_SEMICOLON, '\0', T_EOF};
+    table[':'] = OperatorRule{T_COLON, '\0', T_EOF};
+    return table;
+}
+
+constexpr array<OperatorRule, 256> OPERATOR_RULES = makeOperatorRules();
+
+// Bulk scanning kernels used by the lexer. Each one advances from pos over
+// a run of bytes and returns the first position that ends the run (or end).
+// The SSE2/AVX2 versions look at 16/32 bytes per step and hand the final
+// partial block to the scalar version, so they never read past end.
+struct ScanKernels
+{
+    const char *name;
+    size_t (*skipWhitespace)(const char *s, size_t pos, size_t end, int &line); // Spaces and newlines
+    size_t (*skipIdentifier)(const char *s, size_t pos, size_t end);
+    size_t (*skipDigits)(const char *s, size_t pos, size_t end);
+    size_t (*findQuote)(const char *s, size_t pos, size_t end, int &line); // Closing '"'
+    size_t (*findNewline)(const char *s, size_t pos, size_t end);
+};
 
-        outputFile << "\n\t; Program exit\n";
-        outputFile << "\tpush 0\n";
-        outputFile << "\tcall exit\n";
-        outputFile << "main ENDP\n";
-        outputFile << "END main\n";
+inline size_t skipWhitespaceScalar(const char *s, size_t pos, size_t end, int &line)
+{
+    while (pos < end)
+    {
+        uint8_t cls = CHAR_CLASS[(unsigned char)s[pos]];
+        if (cls == CC_NEWLINE)
+            line++;
+        else if (cls != CC_SPACE)
+            break;
+        pos++;
     }
+    return pos;
+}
 
-    void processInstruction(const string &instruction)
-    {
-        istringstream iss(instruction);
-        string token1, token2, token3, token4;
-        iss >> token1;
+inline size_t skipIdentifierScalar(const char *s, size_t pos, size_t end)
+{
+    while (pos < end && isIdentifierChar(s[pos]))
+        pos++;
+    return pos;
+}
 
-        // Label definition
-        if (token1.back() == ':')
-        {
-            outputFile << token1 << "\n";
-            return;
-        }
+inline size_t skipDigitsScalar(const char *s, size_t pos, size_t end)
+{
+    while (pos < end && isDigitChar(s[pos]))
+        pos++;
+    return pos;
+}
 
-        // Conditional jump
-        if (token1 == "ifFalse")
-        {
-            processConditionalJump(instruction);
-            return;
-        }
+inline size_t findQuoteScalar(const char *s, size_t pos, size_t end, int &line)
+{
+    while (pos < end && s[pos] != '"')
+    {
+        if (s[pos] == '\n')
+            line++;
+        pos++;
+    }
+    return pos;
+}
 
-        // Unconditional jump
-        if (token1 == "goto")
-        {
-            iss >> token2;
-            outputFile << "\tjmp " << token2 << "\n";
-            return;
-        }
+// memchr is already vectorized by every C library we build against
+inline size_t findNewlineScalar(const char *s, size_t pos, size_t end)
+{
+    const void *hit = pos < end ? memchr(s + pos, '\n', end - pos) : nullptr;
+    return hit ? (size_t)((const char *)hit - s) : end;
+}
 
-        // Assignment or comparison
-        if (instruction.find(" = ") != string::npos)
+#ifdef LEXER_SIMD
+
+__attribute__((target("sse2"))) static size_t skipWhitespaceSSE2(const char *s, size_t pos, size_t end, int &line)
+{
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    while (pos + 16 <= end)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+        uint32_t newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        __m128i blank = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+                                     _mm_cmpeq_epi8(v, cr));
+        uint32_t white = (uint32_t)_mm_movemask_epi8(blank) | newlines;
+        if (white != 0xFFFF)
         {
-            processAssignmentOrComparison(instruction);
-            return;
+            unsigned k = (unsigned)__builtin_ctz(~white);
+            line += __builtin_popcount(newlines & ((1u << k) - 1));
+            return skipWhitespaceScalar(s, pos + k, end, line);
         }
+        line += __builtin_popcount(newlines);
+        pos += 16;
+    }
+    return skipWhitespaceScalar(s, pos, end, line);
+}
 
-        // Unhandled instruction
-        outputFile << "\t; Unhandled instruction: " << instruction << "\n";
+__attribute__((target("sse2"))) static inline uint32_t identifierMaskSSE2(__m128i v)
+{
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+    return (uint32_t)_mm_movemask_epi8(_mm_or_si128(alpha, digit));
+}
+
+__attribute__((target("sse2"))) static size_t skipIdentifierSSE2(const char *s, size_t pos, size_t end)
+{
+    while (pos + 16 <= end)
+    {
+        uint32_t ident = identifierMaskSSE2(_mm_loadu_si128((const __m128i *)(s + pos)));
+        if (ident != 0xFFFF)
+            return pos + __builtin_ctz(~ident);
+        pos += 16;
     }
+    return skipIdentifierScalar(s, pos, end);
+}
 
-    void processAssignmentOrComparison(const string &instruction)
+__attribute__((target("sse2"))) static size_t skipDigitsSSE2(const char *s, size_t pos, size_t end)
+{
+    while (pos + 16 <= end)
     {
-        istringstream iss(instruction);
-        string left, eq, right, op;
-        iss >> left >> eq;
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+        uint32_t digits = (uint32_t)_mm_movemask_epi8(digit);
+        if (digits != 0xFFFF)
+            return pos + __builtin_ctz(~digits);
+        pos += 16;
+    }
+    return skipDigitsScalar(s, pos, end);
+}
 
-        // Check if it's a simple assignment
-        if (iss >> right && right.find_first_not_of("0123456789.-") == string::npos)
+__attribute__((target("sse2"))) static size_t findQuoteSSE2(const char *s, size_t pos, size_t end, int &line)
+{
+    const __m128i quote = _mm_set1_epi8('"'), lf = _mm_set1_epi8('\n');
+    while (pos + 16 <= end)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+        uint32_t quotes = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote));
+        uint32_t newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if (quotes)
         {
-            processSimpleAssignment(left, right);
-            return;
+            unsigned k = (unsigned)__builtin_ctz(quotes);
+            line += __builtin_popcount(newlines & ((1u << k) - 1));
+            return pos + k;
         }
+        line += __builtin_popcount(newlines);
+        pos += 16;
+    }
+    return findQuoteScalar(s, pos, end, line);
+}
 
-        // Check if it's a comparison
-        iss.clear();
-        iss.str(instruction);
-        iss >> left >> eq >> right >> op >> right;
-
-        if (isComparisonOperator(op))
+__attribute__((target("avx2"))) static size_t skipWhitespaceAVX2(const char *s, size_t pos, size_t end, int &line)
+{
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    while (pos + 32 <= end)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        __m256i blank = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)),
+                                        _mm256_cmpeq_epi8(v, cr));
+        uint32_t white = (uint32_t)_mm256_movemask_epi8(blank) | newlines;
+        if (white != 0xFFFFFFFFu)
         {
-            processComparison(left, op, right);
-            return;
+            unsigned k = (unsigned)__builtin_ctz(~white);
+            line += __builtin_popcount(newlines & ((1u << k) - 1));
+            return skipWhitespaceScalar(s, pos + k, end, line);
         }
+        line += __builtin_popcount(newlines);
+        pos += 32;
+    }
+    return skipWhitespaceScalar(s, pos, end, line);
+}
+
+__attribute__((target("avx2"))) static size_t skipIdentifierAVX2(const char *s, size_t pos, size_t end)
+{
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i beforeA = _mm256_set1_epi8('a' - 1), afterZ = _mm256_set1_epi8('z' + 1);
+    const __m256i before0 = _mm256_set1_epi8('0' - 1), after9 = _mm256_set1_epi8('9' + 1);
+    while (pos + 32 <= end)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        __m256i lower = _mm256_or_si256(v, caseBit);
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, beforeA), _mm256_cmpgt_epi8(afterZ, lower));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, before0), _mm256_cmpgt_epi8(after9, v));
+        uint32_t ident = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(alpha, digit));
+        if (ident != 0xFFFFFFFFu)
+            return pos + __builtin_ctz(~ident);
+        pos += 32;
+    }
+    return skipIdentifierSSE2(s, pos, end);
+}
 
-        outputFile << "\t; Unhandled complex assignment: " << instruction << "\n";
+__attribute__((target("avx2"))) static size_t skipDigitsAVX2(const char *s, size_t pos, size_t end)
+{
+    const __m256i before0 = _mm256_set1_epi8('0' - 1), after9 = _mm256_set1_epi8('9' + 1);
+    while (pos + 32 <= end)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, before0), _mm256_cmpgt_epi8(after9, v));
+        uint32_t digits = (uint32_t)_mm256_movemask_epi8(digit);
+        if (digits != 0xFFFFFFFFu)
+            return pos + __builtin_ctz(~digits);
+        pos += 32;
     }
+    return skipDigitsScalar(s, pos, end);
+}
 
-    void processSimpleAssignment(const string &left, const string &right)
+__attribute__((target("avx2"))) static size_t findQuoteAVX2(const char *s, size_t pos, size_t end, int &line)
+{
+    const __m256i quote = _mm256_set1_epi8('"'), lf = _mm256_set1_epi8('\n');
+    while (pos + 32 <= end)
     {
-        // Mark variable as declared
-        if (variableDeclarations.find(left) == variableDeclarations.end())
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        uint32_t quotes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote));
+        uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        if (quotes)
         {
-            variableDeclarations[left] = isFloat(right) ? "float" : "int";
+            unsigned k = (unsigned)__builtin_ctz(quotes);
+            line += __builtin_popcount(newlines & ((1u << k) - 1));
+            return pos + k;
         }
-
-        outputFile << "\t; Assignment\n";
-        outputFile << "\tmov eax, " << right << "\n";
-        outputFile << "\tmov [" << left << "], eax\n";
+        line += __builtin_popcount(newlines);
+        pos += 32;
     }
+    return findQuoteSSE2(s, pos, end, line);
+}
+
+#endif
 
-    void processComparison(const string &dest, const string &op, const string &right)
+// Picks the widest kernels the CPU supports, once per process
+inline const ScanKernels &scanKernels()
+{
+    static const ScanKernels kernels = []()
     {
-        // Mark variables
-        variableDeclarations[dest] = "int";
+#ifdef LEXER_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return ScanKernels{"avx2", skipWhitespaceAVX2, skipIdentifierAVX2, skipDigitsAVX2, findQuoteAVX2, findNewlineScalar};
+        if (__builtin_cpu_supports("sse2"))
+            return ScanKernels{"sse2", skipWhitespaceSSE2, skipIdentifierSSE2, skipDigitsSSE2, findQuoteSSE2, findNewlineScalar};
+#endif
+        return ScanKernels{"scalar", skipWhitespaceScalar, skipIdentifierScalar, skipDigitsScalar, findQuoteScalar, findNewlineScalar};
+    }();
+    return kernels;
+}
+
+// Every keyword and alias is listed once here; the perfect hash below is
+// derived from this table at compile time
+struct Keyword
+{
+    string_view text;
+    TokenType type;
+};
 
-        outputFile << "\t; Comparison\n";
-        outputFile << "\tmov eax, [" << dest << "]\n";
-        outputFile << "\tcmp eax, " << right << "\n";
+constexpr Keyword KEYWORDS[] = {
+    {"int", T_INT},
+    {"float", T_FLOAT},
+    {"double", T_DOUBLE},
+    {"string", T_STRING},
+    {"bool", T_BOOL},
+    {"true", T_TRUE},
+    {"false", T_FALSE},
+    {"char", T_CHAR},
+    {"if", T_IF},
+    {"agar", T_IF},
+    {"else", T_ELSE},
+    {"return", T_RETURN},
+    {"while", T_WHILE},
+    {"for", T_FOR},
+    {"switch", T_SWITCH},
+    {"case", T_CASE},
+    {"default", T_DEFAULT},
+    {"break", T_BREAK},
+    {"continue", T_CONTINUE},
+    {"print", T_PRINT},
+};
 
-        string jumpInstruction;
-        if (op == "==")
-            jumpInstruction = "sete";
-        else if (op == "!=")
-            jumpInstruction = "setne";
-        else if (op == "<")
-            jumpInstruction = "setl";
-        else if (op == ">")
-            jumpInstruction = "setg";
-        else if (op == "<=")
-            jumpInstruction = "setle";
-        else if (op == ">=")
-            jumpInstruction = "setge";
+constexpr int KEYWORD_COUNT = sizeof(KEYWORDS) / sizeof(KEYWORDS[0]);
+constexpr int KEYWORD_HASH_BITS = 6;
+constexpr size_t KEYWORD_MAX_LENGTH = 8;
 
-        outputFile << "\t" << jumpInstruction << " al\n";
-        outputFile << "\tmovzx eax, al\n";
-        outputFile << "\tmov [" << dest << "], eax\n";
+constexpr uint32_t keywordHash(string_view word, uint32_t seed)
+{
+    uint32_t h = seed ^ (uint32_t)word.size();
+    h = h * 31 + (unsigned char)word[0];
+    h = h * 31 + (unsigned char)word[word.size() / 2];
+    h = h * 31 + (unsigned char)word[word.size() - 1];
+    return (h * 2654435761u) >> (32 - KEYWORD_HASH_BITS);
+}
+
+constexpr bool keywordSeedIsPerfect(uint32_t seed)
+{
+    bool used[1 << KEYWORD_HASH_BITS] = {};
+    for (const Keyword &keyword : KEYWORDS)
+    {
+        uint32_t slot = keywordHash(keyword.text, seed);
+        if (used[slot])
+            return false;
+        used[slot] = true;
     }
+    return true;
+}
 
-    void processConditionalJump(const string &instruction)
+constexpr uint32_t findKeywordSeed()
+{
+    for (uint32_t seed = 0; seed < 100000; seed++)
     {
-        istringstream iss(instruction);
-        string ifFalse, condition, goto_, label;
-        iss >> ifFalse >> condition >> goto_ >> label;
-
-        outputFile << "\t; Conditional jump\n";
-        outputFile << "\tmov eax, [" << condition << "]\n";
-        outputFile << "\ttest eax, eax\n";
-        outputFile << "\tjz " << label << "\n";
+        if (keywordSeedIsPerfect(seed))
+            return seed;
     }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t KEYWORD_SEED = findKeywordSeed();
+static_assert(KEYWORD_SEED != UINT32_MAX, "no perfect hash seed for the keyword table");
+
+constexpr array<int8_t, 1 << KEYWORD_HASH_BITS> makeKeywordSlots()
+{
+    array<int8_t, 1 << KEYWORD_HASH_BITS> slots{};
+    for (auto &slot : slots)
+        slot = -1;
+    for (int i = 0; i < KEYWORD_COUNT; i++)
+        slots[keywordHash(KEYWORDS[i].text, KEYWORD_SEED)] = (int8_t)i;
+    return slots;
+}
+
+constexpr array<int8_t, 1 << KEYWORD_HASH_BITS> KEYWORD_SLOTS = makeKeywordSlots();
+
+// One hash and one compare: T_ID unless the word is a keyword
+inline TokenType classifyWord(string_view word)
+{
+    if (word.size() > KEYWORD_MAX_LENGTH)
+        return T_ID;
+    int index = KEYWORD_SLOTS[keywordHash(word, KEYWORD_SEED)];
+    if (index >= 0 && KEYWORDS[index].text == word)
+        return KEYWORDS[index].type;
+    return T_ID;
+}
 
-    bool isComparisonOperator(const string &op)
+class Lexer
+{
+private:
+    string_view src;
+    size_t pos;
+    size_t tokenStart;
+    int line;
+    StringInterner &strings;
+    const ScanKernels &scan;
+    size_t tokenCount = 0;
+    bool timed = false; // Accumulate time spent in next() (costs two clock reads per token)
+    chrono::steady_clock::duration lexTime{0};
+
+public:
+    // Lexing can start at any token boundary, given the line number there
+    Lexer(string_view src, StringInterner &strings, size_t start = 0, int line = 1)
+        : strings(strings), scan(scanKernels())
     {
-        return op == "==" || op == "!=" || op == "<" || op == ">" ||
-               op == "<=" || op == ">=";
+        this->src = src;
+        this->pos = start;
+        this->tokenStart = start;
+        this->line = line;
     }
 
-    bool isFloat(const string &value)
+    // Produces the next token on demand; keeps returning T_EOF at the end
+    Token next()
     {
-        return value.find('.') != string::npos;
+        chrono::steady_clock::time_point begin;
+        if (timed)
+            begin = chrono::steady_clock::now();
+        Token token = scanToken();
+        token.start = tokenStart;
+        tokenCount++;
+        if (timed)
+            lexTime += chrono::steady_clock::now() - begin;
+        return token;
     }
 
-    string newLabel()
+    void enableTiming()
     {
-        return "Label_" + to_string(labelCounter++);
+        timed = true;
     }
 
-    string newTemp()
+    size_t tokensProduced() const
     {
-        return "temp_" + to_string(tempCounter++);
+        return tokenCount;
+    }
+
+    double lexSeconds() const
+    {
+        return chrono::duration<double>(lexTime).count();
+    }
+
+    vector<Token> tokenize()
+    {
+        vector<Token> tokens;
+        do
+        {
+            tokens.push_back(next());
+        } while (tokens.back().type != T_EOF);
+        return tokens;
+    }
+
+private:
+    Token scanToken()
+    {
+        while (pos < src.size())
+        {
+            char current = src[pos];
+            tokenStart = pos;
+
+            switch (CHAR_CLASS[(unsigned char)current])
+            {
+            // Handle whitespace and new lines
+            case CC_NEWLINE:
+            case CC_SPACE:
+                pos = scan.skipWhitespace(src.data(), pos, src.size(), line);
+                continue;
+
+            // Handle numeric literals
+            case CC_DIGIT:
+            {
+                string_view number = consumeNumber();
+                return Token{T_NUM, number, line, strings.intern(number)};
+            }
+
+            // Handle keywords and identifiers
+            case CC_ALPHA:
+            {
+                string_view word = consumeWord();
+                TokenType type = classifyWord(word);
+                bool hasSymbol = type == T_ID || type == T_TRUE || type == T_FALSE;
+                return Token{type, word, line, hasSymbol ? strings.intern(word) : -1};
+            }
+
+            // Handle string literals
+            case CC_DQUOTE:
+            {
+                int startLine = line;
+                string_view literal = consumeStringLiteral();
+                return Token{T_STRING, literal, startLine, strings.intern(literal)};
+            }
+
+            // Handle char literals
+            case CC_SQUOTE:
+            {
+                string_view literal = consumeCharLiteral();
+                return Token{T_CHAR, literal, line, strings.intern(literal)};
+            }
+
+            // Handle comments and division
+            case CC_SLASH:
+                if (peekNext() == '/')
+                {
+                    consumeComment();
+                    continue;
+                }
+                pos++;
+                return Token{T_DIV, src.substr(pos - 1, 1), line};
+
+            // Handle operators and other symbols
+            case CC_OPERATOR:
+            {
+                const OperatorRule &rule = OPERATOR_RULES[(unsigned char)current];
+                if (rule.second != '\0' && peekNext() == rule.second)
+                {
+                    pos += 2;
+                    return Token{rule.pair, src.substr(pos - 2, 2), line};
+                }
+                if (rule.single != T_EOF)
+                {
+                    pos++;
+                    return Token{rule.single, src.substr(pos - 1, 1), line};
+                }
+                throw runtime_error("Unexpected character " + string(1, current) + " at line " + to_string(line));
+            }
+
+            default:
+                throw runtime_error("Unexpected character " + string(1, current) + " at line " + to_string(line));
+            }
+        }
+
+        tokenStart = pos;
+        return Token{T_EOF, "", line};
+    }
+
+    string_view consumeNumber()
+    {
+        size_t start = pos;
+        pos = scan.skipDigits(src.data(), pos, src.size());
+        if (pos < src.size() && src[pos] == '.')
+        {
+            pos = scan.skipDigits(src.data(), pos + 1, src.size());
+        }
+        return src.substr(start, pos - start);
+    }
+
+    string_view consumeWord()
+    {
+        size_t start = pos;
+        pos = scan.skipIdentifier(src.data(), pos, src.size());
+        return src.substr(start, pos - start);
+    }
+
+    string_view consumeStringLiteral()
+    {
+        pos++;
+        size_t start = pos;
+        pos = scan.findQuote(src.data(), pos, src.size(), line);
+        pos++;
+        return src.substr(start, pos - start - 1);
+    }
+
+    string_view consumeCharLiteral()
+    {
+        pos++;
+        if (pos >= src.size() || src[pos] == '\'')
+        {
+            throw runtime_error("Syntax error: empty or invalid char literal at line " + to_string(line));
+        }
+
+        pos++;
+
+        if (pos >= src.size() || src[pos] != '\'')
+        {
+            throw runtime_error("Syntax error: expected closing single quote at line " + to_string(line));
+        }
+
+        pos++;
+        return src.substr(pos - 2, 1);
+    }
+
+    void consumeComment()
+    {
+        pos = scan.findNewline(src.data(), pos + 2, src.size());
+    }
+
+    char peekNext()
+    {
+        return pos + 1 < src.size() ? src[pos + 1] : '\0';
+    }
+};
+
+// Wall-clock spans for --stats and --trace, kept as Chrome trace-event
+// "complete" events; the viewer nests them by time
+class Profiler
+{
+private:
+    struct Span
+    {
+        string name;
+        double start;    // Microseconds since the profiler was created
+        double duration; // Microseconds
+        string args;     // JSON object members, may be empty
+    };
+
+    chrono::steady_clock::time_point origin;
+    vector<Span> spans;
+    bool statementSpans;
+
+public:
+    // Per-statement spans are only worth their cost in a trace
+    explicit Profiler(bool statementSpans) : origin(chrono::steady_clock::now()), statementSpans(statementSpans) {}
+
+    bool wantsStatementSpans() const
+    {
+        return statementSpans;
+    }
+
+    double now() const
+    {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+    }
+
+    size_t begin(const string &name)
+    {
+        spans.push_back(Span{name, now(), 0, ""});
+        return spans.size() - 1;
+    }
+
+    // Returns the span's duration in milliseconds
+    double end(size_t span, const string &args = "")
+    {
+        spans[span].duration = now() - spans[span].start;
+        spans[span].args = args;
+        return spans[span].duration / 1000;
+    }
+
+    // A span whose time was gathered in pieces, e.g. lexing, which runs
+    // interleaved with parsing
+    void add(const string &name, double start, double duration, const string &args = "")
+    {
+        spans.push_back(Span{name, start, duration, args});
+    }
+
+    void writeTrace(const string &path) const
+    {
+        ofstream out(path);
+        if (!out.is_open())
+        {
+            throw runtime_error("Could not open " + path + " file");
+        }
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (size_t i = 0; i < spans.size(); i++)
+        {
+            const Span &span = spans[i];
+            out << (i ? ",\n" : "\n") << "{\"name\":" << jsonString(span.name)
+                << ",\"cat\":\"compile\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << span.start
+                << ",\"dur\":" << span.duration << ",\"args\":{" << span.args << "}}";
+        }
+        out << "\n]}\n";
+    }
+
+    static string jsonString(string_view text)
+    {
+        string quoted = "\"";
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                quoted += '\\';
+                quoted += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                quoted += escape;
+            }
+            else
+            {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+};
+
+class Parser
+{
+private:
+    // Tokens are pulled from the lexer on demand; the ring holds the
+    // lookahead (parseForStatement needs three tokens to spot `i++`)
+    static const int LOOKAHEAD = 4;
+
+    Lexer &lexer;
+    Token ring[LOOKAHEAD];
+    int head;
+    int buffered;
+    SymbolTable &symTable;
+    AstArena &ast;
+    Profiler *profiler = nullptr;
+
+public:
+    Parser(Lexer &lexer, SymbolTable &symTable, AstArena &ast)
+        : lexer(lexer), head(0), buffered(0), symTable(symTable), ast(ast) {}
+
+    // Records a span per top-level statement, with the lexing inside it;
+    // the lexer needs timing enabled
+    void setProfiler(Profiler *profiler)
+    {
+        this->profiler = profiler;
+    }
+
+    // Returns the N_BLOCK holding every top-level statement
+    NodeId parseProgram()
+    {
+        NodeId program = ast.add(N_BLOCK, peek().line);
+        ast[program].a = parseStatementList(T_EOF);
+        return program;
+    }
+
+    // Statement-at-a-time interface for incremental compilation
+    NodeId parseTopLevelStatement()
+    {
+        return parseStatement();
+    }
+
+    bool atEnd()
+    {
+        return peek().type == T_EOF;
+    }
+
+    const Token &upcoming()
+    {
+        return peek();
+    }
+
+private:
+    NodeId parseStatement()
+    {
+        if (peek().type == T_INT || peek().type == T_FLOAT || peek().type == T_DOUBLE ||
+            peek().type == T_STRING || peek().type == T_BOOL || peek().type == T_CHAR)
+        {
+            return parseDeclaration();
+        }
+        else if (peek().type == T_ID)
+        {
+            return parseAssignment();
+        }
+        else if (peek().type == T_IF)
+        {
+            return parseIfStatement();
+        }
+        else if (peek().type == T_WHILE)
+        {
+            return parseWhileStatement();
+        }
+        else if (peek().type == T_FOR)
+        {
+            return parseForStatement();
+        }
+        else if (peek().type == T_SWITCH)
+        {
+            return parseSwitchStatement();
+        }
+        else if (peek().type == T_RETURN)
+        {
+            return parseReturnStatement();
+        }
+        else if (peek().type == T_PRINT)
+        {
+            return parsePrintStatement();
+        }
+        else if (peek().type == T_LBRACE)
+        {
+            return parseBlock();
+        }
+        else
+        {
+            throw runtime_error("Syntax error: unexpected token " + string(peek().value) + " on line " + to_string(peek().line));
+        }
+    }
+
+    // Parses statements up to (not including) `end` and chains them through `next`
+    NodeId parseStatementList(TokenType end)
+    {
+        NodeId first = NO_NODE;
+        NodeId last = NO_NODE;
+        while (peek().type != end)
+        {
+            NodeId statement = end == T_EOF && profiler ? parseTracedStatement() : parseStatement();
+            if (last == NO_NODE)
+                first = statement;
+            else
+                ast[last].next = statement;
+            last = statement;
+        }
+        return first;
+    }
+
+    NodeId parseTracedStatement()
+    {
+        int line = peek().line;
+        double lexBefore = lexer.lexSeconds();
+        size_t tokensBefore = lexer.tokensProduced();
+        size_t span = profiler->begin("statement line " + to_string(line));
+        double start = profiler->now();
+        NodeId statement = parseStatement();
+
+        double lexMicros = (lexer.lexSeconds() - lexBefore) * 1e6;
+        size_t tokens = lexer.tokensProduced() - tokensBefore;
+        profiler->end(span, "\"line\":" + to_string(line) + ",\"tokens\":" + to_string(tokens));
+        // Lexing happens token by token inside the parse; its total is shown
+        // as one child span at the start of the statement
+        profiler->add("lex", start, lexMicros, "\"tokens\":" + to_string(tokens) + ",\"aggregated\":true");
+        return statement;
+    }
+
+    // `{ statements }` as an N_BLOCK with its own scope
+    NodeId parseBlock()
+    {
+        NodeId block = ast.add(N_BLOCK, peek().line);
+        expect(T_LBRACE);
+        symTable.pushScope();
+        ast[block].a = parseStatementList(T_RBRACE);
+        symTable.popScope();
+        expect(T_RBRACE);
+        return block;
+    }
+
+    NodeId parseWhileStatement()
+    {
+        NodeId node = ast.add(N_WHILE, peek().line);
+        expect(T_WHILE);
+        expect(T_LPAREN);
+        ast[node].a = parseExpression();
+        expect(T_RPAREN);
+        ast[node].b = parseBlock();
+        return node;
+    }
+
+    NodeId parseForStatement()
+    {
+        NodeId node = ast.add(N_FOR, peek().line);
+        expect(T_FOR);
+        expect(T_LPAREN);
+        symTable.pushScope(); // The loop variable is only visible inside the loop
+
+        // Handle initialization: declaration, assignment, or empty
+        NodeId init = NO_NODE;
+        if (peek().type == T_INT || peek().type == T_FLOAT || peek().type == T_DOUBLE ||
+            peek().type == T_STRING || peek().type == T_BOOL || peek().type == T_CHAR)
+        {
+            init = parseDeclaration(); // Handle variable declaration
+        }
+        else if (peek().type == T_ID)
+        {
+            init = parseAssignment(); // Handle assignment to existing variable
+        }
+        else
+        {
+            expect(T_SEMICOLON); // Allow empty initialization
+        }
+
+        // Parse the loop condition
+        NodeId condition = parseExpression();
+        expect(T_SEMICOLON);
+
+        // Handle the increment part of the for loop
+        NodeId increment = NO_NODE;
+        if (peek().type != T_RPAREN)
+        {
+            // Special handling for i++ type of expressions
+            if (peek().type == T_ID && peek(1).type == T_PLUS && peek(2).type == T_PLUS)
+            {
+                increment = ast.add(N_INCREMENT, peek().line); // Handle i++
+                ast[increment].a = (uint32_t)resolveVariable(peek());
+                advance(); // Skip the `i++`
+                advance();
+                advance();
+            }
+            else
+            {
+                increment = parseExpression(); // Parse regular expression if not i++
+            }
+        }
+        expect(T_RPAREN);
+
+        // Parse the loop body
+        NodeId body = parseBlock();
+        symTable.popScope();
+
+        AstNode &n = ast[node];
+        n.a = init;
+        n.b = condition;
+        n.c = increment;
+        n.d = body;
+        return node;
+    }
+
+    NodeId parseSwitchStatement()
+    {
+        NodeId node = ast.add(N_SWITCH, peek().line);
+        expect(T_SWITCH); // Consume the 'switch' keyword
+        expect(T_LPAREN); // Consume the opening parenthesis for the expression
+
+        // Parse the switch expression (condition for the switch)
+        ast[node].a = parseExpression();
+        expect(T_RPAREN); // Consume the closing parenthesis
+
+        expect(T_LBRACE); // Consume the opening brace for the block
+        symTable.pushScope();
+
+        // Parse case statements
+        NodeId last = NO_NODE;
+        bool hasDefault = false;
+        while (peek().type == T_CASE || peek().type == T_DEFAULT)
+        {
+            if (peek().type == T_DEFAULT && hasDefault)
+                throw runtime_error("Syntax error: more than one default in switch on line " + to_string(peek().line));
+            hasDefault |= peek().type == T_DEFAULT;
+            NodeId caseNode = parseCaseStatement();
+            if (last == NO_NODE)
+                ast[node].b = caseNode;
+            else
+                ast[last].next = caseNode;
+            last = caseNode;
+        }
+
+        symTable.popScope();
+        expect(T_RBRACE); // Consume the closing brace for the block
+        return node;
+    }
+
+    NodeId parseCaseStatement()
+    {
+        NodeId node = ast.add(N_CASE, peek().line);
+        NodeId value = NO_NODE;
+        if (peek().type == T_DEFAULT)
+        {
+            expect(T_DEFAULT); // Consume the 'default' keyword
+        }
+        else
+        {
+            expect(T_CASE);            // Consume the 'case' keyword
+            value = parseExpression(); // Parse the value for the case
+        }
+        expect(T_COLON); // Expect the colon after the case value
+
+        NodeId body = parseStatement(); // Parse the statement(s) for this case
+        ast[node].a = value;
+        ast[node].b = body;
+
+        // Check for the break statement inside the case block
+        if (peek().type == T_BREAK)
+        {
+            expect(T_BREAK);     // Consume 'break'
+            expect(T_SEMICOLON); // Consume the semicolon after the break
+            ast[node].flags = CASE_HAS_BREAK;
+        }
+        return node;
+    }
+
+    NodeId parseReturnStatement()
+    {
+        NodeId node = ast.add(N_RETURN, peek().line);
+        expect(T_RETURN);
+        if (peek().type != T_SEMICOLON)
+        {
+            ast[node].a = parseExpression();
+        }
+        expect(T_SEMICOLON);
+        return node;
+    }
+
+    NodeId parseIfStatement()
+    {
+        NodeId node = ast.add(N_IF, peek().line);
+        expect(T_IF);
+        expect(T_LPAREN);
+        ast[node].a = parseExpression();
+        expect(T_RPAREN);
+        ast[node].b = parseBlock();
+
+        if (peek().type == T_ELSE)
+        {
+            expect(T_ELSE);
+            ast[node].c = parseBlock();
+        }
+        return node;
+    }
+
+    NodeId parsePrintStatement()
+    {
+        NodeId node = ast.add(N_PRINT, peek().line);
+        expect(T_PRINT);
+        expect(T_LPAREN);
+        ast[node].a = parseExpression();
+        expect(T_RPAREN);
+        expect(T_SEMICOLON);
+        return node;
+    }
+
+    NodeId parseStringOrCharLiteral()
+    {
+        if (peek().type == T_STRING)
+        {
+            NodeId strValue = literal(VT_STRING, peek());
+            expect(T_STRING);
+            return strValue;
+        }
+        else if (peek().type == T_CHAR)
+        {
+            NodeId charValue = literal(VT_CHAR, peek());
+            expect(T_CHAR);
+            return charValue;
+        }
+        else
+        {
+            throw runtime_error("Syntax error: expected string or char literal at line " + to_string(peek().line));
+        }
+    }
+
+    NodeId parseDeclaration()
+    {
+        TokenType varType = peek().type;
+        expect(varType); // Consume the data type token (e.g., T_INT, T_STRING)
+
+        // Store identifier token
+        Token idToken = peek();
+        expect(T_ID); // Consume the variable identifier
+
+        expect(T_ASSIGN); // Expect '=' for initialization
+
+        // Handle value assignment
+        NodeId value;
+        if (varType == T_STRING || varType == T_CHAR)
+        {
+            value = parseStringOrCharLiteral(); // Parse string or char literal
+        }
+        else
+        {
+            value = parseExpression(); // Parse other types normally
+        }
+
+        // Create and insert symbol
+        ValueType type = tokenTypeToValueType(varType);
+        int variable = symTable.declareVariable(idToken.symbol, type);
+
+        expect(T_SEMICOLON); // Ensure proper end of declaration
+
+        NodeId node = ast.add(N_DECL, idToken.line, (uint8_t)type);
+        ast[node].flags = symTable.shadows(variable) ? DECL_SHADOWS : 0;
+        ast[node].a = (uint32_t)variable;
+        ast[node].b = value;
+        ast[node].c = (uint32_t)idToken.symbol;
+        return node;
+    }
+
+    NodeId parseAssignment()
+    {
+        // Store identifier token
+        Token idToken = peek();
+        expect(T_ID);
+
+        // Check if variable exists
+        int variable = resolveVariable(idToken);
+
+        expect(T_ASSIGN);
+
+        // Store new value
+        NodeId value = parseExpression();
+
+        expect(T_SEMICOLON);
+
+        NodeId node = ast.add(N_ASSIGN, idToken.line);
+        ast[node].a = (uint32_t)variable;
+        ast[node].b = value;
+        return node;
+    }
+
+    NodeId parseExpression()
+    {
+        NodeId left = parsePrimary();
+
+        while ((peek().type == T_PLUS ||
+                peek().type == T_MINUS ||
+                peek().type == T_MUL ||
+                peek().type == T_DIV ||
+                peek().type == T_EQUAL_EQUAL ||
+                peek().type == T_NOT_EQUAL ||
+                peek().type == T_LESS ||
+                peek().type == T_GREATER ||
+                peek().type == T_LESS_EQUAL ||
+                peek().type == T_GREATER_EQUAL))
+        {
+            NodeId node = ast.add(N_BINARY, peek().line, (uint8_t)tokenTypeToOpCode(peek().type));
+            expect(peek().type);
+            NodeId right = parsePrimary();
+
+            ast[node].a = left;
+            ast[node].b = right;
+            left = node;
+        }
+
+        return left;
+    }
+
+    NodeId parsePrimary()
+    {
+        Token token = peek();
+        if (token.type == T_NUM)
+        {
+            expect(T_NUM);
+            bool isFloat = token.value.find('.') != string::npos;
+            return literal(isFloat ? VT_FLOAT : VT_INT, token);
+        }
+        else if (token.type == T_ID)
+        {
+            expect(T_ID);
+            NodeId node = ast.add(N_VAR, token.line);
+            ast[node].a = (uint32_t)resolveVariable(token);
+            return node;
+        }
+        else if (token.type == T_TRUE || token.type == T_FALSE)
+        {
+            expect(token.type);
+            return literal(VT_BOOL, token);
+        }
+        else if (token.type == T_STRING)
+        {
+            expect(T_STRING);
+            return literal(VT_STRING, token);
+        }
+        else
+        {
+            throw runtime_error("Syntax error in expression on line " + to_string(peek().line));
+        }
+    }
+
+    int resolveVariable(const Token &idToken)
+    {
+        int variable = symTable.lookup(idToken.symbol);
+        if (variable == -1)
+        {
+            throw runtime_error("Error: Variable '" + string(idToken.value) + "' not declared at line " +
+                                to_string(idToken.line));
+        }
+        return variable;
+    }
+
+    NodeId literal(ValueType type, const Token &token)
+    {
+        NodeId node = ast.add(N_LITERAL, token.line, (uint8_t)type);
+        ast[node].a = (uint32_t)token.symbol;
+        return node;
+    }
+
+    const Token &peek(int offset = 0)
+    {
+        while (buffered <= offset)
+        {
+            ring[(head + buffered) % LOOKAHEAD] = lexer.next();
+            buffered++;
+        }
+        return ring[(head + offset) % LOOKAHEAD];
+    }
+
+    void advance()
+    {
+        peek();
+        head = (head + 1) % LOOKAHEAD;
+        buffered--;
+    }
+
+    void expect(TokenType type)
+    {
+        if (peek().type != type)
+        {
+            throw runtime_error("Syntax error: expected token of type " + to_string(type) + ", but got " +
+                                string(peek().value) + " on line: " + to_string(peek().line));
+        }
+        advance();
+    }
+
+    OpCode tokenTypeToOpCode(TokenType type)
+    {
+        switch (type)
+        {
+        case T_PLUS:
+            return OP_ADD;
+        case T_MINUS:
+            return OP_SUB;
+        case T_MUL:
+            return OP_MUL;
+        case T_DIV:
+            return OP_DIV;
+        case T_EQUAL_EQUAL:
+            return OP_EQ;
+        case T_NOT_EQUAL:
+            return OP_NE;
+        case T_LESS:
+            return OP_LT;
+        case T_GREATER:
+            return OP_GT;
+        case T_LESS_EQUAL:
+            return OP_LE;
+        default:
+            return OP_GE;
+        }
+    }
+
+    ValueType tokenTypeToValueType(TokenType type)
+    {
+        switch (type)
+        {
+        case T_FLOAT:
+        case T_DOUBLE:
+            return VT_FLOAT;
+        case T_STRING:
+            return VT_STRING;
+        case T_CHAR:
+            return VT_CHAR;
+        case T_BOOL:
+            return VT_BOOL;
+        default:
+            return VT_INT;
+        }
+    }
+};
+
+
+// Walks the syntax tree and emits quadruples into the IntermediateCodeGnerator
+class AstLowering
+{
+private:
+    const AstArena &ast;
+    IntermediateCodeGnerator &icg;
+
+public:
+    AstLowering(const AstArena &ast, IntermediateCodeGnerator &icg) : ast(ast), icg(icg) {}
+
+    void lowerProgram(NodeId program)
+    {
+        lowerStatement(program);
+    }
+
+    void lowerTopLevelStatement(NodeId id)
+    {
+        lowerStatement(id);
+    }
+
+private:
+    void lowerStatementList(NodeId first)
+    {
+        for (NodeId id = first; id != NO_NODE; id = ast[id].next)
+        {
+            lowerStatement(id);
+        }
+    }
+
+    void lowerStatement(NodeId id)
+    {
+        const AstNode &node = ast[id];
+        switch (node.kind)
+        {
+        case N_BLOCK:
+            lowerStatementList(node.a);
+            break;
+        case N_DECL:
+        {
+            Operand value = lowerExpression(node.b);
+            Operand var = icg.declareVariable((int)node.a, (int)node.c, (ValueType)node.subtype,
+                                              (node.flags & DECL_SHADOWS) != 0);
+            checkAssignment(var, value, node.line);
+            icg.addInstruction(OP_ASSIGN, var, value);
+            break;
+        }
+        case N_ASSIGN:
+        {
+            Operand value = lowerExpression(node.b);
+            Operand var = icg.variable((int)node.a);
+            checkAssignment(var, value, node.line);
+            icg.addInstruction(OP_ASSIGN, var, value);
+            break;
+        }
+        case N_IF:
+            lowerIf(node);
+            break;
+        case N_WHILE:
+            lowerWhile(node);
+            break;
+        case N_FOR:
+            lowerFor(node);
+            break;
+        case N_SWITCH:
+            lowerSwitch(node);
+            break;
+        case N_RETURN:
+            // No functions yet, only the value is evaluated
+            if (node.a != NO_NODE)
+                lowerExpression(node.a);
+            break;
+        case N_PRINT:
+            icg.addInstruction(OP_PRINT, Operand(), lowerExpression(node.a));
+            break;
+        case N_INCREMENT:
+        {
+            Operand var = icg.variable((int)node.a);
+            if (isString(var))
+                throw runtime_error("Semantic error: cannot increment a string on line " + to_string(node.line));
+            icg.addInstruction(OP_ADD, var, var, icg.constant(VT_INT, "1"));
+            break;
+        }
+        default:
+            lowerExpression(id);
+            break;
+        }
+    }
+
+    void lowerIf(const AstNode &node)
+    {
+        Operand condition = lowerExpression(node.a);
+        Operand elseLabel = icg.newLabel();
+        Operand endLabel = icg.newLabel();
+
+        icg.addInstruction(OP_IF_FALSE, elseLabel, condition);
+        lowerStatement(node.b);
+        icg.addInstruction(OP_GOTO, endLabel);
+        icg.addInstruction(OP_LABEL, elseLabel);
+        if (node.c != NO_NODE)
+            lowerStatement(node.c);
+        icg.addInstruction(OP_LABEL, endLabel);
+    }
+
+    // The condition is evaluated after the start label so every iteration re-tests it
+    void lowerWhile(const AstNode &node)
+    {
+        Operand startLabel = icg.newLabel();
+        Operand endLabel = icg.newLabel();
+
+        icg.addInstruction(OP_LABEL, startLabel);
+        icg.addInstruction(OP_IF_FALSE, endLabel, lowerExpression(node.a));
+        lowerStatement(node.b);
+        icg.addInstruction(OP_GOTO, startLabel);
+        icg.addInstruction(OP_LABEL, endLabel);
+    }
+
+    void lowerFor(const AstNode &node)
+    {
+        if (node.a != NO_NODE)
+            lowerStatement(node.a);
+
+        Operand startLabel = icg.newLabel();
+        Operand endLabel = icg.newLabel();
+
+        icg.addInstruction(OP_LABEL, startLabel);
+        icg.addInstruction(OP_IF_FALSE, endLabel, lowerExpression(node.b));
+        lowerStatement(node.d);
+        if (node.c != NO_NODE)
+            lowerStatement(node.c);
+        icg.addInstruction(OP_GOTO, startLabel);
+        icg.addInstruction(OP_LABEL, endLabel);
+    }
+
+    // Dispatch comes first, then the bodies in source order so a case without
+    // break falls through into the next one. Integer literal cases are sorted
+    // and dispatched by a binary search over runs of values, where a dense
+    // run becomes a jump table; other switches test each case in turn.
+    void lowerSwitch(const AstNode &node)
+    {
+        Operand subject = lowerExpression(node.a);
+        Operand endLabel = icg.newLabel();
+        Operand defaultLabel = endLabel;
+
+        vector<SwitchCase> cases;
+        vector<Operand> bodyLabels;
+        bool integral = icg.typeOf(subject) != VT_FLOAT && icg.typeOf(subject) != VT_STRING;
+        for (NodeId id = node.b; id != NO_NODE; id = ast[id].next)
+        {
+            bodyLabels.push_back(icg.newLabel());
+            if (ast[id].a == NO_NODE)
+            {
+                defaultLabel = bodyLabels.back();
+                continue;
+            }
+            SwitchCase c{0, Operand(), bodyLabels.back().id};
+            integral = integral && caseValue(ast[id].a, c);
+            cases.push_back(c);
+        }
+
+        if (integral)
+        {
+            // The first of several equal cases wins, as in a linear search
+            stable_sort(cases.begin(), cases.end(), [](const SwitchCase &a, const SwitchCase &b)
+                        { return a.value < b.value; });
+            cases.erase(unique(cases.begin(), cases.end(), [](const SwitchCase &a, const SwitchCase &b)
+                               { return a.value == b.value; }),
+                        cases.end());
+            vector<CaseRun> runs = findCaseRuns(cases);
+            lowerCaseRuns(subject, cases, runs, 0, runs.size(), defaultLabel);
+        }
+        else
+        {
+            size_t k = 0;
+            for (NodeId id = node.b; id != NO_NODE; id = ast[id].next, k++)
+            {
+                if (ast[id].a == NO_NODE)
+                    continue;
+                Operand nextTest = icg.newLabel();
+                Operand value = lowerExpression(ast[id].a);
+                checkOperands(subject, value, ast[id].line);
+                icg.addInstruction(OP_IF_NE, nextTest, subject, value);
+                icg.addInstruction(OP_GOTO, bodyLabels[k]);
+                icg.addInstruction(OP_LABEL, nextTest);
+            }
+            icg.addInstruction(OP_GOTO, defaultLabel);
+        }
+
+        size_t k = 0;
+        for (NodeId id = node.b; id != NO_NODE; id = ast[id].next, k++)
+        {
+            icg.addInstruction(OP_LABEL, bodyLabels[k]);
+            lowerStatement(ast[id].b);
+            if (ast[id].flags & CASE_HAS_BREAK)
+                icg.addInstruction(OP_GOTO, endLabel);
+        }
+        icg.addInstruction(OP_LABEL, endLabel);
+    }
+
+    struct SwitchCase
+    {
+        int64_t value;
+        Operand constant;
+        int body; // Label id
+    };
+
+    // Cases [first, last) of the sorted list, dispatched by one jump table
+    // when table is set, else tested one by one
+    struct CaseRun
+    {
+        size_t first, last;
+        bool table;
+    };
+
+    static constexpr size_t MIN_TABLE_CASES = 4;
+    static constexpr int MIN_TABLE_DENSITY = 40; // Percent of the entries that are cases
+
+    bool caseValue(NodeId id, SwitchCase &c)
+    {
+        const AstNode &node = ast[id];
+        if (node.kind != N_LITERAL || node.subtype == VT_FLOAT || node.subtype == VT_STRING)
+            return false;
+        c.constant = icg.constant((ValueType)node.subtype, (int)node.a);
+        string_view text = icg.constantText(c.constant.id);
+        if (node.subtype == VT_BOOL)
+            c.value = text == "true" ? 1 : 0;
+        else if (node.subtype == VT_CHAR)
+            c.value = text.empty() ? 0 : (unsigned char)text[0];
+        else
+        {
+            auto result = from_chars(text.data(), text.data() + text.size(), c.value);
+            return result.ec == errc() && result.ptr == text.data() + text.size() && c.value >= INT32_MIN &&
+                   c.value <= INT32_MAX;
+        }
+        return true;
+    }
+
+    // Greedily takes the longest dense run starting at each case
+    static vector<CaseRun> findCaseRuns(const vector<SwitchCase> &cases)
+    {
+        vector<CaseRun> runs;
+        for (size_t i = 0; i < cases.size();)
+        {
+            size_t last = i + 1;
+            for (size_t j = i + MIN_TABLE_CASES - 1; j < cases.size(); j++)
+            {
+                int64_t span = cases[j].value - cases[i].value + 1;
+                if ((int64_t)(j - i + 1) * 100 >= span * MIN_TABLE_DENSITY)
+                    last = j + 1;
+            }
+            runs.push_back(CaseRun{i, last, last - i >= MIN_TABLE_CASES});
+            i = last;
+        }
+        return runs;
+    }
+
+    // Splits the runs at the middle one's lowest value until few are left,
+    // then tests those in order
+    void lowerCaseRuns(Operand subject, const vector<SwitchCase> &cases, const vector<CaseRun> &runs, size_t first,
+                       size_t last, Operand defaultLabel)
+    {
+        if (last - first > 3)
+        {
+            size_t middle = first + (last - first) / 2;
+            Operand upper = icg.newLabel();
+            Operand below = icg.newTemp(VT_BOOL);
+            icg.addInstruction(OP_LT, below, subject, cases[runs[middle].first].constant);
+            icg.addInstruction(OP_IF_FALSE, upper, below);
+            lowerCaseRuns(subject, cases, runs, first, middle, defaultLabel);
+            icg.addInstruction(OP_LABEL, upper);
+            lowerCaseRuns(subject, cases, runs, middle, last, defaultLabel);
+            return;
+        }
+
+        for (size_t r = first; r < last; r++)
+        {
+            const CaseRun &run = runs[r];
+            if (run.table)
+            {
+                int low = (int)cases[run.first].value;
+                vector<int> targets((size_t)(cases[run.last - 1].value - low + 1), defaultLabel.id);
+                for (size_t i = run.first; i < run.last; i++)
+                    targets[(size_t)(cases[i].value - low)] = cases[i].body;
+                // Nothing follows the last table, values outside it go
+                // straight to the default
+                if (r + 1 == last)
+                {
+                    icg.addInstruction(OP_JUMP_TABLE, defaultLabel, subject, icg.newJumpTable(low, move(targets)));
+                    return;
+                }
+                Operand outside = icg.newLabel();
+                icg.addInstruction(OP_JUMP_TABLE, outside, subject, icg.newJumpTable(low, move(targets)));
+                icg.addInstruction(OP_LABEL, outside);
+                continue;
+            }
+            for (size_t i = run.first; i < run.last; i++)
+            {
+                Operand nextTest = icg.newLabel();
+                icg.addInstruction(OP_IF_NE, nextTest, subject, cases[i].constant);
+                icg.addInstruction(OP_GOTO, Operand(OPND_LABEL, cases[i].body));
+                icg.addInstruction(OP_LABEL, nextTest);
+            }
+        }
+        icg.addInstruction(OP_GOTO, defaultLabel);
+    }
+
+    Operand lowerExpression(NodeId id)
+    {
+        const AstNode &node = ast[id];
+        switch (node.kind)
+        {
+        case N_LITERAL:
+            return icg.constant((ValueType)node.subtype, (int)node.a);
+        case N_VAR:
+            return icg.variable((int)node.a);
+        case N_BINARY:
+        {
+            OpCode op = (OpCode)node.subtype;
+            Operand left = lowerExpression(node.a);
+            Operand right = lowerExpression(node.b);
+            checkOperands(left, right, node.line);
+
+            // Comparisons yield 0/1, arithmetic follows the wider operand
+            // and string + string concatenates
+            ValueType resultType = VT_INT;
+            if (!isComparisonOp(op) && (icg.typeOf(left) == VT_STRING || icg.typeOf(right) == VT_STRING))
+                resultType = VT_STRING;
+            else if (!isComparisonOp(op) && (icg.typeOf(left) == VT_FLOAT || icg.typeOf(right) == VT_FLOAT))
+                resultType = VT_FLOAT;
+
+            Operand temp = icg.newTemp(resultType);
+            icg.addInstruction(op, temp, left, right);
+            return temp;
+        }
+        default:
+            throw runtime_error("Internal error: node " + to_string(id) + " is not an expression");
+        }
+    }
+
+    // Strings are pointers everywhere past the parser, so there is no
+    // conversion between them and numbers
+    bool isString(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_STRING;
+    }
+
+    void checkAssignment(const Operand &var, const Operand &value, int line) const
+    {
+        if (isString(var) != isString(value))
+        {
+            const char *what = isString(value) ? "a string to a number" : "a number to a string";
+            throw runtime_error(string("Semantic error: cannot assign ") + what + " on line " + to_string(line));
+        }
+    }
+
+    void checkOperands(const Operand &left, const Operand &right, int line) const
+    {
+        if (isString(left) != isString(right))
+            throw runtime_error("Semantic error: cannot combine a string and a number on line " + to_string(line));
+    }
+};
+
+// Rows of bits of one width in a single allocation, one row per block
+class BitMatrix
+{
+private:
+    vector<uint64_t> words;
+    size_t width = 0; // In words
+
+public:
+    void reset(size_t rows, size_t bits, bool value = false)
+    {
+        width = (bits + 63) / 64;
+        words.assign(rows * width, value ? ~(uint64_t)0 : 0);
+    }
+
+    size_t wordsPerRow() const
+    {
+        return width;
+    }
+
+    uint64_t *row(size_t r)
+    {
+        return words.data() + r * width;
+    }
+
+    const uint64_t *row(size_t r) const
+    {
+        return words.data() + r * width;
+    }
+
+    static bool test(const uint64_t *row, size_t bit)
+    {
+        return (row[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    static void set(uint64_t *row, size_t bit)
+    {
+        row[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+
+    static void clear(uint64_t *row, size_t bit)
+    {
+        row[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+    }
+
+    // Sets bits [from, to)
+    static void setRange(uint64_t *row, size_t from, size_t to)
+    {
+        while (from < to && from % 64 != 0)
+            set(row, from++);
+        for (; from + 64 <= to; from += 64)
+            row[from / 64] = ~(uint64_t)0;
+        while (from < to)
+            set(row, from++);
+    }
+};
+
+// Basic blocks of a TAC range and the edges between them. Blocks are
+// numbered in instruction order and edges are kept in flat arrays.
+//
+// The blocks are also split into regions: runs of blocks that control only
+// enters at the top and only leaves by falling out of the bottom. Every
+// top-level statement is one, so dataflow solved region by region needs
+// bit vectors only as wide as one statement and stays linear in the size
+// of the program.
+class ControlFlowGraph
+{
+public:
+    struct Block
+    {
+        size_t first; // Instructions [first, last)
+        size_t last;
+    };
+
+    struct BlockList
+    {
+        const int *from;
+        const int *to;
+        const int *begin() const { return from; }
+        const int *end() const { return to; }
+        size_t size() const { return to - from; }
+    };
+
+    vector<Block> blocks;
+    vector<pair<int, int>> regions; // Blocks [first, last)
+
+    // The range may only jump to its own labels
+    ControlFlowGraph(const IntermediateCodeGnerator &icg, size_t first = 0) : icg(icg), code(icg.instructions)
+    {
+        build(first);
+    }
+
+    size_t size() const
+    {
+        return blocks.size();
+    }
+
+    const Quad &instruction(size_t i) const
+    {
+        return code[i];
+    }
+
+    BlockList successors(int block) const
+    {
+        return BlockList{edges.data() + successorStart[block], edges.data() + successorStart[block + 1]};
+    }
+
+    BlockList predecessors(int block) const
+    {
+        return BlockList{reverseEdges.data() + predecessorStart[block],
+                         reverseEdges.data() + predecessorStart[block + 1]};
+    }
+
+    int blockOf(size_t instruction) const
+    {
+        auto it = upper_bound(blocks.begin(), blocks.end(), instruction,
+                              [](size_t i, const Block &block) { return i < block.first; });
+        return (int)(it - blocks.begin()) - 1;
+    }
+
+    int regionOf(int block) const
+    {
+        return blockRegion[block];
+    }
+
+    // Whether control falls off the end of the whole range after the block
+    bool exits(int block) const
+    {
+        return block + 1 == (int)blocks.size() && !isUnconditionalJump(code[blocks[block].last - 1].op);
+    }
+
+    // Whether control can leave the region at its bottom, rather than
+    // loop in it forever
+    bool fallsOut(int region) const
+    {
+        int last = regions[region].second - 1;
+        if (last + 1 == (int)blocks.size())
+            return !isUnconditionalJump(code[blocks[last].last - 1].op);
+        const BlockList next = successors(last);
+        return find(next.begin(), next.end(), last + 1) != next.end();
+    }
+
+private:
+    const IntermediateCodeGnerator &icg;
+    const vector<Quad> &code;
+    vector<int> successorStart;
+    vector<int> edges;
+    vector<int> predecessorStart;
+    vector<int> reverseEdges;
+    vector<int> blockRegion;
+
+    void build(size_t first)
+    {
+        // The labels of a range are numbered close together
+        int minLabel = INT32_MAX;
+        int maxLabel = -1;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (code[i].op == OP_LABEL)
+            {
+                minLabel = min(minLabel, code[i].dst.id);
+                maxLabel = max(maxLabel, code[i].dst.id);
+            }
+        }
+        vector<int> labelBlock(maxLabel >= minLabel ? maxLabel - minLabel + 1 : 0, -1);
+
+        // A block starts at the range start, at a label and after a jump
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (i == first || code[i].op == OP_LABEL || isJumpOp(code[i - 1].op))
+            {
+                if (!blocks.empty())
+                    blocks.back().last = i;
+                blocks.push_back(Block{i, code.size()});
+            }
+            if (code[i].op == OP_LABEL)
+                labelBlock[code[i].dst.id - minLabel] = (int)blocks.size() - 1;
+        }
+
+        int count = (int)blocks.size();
+        successorStart.reserve(count + 1);
+        for (int b = 0; b < count; b++)
+        {
+            size_t start = edges.size();
+            successorStart.push_back((int)start);
+            const Quad &end = code[blocks[b].last - 1];
+            if (isJumpOp(end.op))
+                icg.forEachJumpTarget(end, [&](int label) { edges.push_back(labelBlock[label - minLabel]); });
+            if (!isUnconditionalJump(end.op) && b + 1 < count)
+                edges.push_back(b + 1);
+            if (edges.size() - start > 1)
+            {
+                sort(edges.begin() + start, edges.end());
+                edges.erase(unique(edges.begin() + start, edges.end()), edges.end());
+            }
+        }
+        successorStart.push_back((int)edges.size());
+
+        predecessorStart.assign(count + 1, 0);
+        for (int s : edges)
+            predecessorStart[s + 1]++;
+        for (int b = 0; b < count; b++)
+            predecessorStart[b + 1] += predecessorStart[b];
+        reverseEdges.resize(edges.size());
+        vector<int> fill(predecessorStart.begin(), predecessorStart.end() - 1);
+        for (int b = 0; b < count; b++)
+        {
+            for (int s : successors(b))
+                reverseEdges[fill[s]++] = b;
+        }
+
+        // Count the edges over each gap between neighbouring blocks, not
+        // counting fallthroughs; a region ends at every gap with none
+        vector<int> crossing(count + 1, 0);
+        for (int b = 0; b < count; b++)
+        {
+            for (int s : successors(b))
+            {
+                if (s != b && s != b + 1)
+                {
+                    crossing[min(b, s)]++;
+                    crossing[max(b, s)]--;
+                }
+            }
+        }
+        blockRegion.resize(count);
+        int open = 0;
+        int start = 0;
+        for (int b = 0; b < count; b++)
+        {
+            open += crossing[b];
+            blockRegion[b] = (int)regions.size();
+            if (open == 0)
+            {
+                regions.push_back({start, b + 1});
+                start = b + 1;
+            }
+        }
+    }
+};
+
+// Dominators of the blocks of a ControlFlowGraph that are reachable from its
+// first block, found with the iterative algorithm of Cooper, Harvey and
+// Kennedy over reverse postorder. Keeps the dominator tree, each block's
+// children in reverse postorder, and each block's dominance frontier: the
+// blocks just past the ones it dominates, where a value stored in it meets
+// values from other paths.
+class DominatorTree
+{
+public:
+    typedef ControlFlowGraph::BlockList BlockList;
+
+    vector<int> order; // Reachable blocks in reverse postorder
+
+    void build(const ControlFlowGraph &cfg)
+    {
+        findOrder(cfg);
+        findDominators(cfg);
+        findChildren(cfg);
+        findFrontiers(cfg);
+    }
+
+    bool reachable(int block) const
+    {
+        return position[block] != -1;
+    }
+
+    // -1 for the first block and unreachable ones
+    int immediateDominator(int block) const
+    {
+        return idom[block];
+    }
+
+    BlockList children(int block) const
+    {
+        return BlockList{childList.data() + childStart[block], childList.data() + childStart[block + 1]};
+    }
+
+    BlockList frontier(int block) const
+    {
+        return BlockList{frontierList.data() + frontierStart[block], frontierList.data() + frontierStart[block + 1]};
+    }
+
+private:
+    vector<int> position; // In order, -1 if unreachable
+    vector<int> idom;
+    vector<int> childStart;
+    vector<int> childList;
+    vector<int> frontierStart;
+    vector<int> frontierList;
+
+    void findOrder(const ControlFlowGraph &cfg)
+    {
+        int count = (int)cfg.size();
+        position.assign(count, -1);
+        order.clear();
+        if (count == 0)
+            return;
+
+        // Depth-first, with the next successor to try for each open block
+        vector<pair<int, int>> stack;
+        stack.push_back({0, 0});
+        position[0] = -2;
+        while (!stack.empty())
+        {
+            int block = stack.back().first;
+            int next = stack.back().second;
+            const BlockList successors = cfg.successors(block);
+            if (next < (int)successors.size())
+            {
+                stack.back().second++;
+                int s = successors.begin()[next];
+                if (position[s] == -1)
+                {
+                    position[s] = -2;
+                    stack.push_back({s, 0});
+                }
+                continue;
+            }
+            order.push_back(block);
+            stack.pop_back();
+        }
+        reverse(order.begin(), order.end());
+        for (size_t k = 0; k < order.size(); k++)
+            position[order[k]] = (int)k;
+    }
+
+    void findDominators(const ControlFlowGraph &cfg)
+    {
+        idom.assign(cfg.size(), -1);
+        if (order.empty())
+            return;
+        idom[0] = 0;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t k = 1; k < order.size(); k++)
+            {
+                int block = order[k];
+                int best = -1;
+                for (int p : cfg.predecessors(block))
+                {
+                    if (idom[p] != -1)
+                        best = best == -1 ? p : intersect(p, best);
+                }
+                if (idom[block] != best)
+                {
+                    idom[block] = best;
+                    changed = true;
+                }
+            }
+        }
+        idom[0] = -1;
+    }
+
+    // Closest common dominator, while idom[0] is still 0
+    int intersect(int a, int b) const
+    {
+        while (a != b)
+        {
+            while (position[a] > position[b])
+                a = idom[a];
+            while (position[b] > position[a])
+                b = idom[b];
+        }
+        return a;
+    }
+
+    void findChildren(const ControlFlowGraph &cfg)
+    {
+        int count = (int)cfg.size();
+        childStart.assign(count + 1, 0);
+        for (size_t k = 1; k < order.size(); k++)
+            childStart[idom[order[k]] + 1]++;
+        for (int b = 0; b < count; b++)
+            childStart[b + 1] += childStart[b];
+        childList.resize(order.empty() ? 0 : order.size() - 1);
+        vector<int> fill(childStart.begin(), childStart.end() - 1);
+        for (size_t k = 1; k < order.size(); k++)
+            childList[fill[idom[order[k]]]++] = order[k];
+    }
+
+    // A join point is in the frontier of every block from each of its
+    // predecessors up to, but not including, its immediate dominator. The
+    // first block counts as a join if anything jumps back to it, since
+    // control also enters it from outside.
+    void findFrontiers(const ControlFlowGraph &cfg)
+    {
+        int count = (int)cfg.size();
+        vector<pair<int, int>> entries; // (block, frontier block)
+        vector<int> lastAdded(count, -1);
+        for (int block : order)
+        {
+            const BlockList predecessors = cfg.predecessors(block);
+            if (predecessors.size() + (block == 0) < 2)
+                continue;
+            for (int p : predecessors)
+            {
+                for (int runner = p; reachable(p) && runner != idom[block]; runner = idom[runner])
+                {
+                    if (lastAdded[runner] == block)
+                        continue;
+                    lastAdded[runner] = block;
+                    entries.push_back({runner, block});
+                }
+            }
+        }
+
+        frontierStart.assign(count + 1, 0);
+        for (const auto &entry : entries)
+            frontierStart[entry.first + 1]++;
+        for (int b = 0; b < count; b++)
+            frontierStart[b + 1] += frontierStart[b];
+        frontierList.resize(entries.size());
+        vector<int> fill(frontierStart.begin(), frontierStart.end() - 1);
+        for (const auto &entry : entries)
+            frontierList[fill[entry.first]++] = entry.second;
+    }
+};
+
+// A gen/kill problem over a range of blocks for DataflowSolver. The client
+// fills gen and kill (a row per block of the range) and the boundary: the
+// facts entering the range at its first block for a forward problem, or
+// holding where control leaves it for a backward one.
+struct DataflowProblem
+{
+    bool forward = true;
+    bool meetIsUnion = true; // false for facts that must hold on every path
+    size_t bits = 0;
+    BitMatrix gen;
+    BitMatrix kill;
+    vector<uint64_t> boundary;
+
+    void reset(size_t blocks, size_t factCount)
+    {
+        bits = factCount;
+        gen.reset(blocks, bits);
+        kill.reset(blocks, bits);
+        boundary.assign(gen.wordsPerRow(), 0);
+    }
+};
+
+// Worklist solver for out = gen | (in & ~kill), with in and out swapped for
+// backward problems. Blocks are queued once in the order that usually
+// settles the problem in one sweep, then again whenever an input changes.
+// Edges into the range from outside are ignored. One solver is meant to be
+// reused for every range of a graph.
+class DataflowSolver
+{
+public:
+    BitMatrix in; // One row per block of the range, valid until the next solve
+    BitMatrix out;
+
+    void solve(const ControlFlowGraph &cfg, int firstBlock, int lastBlock, const DataflowProblem &problem)
+    {
+        int count = lastBlock - firstBlock;
+        size_t width = problem.gen.wordsPerRow();
+        in.reset(count, problem.bits, !problem.meetIsUnion);
+        out.reset(count, problem.bits, !problem.meetIsUnion);
+
+        // Meet side and transfer side
+        BitMatrix &before = problem.forward ? in : out;
+        BitMatrix &after = problem.forward ? out : in;
+
+        queue.resize(count);
+        queued.assign(count, 1);
+        for (int k = 0; k < count; k++)
+            queue[k] = problem.forward ? k : count - 1 - k;
+        size_t head = 0;
+        size_t pending = count;
+
+        while (pending > 0)
+        {
+            int k = queue[head];
+            head = (head + 1) % count;
+            pending--;
+            queued[k] = 0;
+            int block = firstBlock + k;
+
+            uint64_t *meet = before.row(k);
+            bool first = true;
+            auto join = [&](const uint64_t *row)
+            {
+                for (size_t w = 0; w < width; w++)
+                {
+                    if (first)
+                        meet[w] = row[w];
+                    else if (problem.meetIsUnion)
+                        meet[w] |= row[w];
+                    else
+                        meet[w] &= row[w];
+                }
+                first = false;
+            };
+            bool atBoundary = problem.forward ? k == 0 : cfg.exits(block);
+            for (int neighbour : problem.forward ? cfg.predecessors(block) : cfg.successors(block))
+            {
+                if (neighbour >= firstBlock && neighbour < lastBlock)
+                    join(after.row(neighbour - firstBlock));
+                else if (!problem.forward)
+                    atBoundary = true;
+            }
+            if (atBoundary)
+                join(problem.boundary.data());
+            if (first)
+                fill(meet, meet + width, 0); // Nothing flows in
+
+            const uint64_t *gen = problem.gen.row(k);
+            const uint64_t *kill = problem.kill.row(k);
+            uint64_t *result = after.row(k);
+            bool changed = false;
+            for (size_t w = 0; w < width; w++)
+            {
+                uint64_t value = gen[w] | (meet[w] & ~kill[w]);
+                changed |= value != result[w];
+                result[w] = value;
+            }
+            if (!changed)
+                continue;
+
+            for (int neighbour : problem.forward ? cfg.successors(block) : cfg.predecessors(block))
+            {
+                int j = neighbour - firstBlock;
+                if (j >= 0 && j < count && !queued[j])
+                {
+                    queued[j] = 1;
+                    queue[(head + pending) % count] = j;
+                    pending++;
+                }
+            }
+        }
+    }
+
+private:
+    vector<int> queue; // Circular
+    vector<char> queued;
+};
+
+// Variables and temps as one range of dataflow slots: variable id, then
+// variableCount + temp id
+struct SlotNumbering
+{
+    int slotBase;
+    int slotCount;
+
+    SlotNumbering(const IntermediateCodeGnerator &icg)
+        : slotBase(icg.variableCount()), slotCount(icg.variableCount() + icg.tempCount) {}
+
+    static bool isSlot(const Operand &operand)
+    {
+        return operand.kind == OPND_VAR || operand.kind == OPND_TEMP;
+    }
+
+    int slotOf(const Operand &operand) const
+    {
+        return operand.kind == OPND_VAR ? operand.id : slotBase + operand.id;
+    }
+
+    Operand operandOf(int slot) const
+    {
+        return slot < slotBase ? Operand(OPND_VAR, slot) : Operand(OPND_TEMP, slot - slotBase);
+    }
+};
+
+// Slots a region mentions, the blocks each is mentioned in, and which are
+// read in some block before being written there. Only the latter can carry
+// a value from one block to another; expression temps never do.
+class RegionSlots
+{
+public:
+    struct Span
+    {
+        size_t seen;      // Region stamp
+        size_t definedIn; // Block stamp
+        int firstBlock;
+        int lastBlock;
+        bool exposed;
+    };
+
+    vector<int> mentioned; // Sorted
+
+    RegionSlots(const SlotNumbering &slots) : slots(slots), spans(slots.slotCount, Span{0, 0, 0, 0, false}) {}
+
+    // Valid for the mentioned slots of the last scan
+    const Span &operator[](int slot) const
+    {
+        return spans[slot];
+    }
+
+    void scan(const ControlFlowGraph &cfg, int region)
+    {
+        mentioned.clear();
+        stamp++;
+        for (int b = cfg.regions[region].first; b < cfg.regions[region].second; b++)
+        {
+            size_t block = ++blockStamp;
+            for (size_t i = cfg.blocks[b].first; i < cfg.blocks[b].last; i++)
+            {
+                const Quad &q = cfg.instruction(i);
+                for (const Operand *operand : {&q.src1, &q.src2})
+                {
+                    if (SlotNumbering::isSlot(*operand))
+                    {
+                        Span &span = note(slots.slotOf(*operand), b);
+                        if (span.definedIn != block)
+                            span.exposed = true;
+                    }
+                }
+                if (isDefinitionOp(q.op))
+                    note(slots.slotOf(q.dst), b).definedIn = block;
+            }
+        }
+        sort(mentioned.begin(), mentioned.end());
+    }
+
+private:
+    const SlotNumbering &slots;
+    vector<Span> spans;
+    size_t stamp = 0;
+    size_t blockStamp = 0;
+
+    Span &note(int slot, int block)
+    {
+        Span &span = spans[slot];
+        if (span.seen != stamp)
+        {
+            span.seen = stamp;
+            span.firstBlock = block;
+            span.exposed = false;
+            mentioned.push_back(slot);
+        }
+        span.lastBlock = block;
+        return span;
+    }
+};
+
+// Which variables and temps may still be read after each block.
+//
+// Bits are given only to slots read across a block boundary. In a long
+// region a slot gets them only over the window of blocks it is mentioned
+// in, as long as its value never enters the window from outside; slots
+// with overlapping windows are solved together, 64 at a time. The rest
+// (values live around a loop or past the region) are solved over the whole
+// region. A huge loop body full of short-lived locals thus costs about the
+// size of the code rather than blocks times slots.
+class Liveness
+{
+public:
+    // A block range solved on its own; its slots' bits are in this order
+    struct Window
+    {
+        int firstBlock;
+        int lastBlock;
+        size_t firstSlot; // In windowSlots
+        size_t slotCount;
+        size_t firstWord; // In inPool and outPool
+        size_t width;
+    };
+
+private:
+    static constexpr int SMALL_REGION = 256; // Blocks
+
+    const ControlFlowGraph &cfg;
+    SlotNumbering slots;
+    bool variablesLiveAtExit;
+
+    // Per region, its windows and the slots it mentions (sorted), each
+    // with its window (-1 if never live across a block boundary) and bit
+    struct Region
+    {
+        size_t firstWindow;
+        size_t lastWindow;
+        size_t firstSlot;
+        size_t lastSlot;
+    };
+    struct SlotBit
+    {
+        int slot;
+        int window;
+        int bit;
+    };
+    vector<Region> regions;
+    vector<Window> windows;
+    vector<int> windowSlots;
+    vector<SlotBit> slotBits;
+    vector<uint64_t> inPool;
+    vector<uint64_t> outPool;
+
+public:
+    // With variablesLiveAtExit every variable counts as read after the range,
+    // as when later statements are compiled on their own
+    Liveness(const IntermediateCodeGnerator &icg, const ControlFlowGraph &cfg, bool variablesLiveAtExit)
+        : cfg(cfg), slots(icg), variablesLiveAtExit(variablesLiveAtExit), scratchBit(slots.slotCount, -1)
+    {
+        // Regions are solved last to first, so the slots live after each
+        // one are known before it is solved
+        vector<char> liveAfter(slots.slotCount, 0);
+        if (variablesLiveAtExit)
+            fill(liveAfter.begin(), liveAfter.begin() + slots.slotBase, 1);
+        vector<int> windowOf(slots.slotCount, -1);
+        vector<int> bitOf(slots.slotCount, -1);
+        vector<int> candidates;
+        vector<int> global;
+        vector<uint64_t> leaks;
+        RegionSlots scan(slots);
+        DataflowSolver solver;
+
+        regions.resize(cfg.regions.size());
+        for (int r = (int)regions.size() - 1; r >= 0; r--)
+        {
+            scan.scan(cfg, r);
+            int regionFirst = cfg.regions[r].first;
+            int regionLast = cfg.regions[r].second;
+            Region &region = regions[r];
+            region.firstWindow = windows.size();
+
+            global.clear();
+            candidates.clear();
+            for (int slot : scan.mentioned)
+            {
+                if (liveAfter[slot])
+                    global.push_back(slot);
+                else if (scan[slot].exposed)
+                    candidates.push_back(slot);
+            }
+            // A short region costs at most a few words per block either way
+            if (regionLast - regionFirst <= SMALL_REGION)
+            {
+                global.insert(global.end(), candidates.begin(), candidates.end());
+                candidates.clear();
+            }
+
+            // Spans of about the same length share windows, so one long span
+            // does not stretch the windows of many short ones
+            auto spanClass = [&](int slot)
+            { return 32 - __builtin_clz((unsigned)(scan[slot].lastBlock - scan[slot].firstBlock + 1)); };
+            sort(candidates.begin(), candidates.end(), [&](int a, int b)
+            {
+                int classA = spanClass(a);
+                int classB = spanClass(b);
+                return classA != classB ? classA < classB : scan[a].firstBlock < scan[b].firstBlock;
+            });
+
+            // Windows of overlapping slots. A slot live where control enters
+            // its window moves to the region-wide solve.
+            for (size_t c = 0; c < candidates.size();)
+            {
+                size_t group = c;
+                int windowFirst = scan[candidates[c]].firstBlock;
+                int windowLast = scan[candidates[c]].lastBlock + 1;
+                for (c++; c < candidates.size() && c - group < 64 && spanClass(candidates[c]) == spanClass(candidates[group]) &&
+                          scan[candidates[c]].firstBlock < windowLast;
+                     c++)
+                    windowLast = max(windowLast, scan[candidates[c]].lastBlock + 1);
+
+                solveWindow(solver, windowFirst, windowLast, &candidates[group], c - group, nullptr);
+                leaks.assign(solver.in.wordsPerRow(), 0);
+                for (int b = windowFirst; b < windowLast; b++)
+                {
+                    if (isEntry(b, windowFirst, windowLast, regionFirst))
+                    {
+                        const uint64_t *row = solver.in.row(b - windowFirst);
+                        for (size_t w = 0; w < leaks.size(); w++)
+                            leaks[w] |= row[w];
+                    }
+                }
+                // Bits are independent, so the others' results stand; the
+                // leaked slot's entry is blanked out
+                size_t kept = 0;
+                for (size_t k = group; k < c; k++)
+                {
+                    if (BitMatrix::test(leaks.data(), k - group))
+                    {
+                        global.push_back(candidates[k]);
+                        windowSlots[windows.back().firstSlot + (k - group)] = -1;
+                    }
+                    else
+                    {
+                        windowOf[candidates[k]] = (int)windows.size() - 1;
+                        bitOf[candidates[k]] = (int)(k - group);
+                        kept++;
+                    }
+                }
+                if (kept == 0)
+                {
+                    const Window &window = windows.back();
+                    windowSlots.resize(window.firstSlot);
+                    inPool.resize(window.firstWord);
+                    outPool.resize(window.firstWord);
+                    windows.pop_back();
+                }
+            }
+
+            if (!global.empty())
+            {
+                sort(global.begin(), global.end());
+                solveWindow(solver, regionFirst, regionLast, global.data(), global.size(), &liveAfter);
+                for (size_t k = 0; k < global.size(); k++)
+                {
+                    windowOf[global[k]] = (int)windows.size() - 1;
+                    bitOf[global[k]] = (int)k;
+                }
+            }
+            region.lastWindow = windows.size();
+
+            // Only the region-wide slots can be live on entry to the region
+            region.firstSlot = slotBits.size();
+            for (int slot : scan.mentioned)
+            {
+                int window = windowOf[slot];
+                slotBits.push_back(SlotBit{slot, window, bitOf[slot]});
+                liveAfter[slot] = window != -1 && windows[window].firstBlock == regionFirst &&
+                                  windows[window].lastBlock == regionLast &&
+                                  BitMatrix::test(inPool.data() + windows[window].firstWord, bitOf[slot]);
+                windowOf[slot] = -1;
+                bitOf[slot] = -1;
+            }
+            region.lastSlot = slotBits.size();
+        }
+    }
+
+    bool liveIn(int block, const Operand &operand) const
+    {
+        return lookup(block, slots.slotOf(operand), true);
+    }
+
+    bool liveOut(int block, const Operand &operand) const
+    {
+        return lookup(block, slots.slotOf(operand), false);
+    }
+
+    // Calls f(block, operand, liveIn, liveOut) for each block a variable or
+    // temp is live at the start or end of, in the regions that mention it.
+    // Costs as much as the solved bits, not blocks times slots.
+    template <typename F>
+    void forEachLiveBlock(F f) const
+    {
+        for (const Window &w : windows)
+        {
+            const int *windowSlots = this->windowSlots.data() + w.firstSlot;
+            for (int block = w.firstBlock; block < w.lastBlock; block++)
+            {
+                const uint64_t *in = inPool.data() + w.firstWord + w.width * (block - w.firstBlock);
+                const uint64_t *out = outPool.data() + w.firstWord + w.width * (block - w.firstBlock);
+                for (size_t k = 0; k < w.width; k++)
+                {
+                    for (uint64_t bits = in[k] | out[k]; bits; bits &= bits - 1)
+                    {
+                        int bit = (int)(k * 64) + __builtin_ctzll(bits);
+                        if (windowSlots[bit] != -1)
+                            f(block, slots.operandOf(windowSlots[bit]), BitMatrix::test(in, bit), BitMatrix::test(out, bit));
+                    }
+                }
+            }
+        }
+    }
+
+    size_t windowCount() const
+    {
+        return windows.size();
+    }
+
+    // Calls f(index, window, slots) for each block range of the region that
+    // was solved on its own, with the slots whose values cross block
+    // boundaries in it (-1 for a slot that turned out to need the
+    // region-wide solve). Outside its window a slot is dead.
+    template <typename F>
+    void forEachWindow(int region, F f) const
+    {
+        for (size_t w = regions[region].firstWindow; w < regions[region].lastWindow; w++)
+            f((int)w, windows[w], windowSlots.data() + windows[w].firstSlot);
+    }
+
+    // The window and bit of a slot in a region, false if its value never
+    // crosses a block boundary there
+    bool findSlot(int region, int slot, int &window, int &bit) const
+    {
+        auto from = slotBits.begin() + regions[region].firstSlot;
+        auto to = slotBits.begin() + regions[region].lastSlot;
+        auto it = lower_bound(from, to, slot, [](const SlotBit &entry, int s) { return entry.slot < s; });
+        if (it == to || it->slot != slot || it->window == -1)
+            return false;
+        window = it->window;
+        bit = it->bit;
+        return true;
+    }
+
+private:
+    // Blocks control can enter from outside the window, or from before
+    // the region
+    bool isEntry(int block, int windowFirst, int windowLast, int regionFirst) const
+    {
+        if (block == regionFirst)
+            return true;
+        for (int predecessor : cfg.predecessors(block))
+        {
+            if (predecessor < windowFirst || predecessor >= windowLast)
+                return true;
+        }
+        return false;
+    }
+
+    // Solves blocks [firstBlock, lastBlock) for the given slots, bit k for
+    // slot k, and appends the result as a window
+    void solveWindow(DataflowSolver &solver, int firstBlock, int lastBlock, const int *windowSlotList, size_t count,
+                     const vector<char> *liveAfter)
+    {
+        vector<int> &bitOf = scratchBit;
+        for (size_t k = 0; k < count; k++)
+            bitOf[windowSlotList[k]] = (int)k;
+        problem.forward = false;
+        problem.reset(lastBlock - firstBlock, count);
+        if (liveAfter)
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                if ((*liveAfter)[windowSlotList[k]])
+                    BitMatrix::set(problem.boundary.data(), k);
+            }
+        }
+        // Backwards through each block: a read makes the slot live on entry
+        // unless an earlier store in the block provides the value
+        for (int b = firstBlock; b < lastBlock; b++)
+        {
+            uint64_t *gen = problem.gen.row(b - firstBlock);
+            uint64_t *kill = problem.kill.row(b - firstBlock);
+            for (size_t i = cfg.blocks[b].last; i-- > cfg.blocks[b].first;)
+            {
+                const Quad &q = cfg.instruction(i);
+                int bit;
+                if (isDefinitionOp(q.op) && (bit = bitOf[slots.slotOf(q.dst)]) != -1)
+                {
+                    BitMatrix::set(kill, bit);
+                    BitMatrix::clear(gen, bit);
+                }
+                for (const Operand *operand : {&q.src1, &q.src2})
+                {
+                    if (SlotNumbering::isSlot(*operand) && (bit = bitOf[slots.slotOf(*operand)]) != -1)
+                        BitMatrix::set(gen, bit);
+                }
+            }
+        }
+        solver.solve(cfg, firstBlock, lastBlock, problem);
+        for (size_t k = 0; k < count; k++)
+            bitOf[windowSlotList[k]] = -1;
+
+        Window window{firstBlock, lastBlock, windowSlots.size(), count, inPool.size(), solver.in.wordsPerRow()};
+        windowSlots.insert(windowSlots.end(), windowSlotList, windowSlotList + count);
+        size_t words = window.width * (lastBlock - firstBlock);
+        inPool.insert(inPool.end(), solver.in.row(0), solver.in.row(0) + words);
+        outPool.insert(outPool.end(), solver.out.row(0), solver.out.row(0) + words);
+        windows.push_back(window);
+    }
+
+    bool test(const vector<uint64_t> &pool, int window, int block, int bit) const
+    {
+        const Window &w = windows[window];
+        if (block < w.firstBlock || block >= w.lastBlock)
+            return false;
+        return BitMatrix::test(pool.data() + w.firstWord + w.width * (block - w.firstBlock), bit);
+    }
+
+    bool lookup(int block, int slot, bool atEntry) const
+    {
+        int r = cfg.regionOf(block);
+        for (;;)
+        {
+            const Region &region = regions[r];
+            auto from = slotBits.begin() + region.firstSlot;
+            auto to = slotBits.begin() + region.lastSlot;
+            auto it = lower_bound(from, to, slot, [](const SlotBit &entry, int s) { return entry.slot < s; });
+            if (it != to && it->slot == slot)
+                return it->window != -1 && test(atEntry ? inPool : outPool, it->window, block, it->bit);
+
+            // Untouched by the region: live wherever it is live after it,
+            // which the first later region using it decides
+            if (!cfg.fallsOut(r))
+                return false;
+            if (++r == (int)regions.size())
+                return variablesLiveAtExit && slot < slots.slotBase;
+            block = cfg.regions[r].first;
+            atEntry = true;
+        }
+    }
+
+    DataflowProblem problem;
+    vector<int> scratchBit; // Per slot, -1 outside solveWindow
+};
+
+// Which stores may have produced the value an instruction reads. Solved
+// over the same windows as Liveness: a store can only matter where its
+// slot is live. A value from before the region is reported as OUTSIDE.
+class ReachingDefinitions
+{
+public:
+    static constexpr size_t OUTSIDE = (size_t)-1;
+
+private:
+    const ControlFlowGraph &cfg;
+    const Liveness &liveness;
+    SlotNumbering slots;
+
+    // Per Liveness window: bit k < slotCount is "slot k as it was when
+    // control entered the window"; the stores to slot k that reach the end
+    // of their block follow at bits [storeStart[k], storeStart[k + 1]).
+    struct Window
+    {
+        int firstBlock;
+        size_t firstStart; // In storeStarts, slotCount + 1 entries
+        size_t firstStore; // In stores
+        size_t firstWord;  // In inPool
+        size_t width;
+    };
+    vector<Window> windows;
+    vector<int> storeStarts;
+    vector<size_t> stores; // Instruction of each store bit
+    vector<uint64_t> inPool;
+
+public:
+    ReachingDefinitions(const IntermediateCodeGnerator &icg, const ControlFlowGraph &cfg, const Liveness &liveness)
+        : cfg(cfg), liveness(liveness), slots(icg)
+    {
+        vector<int> slotIndex(slots.slotCount, -1);
+        vector<int> lastStore(slots.slotCount, -1); // Per slot, within the current block
+        vector<pair<int, size_t>> found;            // (slot index, instruction)
+        vector<int> storedSlots;
+        DataflowProblem problem;
+        DataflowSolver solver;
+
+        windows.resize(liveness.windowCount());
+        for (int r = 0; r < (int)cfg.regions.size(); r++)
+        {
+            liveness.forEachWindow(r, [&](int index, const Liveness::Window &window, const int *windowSlots)
+            {
+                size_t count = window.slotCount;
+                for (size_t k = 0; k < count; k++)
+                {
+                    if (windowSlots[k] != -1)
+                        slotIndex[windowSlots[k]] = (int)k;
+                }
+
+                // The last store to each slot in each block, grouped by slot
+                found.clear();
+                for (int b = window.firstBlock; b < window.lastBlock; b++)
+                {
+                    for (size_t i = cfg.blocks[b].first; i < cfg.blocks[b].last; i++)
+                    {
+                        const Quad &q = cfg.instruction(i);
+                        if (!isDefinitionOp(q.op) || slotIndex[slots.slotOf(q.dst)] == -1)
+                            continue;
+                        int slot = slots.slotOf(q.dst);
+                        if (lastStore[slot] != -1)
+                        {
+                            found[lastStore[slot]].second = i;
+                            continue;
+                        }
+                        lastStore[slot] = (int)found.size();
+                        found.push_back({slotIndex[slot], i});
+                        storedSlots.push_back(slot);
+                    }
+                    for (int slot : storedSlots)
+                        lastStore[slot] = -1;
+                    storedSlots.clear();
+                }
+                stable_sort(found.begin(), found.end(),
+                            [](const pair<int, size_t> &a, const pair<int, size_t> &b) { return a.first < b.first; });
+
+                Window &entry = windows[index];
+                entry.firstBlock = window.firstBlock;
+                entry.firstStart = storeStarts.size();
+                entry.firstStore = stores.size();
+                storeStarts.resize(storeStarts.size() + count + 1, 0);
+                int *start = storeStarts.data() + entry.firstStart;
+                for (const auto &store : found)
+                    start[store.first + 1]++;
+                start[0] = (int)count;
+                for (size_t k = 0; k < count; k++)
+                    start[k + 1] += start[k];
+                for (const auto &store : found)
+                    stores.push_back(store.second);
+
+                // A block kills every fact about the slots it stores and
+                // generates its last store to each; the transfer function
+                // lets gen win over kill
+                problem.reset(window.lastBlock - window.firstBlock, count + found.size());
+                for (size_t k = 0; k < count; k++)
+                    BitMatrix::set(problem.boundary.data(), k);
+                for (size_t bit = count; bit < problem.bits; bit++)
+                {
+                    size_t i = stores[entry.firstStore + bit - count];
+                    int k = slotIndex[slots.slotOf(cfg.instruction(i).dst)];
+                    int block = cfg.blockOf(i) - window.firstBlock;
+                    uint64_t *kill = problem.kill.row(block);
+                    BitMatrix::set(problem.gen.row(block), bit);
+                    BitMatrix::set(kill, k);
+                    BitMatrix::setRange(kill, start[k], start[k + 1]);
+                }
+                solver.solve(cfg, window.firstBlock, window.lastBlock, problem);
+
+                entry.firstWord = inPool.size();
+                entry.width = solver.in.wordsPerRow();
+                size_t words = entry.width * (window.lastBlock - window.firstBlock);
+                inPool.insert(inPool.end(), solver.in.row(0), solver.in.row(0) + words);
+                for (size_t k = 0; k < count; k++)
+                {
+                    if (windowSlots[k] != -1)
+                        slotIndex[windowSlots[k]] = -1;
+                }
+            });
+        }
+    }
+
+    // Calls f(instruction) for each store whose value the operand may hold
+    // when instruction `use` reads it, or f(OUTSIDE) for a value from
+    // before the region
+    template <typename F>
+    void forEachReachingDefinition(size_t use, const Operand &operand, F f) const
+    {
+        int block = cfg.blockOf(use);
+        for (size_t i = use; i-- > cfg.blocks[block].first;)
+        {
+            const Quad &q = cfg.instruction(i);
+            if (isDefinitionOp(q.op) && q.dst == operand)
+            {
+                f(i);
+                return;
+            }
+        }
+
+        int window;
+        int k;
+        if (!liveness.findSlot(cfg.regionOf(block), slots.slotOf(operand), window, k))
+        {
+            f(OUTSIDE); // Not read in the region before being stored
+            return;
+        }
+        const Window &entry = windows[window];
+        const uint64_t *row = inPool.data() + entry.firstWord + entry.width * (block - entry.firstBlock);
+        if (BitMatrix::test(row, k))
+            f(OUTSIDE);
+        const int *start = storeStarts.data() + entry.firstStart;
+        size_t count = start[0];
+        for (int bit = start[k]; bit < start[k + 1]; bit++)
+        {
+            if (BitMatrix::test(row, bit))
+                f(stores[entry.firstStore + bit - count]);
+        }
+    }
+};
+
+// Folds operations on constants and propagates the constant values of
+// variables and temps forward through the TAC. The code is walked once in
+// order; a label merges the states at the jumps that reach it and a loop
+// header forgets everything assigned inside the loop. Branches on a
+// constant become a goto or disappear, which leaves the code behind a goto
+// unreachable until a label that is still jumped to.
+class ConstantPropagation
+{
+private:
+    IntermediateCodeGnerator &icg;
+
+    // Per slot (variable id, then slotBase + temp id): id of the constant it
+    // is known to hold, or -1. All -1 between runs.
+    vector<int> values;
+    vector<pair<int, int>> changes; // (slot, previous value), undone by merges
+    int slotBase = 0;
+
+    // Per slot, for merge()
+    struct Scratch
+    {
+        size_t stamp;
+        int before;         // Value at the walk position
+        int met;            // Meet over the jumps passed so far
+        size_t jumpsPassed; // When the slot was first seen
+    };
+    vector<Scratch> scratch;
+    vector<int> mergeSlots;
+    size_t mergeStamp = 0;
+
+    // Forward jumps waiting for their label: changes.size() at the jump and
+    // the next entry for the same label
+    struct Jump
+    {
+        size_t snapshot;
+        int next;
+    };
+    vector<Jump> jumps;
+    vector<size_t> jumpSnapshots;
+    vector<int> tableTargets;
+
+    // Per label, reset after each run
+    vector<int> firstJump; // Into jumps, -1 if none
+    vector<size_t> labelPos;
+    vector<size_t> loopEnd; // Last backward jump to the label, 0 if none
+
+    static constexpr int UNSET = -2;
+    static constexpr size_t NO_POS = (size_t)-1;
+
+    struct Number
+    {
+        bool isFloat;
+        int64_t i;
+        double f;
+    };
+
+public:
+    size_t foldedOperations = 0;
+    size_t propagatedOperands = 0;
+    size_t resolvedBranches = 0;
+    size_t removedInstructions = 0;
+
+    ConstantPropagation(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    // Optimizes instructions [first, end); the range may only jump to its
+    // own labels
+    void run(size_t first = 0)
+    {
+        vector<Quad> &code = icg.instructions;
+        prepare(first);
+
+        vector<bool> removed(code.size() - first, false);
+        bool reachable = true;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            Quad &q = code[i];
+            if (q.op == OP_LABEL)
+            {
+                reachable = enterLabel(q.dst.id, i, reachable);
+                continue;
+            }
+            if (!reachable)
+                continue;
+
+            if (isBinaryOp(q.op))
+            {
+                substitute(q.src1);
+                substitute(q.src2);
+                int result = fold(q);
+                if (result != -1)
+                {
+                    q = Quad(OP_ASSIGN, q.dst, Operand(OPND_CONST, result));
+                    foldedOperations++;
+                }
+                define(q);
+                continue;
+            }
+
+            switch (q.op)
+            {
+            case OP_ASSIGN:
+                substitute(q.src1);
+                define(q);
+                break;
+            case OP_PRINT:
+                substitute(q.src1);
+                break;
+            case OP_GOTO:
+                jumpTo(q.dst.id, i);
+                reachable = false;
+                break;
+            case OP_IF_FALSE:
+            case OP_IF_NE:
+            {
+                substitute(q.src1);
+                if (q.op == OP_IF_NE)
+                    substitute(q.src2);
+                int taken = branchTaken(q);
+                if (taken == -1)
+                {
+                    jumpTo(q.dst.id, i);
+                    break;
+                }
+                resolvedBranches++;
+                if (taken)
+                {
+                    q = Quad(OP_GOTO, q.dst);
+                    jumpTo(q.dst.id, i);
+                    reachable = false;
+                }
+                else
+                {
+                    removed[i - first] = true;
+                }
+                break;
+            }
+            case OP_JUMP_TABLE:
+            {
+                substitute(q.src1);
+                Number n;
+                if (q.src1.kind == OPND_CONST && number(q.src1.id, n) && !n.isFloat)
+                {
+                    const JumpTable &table = icg.jumpTables[q.src2.id];
+                    int64_t entry = n.i - table.low;
+                    bool inside = entry >= 0 && entry < (int64_t)table.targets.size();
+                    q = Quad(OP_GOTO, inside ? Operand(OPND_LABEL, table.targets[(size_t)entry]) : q.dst);
+                    jumpTo(q.dst.id, i);
+                    resolvedBranches++;
+                }
+                else
+                {
+                    // Each distinct target once, holes all point at one label
+                    tableTargets.clear();
+                    icg.forEachJumpTarget(q, [&](int label) { tableTargets.push_back(label); });
+                    sort(tableTargets.begin(), tableTargets.end());
+                    tableTargets.erase(unique(tableTargets.begin(), tableTargets.end()), tableTargets.end());
+                    for (int label : tableTargets)
+                        jumpTo(label, i);
+                }
+                reachable = false;
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        size_t out = first;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (!removed[i - first])
+                code[out++] = code[i];
+        }
+        removedInstructions += code.size() - out;
+        code.erase(code.begin() + out, code.end());
+
+        for (const auto &change : changes)
+            values[change.first] = -1;
+        changes.clear();
+        jumps.clear();
+    }
+
+    string summary() const
+    {
+        return to_string(foldedOperations) + " folded, " + to_string(propagatedOperands) + " operands propagated, " +
+               to_string(resolvedBranches) + " branches resolved";
+    }
+
+private:
+    // Sizes the tables and finds loop headers (targets of backward jumps)
+    void prepare(size_t first)
+    {
+        const vector<Quad> &code = icg.instructions;
+        slotBase = icg.variableCount();
+        if (values.size() < (size_t)slotBase + icg.tempCount)
+        {
+            values.resize((size_t)slotBase + icg.tempCount, -1);
+            scratch.resize(values.size(), Scratch{0, 0, 0, 0});
+        }
+        if ((int)labelPos.size() < icg.labelCount)
+        {
+            firstJump.resize(icg.labelCount, -1);
+            labelPos.resize(icg.labelCount, NO_POS);
+            loopEnd.resize(icg.labelCount, 0);
+        }
+
+        for (size_t i = first; i < code.size(); i++)
+        {
+            const Quad &q = code[i];
+            if (q.op == OP_LABEL)
+            {
+                labelPos[q.dst.id] = i;
+            }
+            else if (isJumpOp(q.op))
+            {
+                icg.forEachJumpTarget(q, [&](int label)
+                                      {
+                                          if (labelPos[label] != NO_POS)
+                                              loopEnd[label] = i;
+                                      });
+            }
+        }
+    }
+
+    int slotOf(const Operand &operand) const
+    {
+        return operand.kind == OPND_VAR ? operand.id : slotBase + operand.id;
+    }
+
+    void set(int slot, int value)
+    {
+        if (values[slot] != value)
+        {
+            changes.push_back({slot, values[slot]});
+            values[slot] = value;
+        }
+    }
+
+    void substitute(Operand &operand)
+    {
+        if (operand.kind != OPND_VAR && operand.kind != OPND_TEMP)
+            return;
+        int value = values[slotOf(operand)];
+        if (value != -1)
+        {
+            operand = Operand(OPND_CONST, value);
+            propagatedOperands++;
+        }
+    }
+
+    // Records what the destination of an assignment or operation now holds.
+    // A known value keeps the destination's type so that substituting it
+    // later does not change how the value is printed or stored.
+    void define(const Quad &q)
+    {
+        int value = -1;
+        if (q.op == OP_ASSIGN && q.src1.kind == OPND_CONST)
+        {
+            ValueType want = icg.typeOf(q.dst);
+            ValueType have = icg.typeOf(q.src1);
+            Number n;
+            if (want == have)
+                value = q.src1.id;
+            else if (want == VT_BOOL && number(q.src1.id, n) && !n.isFloat && (n.i == 0 || n.i == 1))
+                value = icg.constant(VT_BOOL, n.i ? "true" : "false").id;
+            else if (want == VT_INT && number(q.src1.id, n) && !n.isFloat)
+                value = icg.constant(VT_INT, to_string(n.i)).id;
+        }
+        set(slotOf(q.dst), value);
+    }
+
+    void jumpTo(int label, size_t pos)
+    {
+        if (labelPos[label] > pos)
+        {
+            jumps.push_back(Jump{changes.size(), firstJump[label]});
+            firstJump[label] = (int)jumps.size() - 1;
+        }
+    }
+
+    // Returns whether code after the label is reachable
+    bool enterLabel(int label, size_t pos, bool fallthrough)
+    {
+        jumpSnapshots.clear();
+        for (int k = firstJump[label]; k != -1; k = jumps[k].next)
+            jumpSnapshots.push_back(jumps[k].snapshot);
+        firstJump[label] = -1;
+        bool reachable = fallthrough || !jumpSnapshots.empty();
+        if (!jumpSnapshots.empty())
+            merge(jumpSnapshots, fallthrough);
+
+        // Loops are only entered through their header, so a header nothing
+        // reaches from above is dead along with its body
+        if (reachable && loopEnd[label] > pos)
+        {
+            const vector<Quad> &code = icg.instructions;
+            for (size_t i = pos + 1; i < loopEnd[label]; i++)
+            {
+                if (isDefinitionOp(code[i].op))
+                    set(slotOf(code[i].dst), -1);
+            }
+        }
+        labelPos[label] = NO_POS;
+        loopEnd[label] = 0;
+        return reachable;
+    }
+
+    // Meets the states recorded at `snapshots` (and the current one when control
+    // also falls through) for every slot changed since the oldest of them.
+    // Walking the change log backwards rebuilds each slot's value at every
+    // recorded point.
+    void merge(vector<size_t> &snapshots, bool fallthrough)
+    {
+        sort(snapshots.begin(), snapshots.end(), greater<size_t>());
+        size_t oldest = snapshots.back();
+
+        mergeStamp++;
+        mergeSlots.clear();
+        size_t next = 0;
+        for (size_t pos = changes.size();; pos--)
+        {
+            for (; next < snapshots.size() && snapshots[next] == pos; next++)
+            {
+                for (int slot : mergeSlots)
+                    meet(scratch[slot].met, scratch[slot].before);
+            }
+            if (pos == oldest)
+                break;
+            const auto &change = changes[pos - 1];
+            Scratch &slot = scratch[change.first];
+            if (slot.stamp != mergeStamp)
+            {
+                slot = Scratch{mergeStamp, 0, UNSET, next};
+                mergeSlots.push_back(change.first);
+            }
+            slot.before = change.second;
+        }
+
+        for (int slot : mergeSlots)
+        {
+            int value = scratch[slot].met;
+            if (fallthrough || scratch[slot].jumpsPassed > 0)
+                meet(value, values[slot]);
+            set(slot, value == UNSET ? -1 : value);
+        }
+    }
+
+    void meet(int &into, int value)
+    {
+        if (into == UNSET)
+            into = value;
+        else if (into != value && (into == -1 || value == -1 || !sameConstant(into, value)))
+            into = -1;
+    }
+
+    bool sameConstant(int a, int b) const
+    {
+        return icg.constants[a].type == icg.constants[b].type && icg.constants[a].symbol == icg.constants[b].symbol;
+    }
+
+    // Numeric value of an int, bool, char or float constant
+    bool number(int id, Number &n) const
+    {
+        string_view text = icg.constantText(id);
+        n = Number{false, 0, 0.0};
+        switch (icg.constants[id].type)
+        {
+        case VT_INT:
+        {
+            auto result = from_chars(text.data(), text.data() + text.size(), n.i);
+            return result.ec == errc() && result.ptr == text.data() + text.size() && n.i >= INT32_MIN &&
+                   n.i <= INT32_MAX;
+        }
+        case VT_BOOL:
+            n.i = text == "true" ? 1 : 0;
+            return true;
+        case VT_CHAR:
+            n.i = text.empty() ? 0 : (unsigned char)text[0];
+            return true;
+        case VT_FLOAT:
+        {
+            n.isFloat = true;
+            float value;
+            auto result = from_chars(text.data(), text.data() + text.size(), value);
+            n.f = value;
+            return result.ec == errc() && result.ptr == text.data() + text.size();
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Constant id for the result of q, or -1 if it cannot be folded. Integer
+    // arithmetic wraps like the generated 32-bit code; division by zero and
+    // INT_MIN / -1 are left for run time.
+    int fold(const Quad &q)
+    {
+        Number a, b;
+        if (q.src1.kind != OPND_CONST || q.src2.kind != OPND_CONST || !number(q.src1.id, a) || !number(q.src2.id, b))
+            return -1;
+
+        if (isComparisonOp(q.op))
+        {
+            bool result;
+            if (!a.isFloat && !b.isFloat)
+                result = compare(q.op, a.i, b.i);
+            else
+                result = compare(q.op, a.isFloat ? a.f : (float)a.i, b.isFloat ? b.f : (float)b.i);
+            return icg.constant(VT_INT, result ? "1" : "0").id;
+        }
+
+        if (icg.typeOf(q.dst) != VT_FLOAT)
+        {
+            if (a.isFloat || b.isFloat)
+                return -1;
+            int64_t result;
+            switch (q.op)
+            {
+            case OP_ADD:
+                result = a.i + b.i;
+                break;
+            case OP_SUB:
+                result = a.i - b.i;
+                break;
+            case OP_MUL:
+                result = a.i * b.i;
+                break;
+            default:
+                if (b.i == 0 || (a.i == INT32_MIN && b.i == -1))
+                    return -1;
+                result = a.i / b.i;
+                break;
+            }
+            return icg.constant(VT_INT, to_string((int32_t)(uint32_t)result)).id;
+        }
+
+        // REAL4 arithmetic; only results that read back as a plain decimal
+        // literal are folded
+        float x = a.isFloat ? (float)a.f : (float)a.i;
+        float y = b.isFloat ? (float)b.f : (float)b.i;
+        float result;
+        switch (q.op)
+        {
+        case OP_ADD:
+            result = x + y;
+            break;
+        case OP_SUB:
+            result = x - y;
+            break;
+        case OP_MUL:
+            result = x * y;
+            break;
+        default:
+            if (y == 0)
+                return -1;
+            result = x / y;
+            break;
+        }
+        char text[32];
+        auto written = to_chars(text, text + sizeof(text), result);
+        if (written.ec != errc())
+            return -1;
+        string literal(text, written.ptr);
+        if (literal.find_first_not_of("-0123456789.") != string::npos)
+            return -1;
+        if (literal.find('.') == string::npos)
+            literal += ".0";
+        return icg.constant(VT_FLOAT, literal).id;
+    }
+
+    template <typename T>
+    static bool compare(OpCode op, T a, T b)
+    {
+        switch (op)
+        {
+        case OP_EQ:
+            return a == b;
+        case OP_NE:
+            return a != b;
+        case OP_LT:
+            return a < b;
+        case OP_GT:
+            return a > b;
+        case OP_LE:
+            return a <= b;
+        default:
+            return a >= b;
+        }
+    }
+
+    // 1 if the jump is always taken, 0 if never, -1 if unknown
+    int branchTaken(const Quad &q) const
+    {
+        Number a, b;
+        if (q.src1.kind != OPND_CONST || !number(q.src1.id, a) || a.isFloat)
+            return -1;
+        if (q.op == OP_IF_FALSE)
+            return a.i == 0 ? 1 : 0;
+        if (q.src2.kind != OPND_CONST || !number(q.src2.id, b) || b.isFloat)
+            return -1;
+        return a.i != b.i ? 1 : 0;
+    }
+};
+
+// Removes code that cannot run or has no effect: instructions that no jump
+// or fallthrough reaches, jumps to the next instruction, labels nothing
+// jumps to, and assignments whose value is overwritten or never read.
+// Temps never outlive the statement that made them, but variables only
+// count as unread when the range is the whole program. A division that may
+// fault stays even when its result is unused.
+class DeadCodeElimination
+{
+private:
+    IntermediateCodeGnerator &icg;
+
+    // Per label, only valid during a run
+    vector<size_t> labelPos;
+    vector<int> labelUses;
+
+    // Per slot (variable id, then slotBase + temp id)
+    vector<int> reads;
+    vector<size_t> overwrittenIn; // Block in which a later store hides the current value
+    vector<size_t> storedIn;      // Walk that kept a store to the slot
+    vector<size_t> touchedIn;     // Basic block, in this walk, that goes on to use or store the slot
+    int slotBase = 0;
+    size_t block = 0;
+    size_t walk = 0;
+    size_t touchStamp = 0;
+
+public:
+    size_t unreachable = 0;
+    size_t uselessJumps = 0;
+    size_t unusedLabels = 0;
+    size_t deadStores = 0;
+
+    DeadCodeElimination(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    void run()
+    {
+        run(0, 0, 0, true);
+    }
+
+    // Cleans up instructions [first, end), which may only jump to their own
+    // labels. Temps from firstTemp and constants from firstConstant on belong
+    // to the range and lose their storage once nothing refers to them.
+    void run(size_t first, int firstTemp, int firstConstant, bool wholeProgram)
+    {
+        prepare();
+        removeUnreachable(first);
+        removeUselessCode(first, wholeProgram);
+        removeUnusedLabels(first);
+        releaseStorage(first, firstTemp, firstConstant, wholeProgram);
+    }
+
+    size_t removedCount() const
+    {
+        return unreachable + uselessJumps + unusedLabels + deadStores;
+    }
+
+    string summary() const
+    {
+        return to_string(removedCount()) + " removed (" + to_string(unreachable) + " unreachable, " +
+               to_string(uselessJumps) + " jumps, " + to_string(unusedLabels) + " labels, " + to_string(deadStores) +
+               " dead stores)";
+    }
+
+private:
+    void prepare()
+    {
+        slotBase = icg.variableCount();
+        size_t slots = (size_t)slotBase + icg.tempCount;
+        if (reads.size() < slots)
+        {
+            reads.resize(slots, 0);
+            overwrittenIn.resize(slots, 0);
+            storedIn.resize(slots, 0);
+            touchedIn.resize(slots, 0);
+        }
+        if ((int)labelPos.size() < icg.labelCount)
+        {
+            labelPos.resize(icg.labelCount, 0);
+            labelUses.resize(icg.labelCount, 0);
+        }
+    }
+
+    static bool isSlot(const Operand &operand)
+    {
+        return operand.kind == OPND_VAR || operand.kind == OPND_TEMP;
+    }
+
+    int slotOf(const Operand &operand) const
+    {
+        return operand.kind == OPND_VAR ? operand.id : slotBase + operand.id;
+    }
+
+    // Drops the flagged instructions of [first, end)
+    void compact(size_t first, const vector<bool> &removed)
+    {
+        vector<Quad> &code = icg.instructions;
+        size_t out = first;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (!removed[i - first])
+                code[out++] = code[i];
+        }
+        code.erase(code.begin() + out, code.end());
+    }
+
+    void removeUnreachable(size_t first)
+    {
+        const vector<Quad> &code = icg.instructions;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (code[i].op == OP_LABEL)
+                labelPos[code[i].dst.id] = i;
+        }
+
+        vector<bool> removed(code.size() - first, true);
+        vector<size_t> pending;
+        if (first < code.size())
+            pending.push_back(first);
+        while (!pending.empty())
+        {
+            size_t i = pending.back();
+            pending.pop_back();
+            for (; i < code.size() && removed[i - first]; i++)
+            {
+                removed[i - first] = false;
+                if (isJumpOp(code[i].op))
+                    icg.forEachJumpTarget(code[i], [&](int label) { pending.push_back(labelPos[label]); });
+                if (isUnconditionalJump(code[i].op))
+                    break;
+            }
+        }
+
+        size_t count = std::count(removed.begin(), removed.end(), true);
+        if (count)
+            compact(first, removed);
+        unreachable += count;
+    }
+
+    // Removes jumps over nothing but labels, and stores whose value is not
+    // live afterwards. The walk goes backwards and looks through what it
+    // already removed, so an `if` whose body turns out to be dead loses its
+    // jumps and then its condition in the same walk. Liveness is computed
+    // once up front; a store whose last read goes later in the walk is
+    // caught by counting reads, and only one read earlier in a loop needs
+    // another walk.
+    void removeUselessCode(size_t first, bool wholeProgram)
+    {
+        const vector<Quad> &code = icg.instructions;
+        ControlFlowGraph cfg(icg, first);
+        Liveness liveness(icg, cfg, !wholeProgram);
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (const Operand *operand : {&code[i].dst, &code[i].src1, &code[i].src2})
+            {
+                if (isSlot(*operand))
+                    reads[slotOf(*operand)] = 0;
+            }
+        }
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (const Operand *operand : {&code[i].src1, &code[i].src2})
+            {
+                if (isSlot(*operand))
+                    reads[slotOf(*operand)]++;
+            }
+        }
+
+        vector<bool> removed(code.size() - first, false);
+        vector<int> labelsAhead; // Labels between here and the next kept instruction
+        bool again = true;
+        while (again)
+        {
+            again = false;
+            walk++;
+            block++;
+            labelsAhead.clear();
+            int basicBlock = (int)cfg.size() - 1;
+            size_t basicBlockStamp = ++touchStamp;
+            for (size_t i = code.size(); i-- > first;)
+            {
+                const Quad &q = code[i];
+                if (i < cfg.blocks[basicBlock].first)
+                {
+                    basicBlock--;
+                    basicBlockStamp = ++touchStamp;
+                }
+                if (removed[i - first])
+                    continue;
+                if (q.op == OP_LABEL)
+                {
+                    labelsAhead.push_back(q.dst.id);
+                    block++; // Values may be read past a block boundary
+                    continue;
+                }
+
+                bool useless = false;
+                if (isJumpOp(q.op))
+                {
+                    useless = q.op != OP_JUMP_TABLE &&
+                              find(labelsAhead.begin(), labelsAhead.end(), q.dst.id) != labelsAhead.end();
+                    if (useless)
+                        uselessJumps++;
+                    else
+                        block++;
+                }
+                else if (isDefinitionOp(q.op))
+                {
+                    int slot = slotOf(q.dst);
+                    bool unread = reads[slot] == 0 && (q.dst.kind == OPND_TEMP || wholeProgram);
+                    bool deadAfterBlock = touchedIn[slot] != basicBlockStamp && !liveness.liveOut(basicBlock, q.dst);
+                    useless = (unread || deadAfterBlock || overwrittenIn[slot] == block ||
+                               (q.op == OP_ASSIGN && q.src1 == q.dst)) &&
+                              !icg.mayFault(q);
+                    if (useless)
+                    {
+                        deadStores++;
+                    }
+                    else
+                    {
+                        overwrittenIn[slot] = block;
+                        storedIn[slot] = walk;
+                        touchedIn[slot] = basicBlockStamp;
+                    }
+                }
+
+                for (const Operand *operand : {&q.src1, &q.src2})
+                {
+                    if (!isSlot(*operand))
+                        continue;
+                    int slot = slotOf(*operand);
+                    if (!useless)
+                    {
+                        overwrittenIn[slot] = 0;
+                        touchedIn[slot] = basicBlockStamp;
+                    }
+                    else if (--reads[slot] == 0 && storedIn[slot] == walk)
+                        again = true; // A store already kept in this walk just died
+                }
+                if (useless)
+                    removed[i - first] = true;
+                else
+                    labelsAhead.clear();
+            }
+            block++;
+        }
+        if (std::count(removed.begin(), removed.end(), true))
+            compact(first, removed);
+    }
+
+    void removeUnusedLabels(size_t first)
+    {
+        const vector<Quad> &code = icg.instructions;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (code[i].op == OP_LABEL)
+                labelUses[code[i].dst.id] = 0;
+        }
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (isJumpOp(code[i].op))
+                icg.forEachJumpTarget(code[i], [&](int label) { labelUses[label]++; });
+        }
+
+        vector<bool> removed(code.size() - first, false);
+        size_t count = 0;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (code[i].op == OP_LABEL && labelUses[code[i].dst.id] == 0)
+            {
+                removed[i - first] = true;
+                count++;
+            }
+        }
+        if (count)
+            compact(first, removed);
+        unusedLabels += count;
+    }
+
+    // Temps, string and float constants and (for a whole program) variables
+    // that lost their last reference get no storage
+    void releaseStorage(size_t first, int firstTemp, int firstConstant, bool wholeProgram)
+    {
+        const vector<Quad> &code = icg.instructions;
+        vector<bool> usedTemps(icg.tempCount - firstTemp, false);
+        vector<bool> usedConstants(icg.constants.size() - firstConstant, false);
+        vector<bool> usedVariables(wholeProgram ? slotBase : 0, false);
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (const Operand *operand : {&code[i].dst, &code[i].src1, &code[i].src2})
+            {
+                if (operand->kind == OPND_TEMP && operand->id >= firstTemp)
+                    usedTemps[operand->id - firstTemp] = true;
+                else if (operand->kind == OPND_CONST && operand->id >= firstConstant)
+                    usedConstants[operand->id - firstConstant] = true;
+                else if (operand->kind == OPND_VAR && wholeProgram)
+                    usedVariables[operand->id] = true;
+            }
+        }
+
+        for (size_t k = 0; k < usedTemps.size(); k++)
+        {
+            if (!usedTemps[k])
+                icg.tempUsed[firstTemp + k] = false;
+        }
+        for (size_t k = 0; k < usedConstants.size(); k++)
+        {
+            if (!usedConstants[k] && icg.constants[firstConstant + k].symbol != -1)
+                icg.releaseConstant(firstConstant + (int)k);
+        }
+        for (int variable = 0; variable < (int)usedVariables.size() && variable < icg.variableCount(); variable++)
+        {
+            if (!usedVariables[variable] && icg.variableSymbols[variable] != -1)
+                icg.releaseVariable(variable);
+        }
+    }
+};
+
+// Global value numbering on SSA form, after Briggs, Cooper and Simpson's
+// dominator-based value numbering. Phis go at the iterated dominance
+// frontiers of the stores to each variable or temp that some block reads
+// before storing it. A walk of the dominator tree then gives each store
+// and phi a new version of its slot and each version a value number: a
+// copy shares its source's number, an operation gets the number of any
+// operation with the same operator and operand numbers, and a phi gets
+// the number its arguments agree on. Numbers are held by the version that
+// first took them while it is in scope and not overwritten. An operation
+// whose number is held becomes a copy of the holder, a store of the number
+// the slot already holds is dropped, and a temp is read from the holder of
+// its number, which leaves dead code elimination to drop the temp.
+//
+// Versions are kept beside the TAC instead of renaming it. A slot is only
+// ever read where it holds the version in question, so the versions of a
+// slot never overlap, no phi needs a copy, and going back out of SSA form
+// is just dropping the version numbers. A slot without phis that is stored
+// in more than one block may hold some other block's value after a join,
+// so its versions only count as held in their own block.
+class GlobalValueNumbering
+{
+private:
+    IntermediateCodeGnerator &icg;
+    int slotBase = 0;
+    DominatorTree dominators;
+    vector<bool> removed; // Per instruction of the range
+
+    // Phis grouped by block, each with an argument per predecessor of its
+    // block in the graph's order
+    struct Phi
+    {
+        int slot;
+        int firstArgument;
+        int version;
+    };
+    vector<Phi> phis;
+    vector<int> phiStart;  // Per block
+    vector<int> arguments; // Versions, UNFILLED until the predecessor is walked
+
+    // Every store and phi of the range defines a version of its slot
+    vector<int> versionSlot;
+    vector<int> versionValue;
+    vector<int> versionBlock;
+    vector<int> current; // Per slot, the version at the walk position or -1; all -1 between runs
+    vector<int> holder;  // Per value number, the version it is read from or -1
+
+    struct Undo
+    {
+        bool isHolder;
+        int index;
+        int previous;
+    };
+    vector<Undo> undo;
+
+    // Value numbers of operations and conversions (kind op * 8 + result
+    // type), in an open addressing table (-1 = empty, capacity a power of two)
+    struct Expression
+    {
+        int kind;
+        int left;
+        int right;
+        int value;
+    };
+    vector<Expression> expressions;
+    vector<int> table;
+    vector<int> constantValue; // Per constant, valid while constantRun is runStamp
+    vector<size_t> constantRun;
+
+    // Per slot and per block, for placing phis
+    vector<size_t> storedIn;
+    vector<size_t> exposed;
+    vector<int> firstStore;
+    vector<int> storeBlocks;
+    vector<size_t> hasPhi;
+    vector<size_t> queued;
+    size_t stamp = 0;
+    size_t runStamp = 0;
+    int block = 0; // At the walk position
+
+    static constexpr int UNFILLED = -2;
+
+public:
+    size_t phiCount = 0;
+    size_t redundant = 0;
+    size_t removedStores = 0;
+    size_t renamedOperands = 0;
+
+    GlobalValueNumbering(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    // Optimizes instructions [first, end); the range may only jump to its
+    // own labels
+    void run(size_t first = 0)
+    {
+        vector<Quad> &code = icg.instructions;
+        if (first >= code.size())
+            return;
+        ControlFlowGraph cfg(icg, first);
+        dominators.build(cfg);
+        prepare(cfg, first);
+        placePhis(cfg);
+        walk(cfg, first);
+
+        size_t out = first;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (!removed[i - first])
+                code[out++] = code[i];
+        }
+        code.erase(code.begin() + out, code.end());
+    }
+
+    string summary() const
+    {
+        return to_string(phiCount) + " phis, " + to_string(redundant) + " redundant, " + to_string(removedStores) +
+               " stores removed, " + to_string(renamedOperands) + " operands renamed";
+    }
+
+private:
+    void prepare(const ControlFlowGraph &cfg, size_t first)
+    {
+        slotBase = icg.variableCount();
+        size_t slots = (size_t)slotBase + icg.tempCount;
+        if (current.size() < slots)
+        {
+            current.resize(slots, -1);
+            storedIn.resize(slots, 0);
+            exposed.resize(slots, 0);
+            firstStore.resize(slots, -1);
+            storeBlocks.resize(slots, 0);
+        }
+        removed.assign(icg.instructions.size() - first, false);
+        hasPhi.assign(cfg.size(), 0);
+        queued.assign(cfg.size(), 0);
+        versionSlot.clear();
+        versionValue.clear();
+        versionBlock.clear();
+        holder.clear();
+        expressions.clear();
+        size_t capacity = 1024;
+        while (capacity < 2 * (icg.instructions.size() - first))
+            capacity *= 2;
+        table.assign(capacity, -1);
+    }
+
+    int slotOf(const Operand &operand) const
+    {
+        return operand.kind == OPND_VAR ? operand.id : slotBase + operand.id;
+    }
+
+    Operand operandOf(int slot) const
+    {
+        return slot < slotBase ? Operand(OPND_VAR, slot) : Operand(OPND_TEMP, slot - slotBase);
+    }
+
+    // Semi-pruned: only slots read in some block before being stored there
+    // get phis, so expression temps never do
+    void placePhis(const ControlFlowGraph &cfg)
+    {
+        vector<pair<int, int>> stores; // (block, next store of the slot)
+        vector<int> exposedSlots;
+        size_t run = runStamp = ++stamp;
+        for (int b : dominators.order)
+        {
+            size_t blockStamp = ++stamp;
+            for (size_t i = cfg.blocks[b].first; i < cfg.blocks[b].last; i++)
+            {
+                const Quad &q = cfg.instruction(i);
+                for (const Operand *operand : {&q.src1, &q.src2})
+                {
+                    if (!SlotNumbering::isSlot(*operand))
+                        continue;
+                    int slot = slotOf(*operand);
+                    if (storedIn[slot] != blockStamp && exposed[slot] != run)
+                    {
+                        exposed[slot] = run;
+                        exposedSlots.push_back(slot);
+                    }
+                }
+                if (isDefinitionOp(q.op))
+                {
+                    int slot = slotOf(q.dst);
+                    if (storedIn[slot] == blockStamp)
+                        continue;
+                    if (storedIn[slot] < run)
+                    {
+                        firstStore[slot] = -1;
+                        storeBlocks[slot] = 0;
+                    }
+                    storedIn[slot] = blockStamp;
+                    storeBlocks[slot]++;
+                    stores.push_back({b, firstStore[slot]});
+                    firstStore[slot] = (int)stores.size() - 1;
+                }
+            }
+        }
+
+        vector<pair<int, int>> placed; // (block, slot)
+        vector<int> work;
+        for (int slot : exposedSlots)
+        {
+            if (storedIn[slot] < run)
+                continue;
+            size_t mark = ++stamp;
+            for (int k = firstStore[slot]; k != -1; k = stores[k].second)
+            {
+                queued[stores[k].first] = mark;
+                work.push_back(stores[k].first);
+            }
+            while (!work.empty())
+            {
+                int b = work.back();
+                work.pop_back();
+                for (int join : dominators.frontier(b))
+                {
+                    if (hasPhi[join] == mark)
+                        continue;
+                    hasPhi[join] = mark;
+                    placed.push_back({join, slot});
+                    if (queued[join] != mark)
+                    {
+                        queued[join] = mark;
+                        work.push_back(join);
+                    }
+                }
+            }
+        }
+
+        int count = (int)cfg.size();
+        phiStart.assign(count + 1, 0);
+        for (const auto &phi : placed)
+            phiStart[phi.first + 1]++;
+        for (int b = 0; b < count; b++)
+            phiStart[b + 1] += phiStart[b];
+        phis.resize(placed.size());
+        vector<int> fill(phiStart.begin(), phiStart.end() - 1);
+        for (const auto &phi : placed)
+            phis[fill[phi.first]++] = Phi{phi.second, 0, -1};
+        int argumentCount = 0;
+        for (int b = 0; b < count; b++)
+        {
+            for (int k = phiStart[b]; k < phiStart[b + 1]; k++)
+            {
+                phis[k].firstArgument = argumentCount;
+                argumentCount += (int)cfg.predecessors(b).size();
+            }
+        }
+        arguments.assign(argumentCount, UNFILLED);
+        phiCount += phis.size();
+    }
+
+    // Preorder over the dominator tree, with children in reverse postorder
+    // so a block's predecessors are all walked before it except along
+    // back edges. Leaving a block undoes what it set.
+    void walk(const ControlFlowGraph &cfg, size_t first)
+    {
+        struct Frame
+        {
+            int block;
+            int child; // -1 before the block itself is visited
+            size_t undoSize;
+        };
+        vector<Frame> frames;
+        if (!dominators.order.empty())
+            frames.push_back(Frame{0, -1, 0});
+        while (!frames.empty())
+        {
+            Frame &frame = frames.back();
+            if (frame.child == -1)
+            {
+                visit(cfg, frame.block, first);
+                frame.child = 0;
+            }
+            const DominatorTree::BlockList children = dominators.children(frame.block);
+            if (frame.child < (int)children.size())
+            {
+                int child = children.begin()[frame.child++];
+                frames.push_back(Frame{child, -1, undo.size()});
+                continue;
+            }
+            restore(frame.undoSize);
+            frames.pop_back();
+        }
+    }
+
+    void visit(const ControlFlowGraph &cfg, int b, size_t first)
+    {
+        vector<Quad> &code = icg.instructions;
+        block = b;
+        for (int k = phiStart[b]; k < phiStart[b + 1]; k++)
+            phis[k].version = define(phis[k].slot, phiValue(cfg, b, k));
+
+        for (size_t i = cfg.blocks[b].first; i < cfg.blocks[b].last; i++)
+        {
+            Quad &q = code[i];
+            if (q.src1.kind == OPND_TEMP)
+                rename(q.src1);
+            if (q.src2.kind == OPND_TEMP)
+                rename(q.src2);
+
+            if (isBinaryOp(q.op))
+            {
+                int value = operationValue(q);
+                int version = holder[value];
+                if (version != -1 && isCurrent(version))
+                {
+                    Operand source = operandOf(versionSlot[version]);
+                    if (source == q.dst)
+                    {
+                        removed[i - first] = true;
+                        removedStores++;
+                        continue;
+                    }
+                    q = Quad(OP_ASSIGN, q.dst, source);
+                    redundant++;
+                }
+                define(slotOf(q.dst), value);
+            }
+            else if (q.op == OP_ASSIGN)
+            {
+                int value = valueOf(q.src1);
+                if (icg.typeOf(q.dst) != icg.typeOf(q.src1))
+                    value = lookup(OP_ASSIGN * 8 + icg.typeOf(q.dst), value, 0);
+                int slot = slotOf(q.dst);
+                if (current[slot] != -1 && isCurrent(current[slot]) && versionValue[current[slot]] == value)
+                {
+                    removed[i - first] = true;
+                    removedStores++;
+                    continue;
+                }
+                define(slot, value);
+            }
+        }
+
+        for (int s : cfg.successors(b))
+        {
+            const ControlFlowGraph::BlockList predecessors = cfg.predecessors(s);
+            int index = (int)(find(predecessors.begin(), predecessors.end(), b) - predecessors.begin());
+            for (int k = phiStart[s]; k < phiStart[s + 1]; k++)
+                arguments[phis[k].firstArgument + index] = currentVersion(phis[k].slot);
+        }
+    }
+
+    // The number all arguments agree on, else that of an earlier phi of the
+    // block with the same arguments. A back edge not walked yet, or control
+    // entering the range at its first block, gives a new number.
+    int phiValue(const ControlFlowGraph &cfg, int b, int k)
+    {
+        if (b == 0)
+            return newValue();
+        const ControlFlowGraph::BlockList predecessors = cfg.predecessors(b);
+        int agreed = -1;
+        bool agree = true;
+        for (size_t j = 0; j < predecessors.size(); j++)
+        {
+            if (!dominators.reachable(predecessors.begin()[j]))
+                continue;
+            int version = arguments[phis[k].firstArgument + j];
+            if (version == UNFILLED)
+                return newValue();
+            int value = versionValue[version];
+            agree = agree && (agreed == -1 || agreed == value);
+            agreed = value;
+        }
+        if (agree && agreed != -1)
+            return agreed;
+
+        for (int other = phiStart[b]; other < k; other++)
+        {
+            bool same = true;
+            for (size_t j = 0; j < predecessors.size() && same; j++)
+            {
+                if (!dominators.reachable(predecessors.begin()[j]))
+                    continue;
+                same = versionValue[arguments[phis[k].firstArgument + j]] ==
+                       versionValue[arguments[phis[other].firstArgument + j]];
+            }
+            if (same)
+                return versionValue[phis[other].version];
+        }
+        return newValue();
+    }
+
+    // Reads the slot holding the operand's number instead, if that is not
+    // the operand itself
+    void rename(Operand &operand)
+    {
+        int version = holder[valueOf(operand)];
+        if (version == -1 || !isCurrent(version) || versionSlot[version] == slotOf(operand))
+            return;
+        operand = operandOf(versionSlot[version]);
+        renamedOperands++;
+    }
+
+    // Commutative operations and mirrored comparisons are numbered alike.
+    // String + concatenates, so its operands keep their order.
+    int operationValue(const Quad &q)
+    {
+        OpCode op = q.op;
+        int left = valueOf(q.src1);
+        int right = valueOf(q.src2);
+        bool commutative = (op == OP_ADD && icg.typeOf(q.dst) != VT_STRING) || op == OP_MUL || op == OP_EQ || op == OP_NE;
+        if (op == OP_GT || op == OP_GE)
+        {
+            op = op == OP_GT ? OP_LT : OP_LE;
+            swap(left, right);
+        }
+        else if (commutative && left > right)
+        {
+            swap(left, right);
+        }
+        return lookup(op * 8 + icg.typeOf(q.dst), left, right);
+    }
+
+    int valueOf(const Operand &operand)
+    {
+        if (operand.kind == OPND_CONST)
+        {
+            if (constantValue.size() <= (size_t)operand.id)
+            {
+                constantValue.resize(icg.constants.size(), -1);
+                constantRun.resize(icg.constants.size(), 0);
+            }
+            if (constantRun[operand.id] != runStamp)
+            {
+                constantRun[operand.id] = runStamp;
+                constantValue[operand.id] = newValue();
+            }
+            return constantValue[operand.id];
+        }
+        return versionValue[currentVersion(slotOf(operand))];
+    }
+
+    // A slot read before any store in scope holds its value on entry to the
+    // range, which gets a version of its own
+    int currentVersion(int slot)
+    {
+        if (current[slot] == -1)
+            define(slot, newValue());
+        return current[slot];
+    }
+
+    bool isCurrent(int version) const
+    {
+        int slot = versionSlot[version];
+        if (current[slot] != version)
+            return false;
+        return versionBlock[version] == block || exposed[slot] == runStamp || storedIn[slot] < runStamp ||
+               storeBlocks[slot] == 1;
+    }
+
+    int define(int slot, int value)
+    {
+        int version = (int)versionSlot.size();
+        versionSlot.push_back(slot);
+        versionValue.push_back(value);
+        versionBlock.push_back(block);
+        undo.push_back(Undo{false, slot, current[slot]});
+        current[slot] = version;
+        if (holder[value] == -1 || !isCurrent(holder[value]))
+        {
+            undo.push_back(Undo{true, value, holder[value]});
+            holder[value] = version;
+        }
+        return version;
+    }
+
+    int newValue()
+    {
+        holder.push_back(-1);
+        return (int)holder.size() - 1;
+    }
+
+    void restore(size_t size)
+    {
+        while (undo.size() > size)
+        {
+            const Undo &u = undo.back();
+            (u.isHolder ? holder : current)[u.index] = u.previous;
+            undo.pop_back();
+        }
+    }
+
+    static size_t hashOf(int kind, int left, int right)
+    {
+        uint64_t key = ((uint64_t)(uint32_t)kind << 40) ^ ((uint64_t)(uint32_t)left << 20) ^ (uint32_t)right;
+        return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    int lookup(int kind, int left, int right)
+    {
+        size_t mask = table.size() - 1;
+        size_t i = hashOf(kind, left, right) & mask;
+        while (table[i] != -1)
+        {
+            const Expression &e = expressions[table[i]];
+            if (e.kind == kind && e.left == left && e.right == right)
+                return e.value;
+            i = (i + 1) & mask;
+        }
+        table[i] = (int)expressions.size();
+        expressions.push_back(Expression{kind, left, right, newValue()});
+        if (expressions.size() * 2 > table.size())
+            grow();
+        return expressions.back().value;
+    }
+
+    void grow()
+    {
+        vector<int> bigger(table.size() * 2, -1);
+        size_t mask = bigger.size() - 1;
+        for (int id = 0; id < (int)expressions.size(); id++)
+        {
+            const Expression &e = expressions[id];
+            size_t i = hashOf(e.kind, e.left, e.right) & mask;
+            while (bigger[i] != -1)
+                i = (i + 1) & mask;
+            bigger[i] = id;
+        }
+        table.swap(bigger);
+    }
+};
+
+// Loop optimizations over the natural loops of the TAC. A loop is found at
+// each backward jump: it spans the target label (the header) to the last
+// jump back to it, and counts only if nothing outside jumps into it, so the
+// header dominates the whole span and code placed right before the header
+// (the preheader) runs once on every entry. Operations whose operands no
+// store in a loop changes move to the preheader of the outermost such loop.
+// Then, in each loop, a product of a variable that the loop only steps by a
+// constant (a basic induction variable) and a constant becomes a temp set
+// in the preheader and stepped after the variable is.
+class LoopOptimization
+{
+private:
+    IntermediateCodeGnerator &icg;
+    int slotBase = 0;
+
+    struct Loop
+    {
+        size_t start; // Header label
+        size_t end;   // Last jump back to the header
+        int level;    // Depth on the walk's stack of open loops, -1 when not open
+    };
+    vector<Loop> loops; // By start, outer loops before the loops inside them
+
+    // Per label, set for the labels of the range
+    vector<size_t> labelPos;
+    vector<size_t> firstJump; // Position of the first and last jump to the label
+    vector<size_t> lastJump;
+
+    // Positions of the range's stores grouped by slot, in order, with each
+    // slot's first entry and count
+    vector<size_t> stores;
+    vector<int> storeSlots; // Slots with stores, to reset the counts
+    vector<int> storeStart;
+    vector<int> storeCount;
+
+    vector<int> hoistedTo; // Per slot, the loop whose preheader took its store, or -1
+    vector<int> reads;     // Per temp
+
+    static constexpr size_t NO_POS = (size_t)-1;
+
+public:
+    size_t loopCount = 0;
+    size_t hoisted = 0;
+    size_t reduced = 0;
+
+    LoopOptimization(IntermediateCodeGnerator &icg) : icg(icg) {}
+
+    // Optimizes instructions [first, end); the range may only jump to its
+    // own labels
+    void run(size_t first = 0)
+    {
+        findLoops(first);
+        loopCount += loops.size();
+        if (loops.empty())
+            return;
+        hoistInvariants(first);
+        findLoops(first);
+        reduceStrength(first);
+    }
+
+    string summary() const
+    {
+        return to_string(loopCount) + " loops, " + to_string(hoisted) + " hoisted, " + to_string(reduced) +
+               " strength reduced";
+    }
+
+private:
+    void findLoops(size_t first)
+    {
+        const vector<Quad> &code = icg.instructions;
+        if ((int)labelPos.size() < icg.labelCount)
+        {
+            labelPos.resize(icg.labelCount, NO_POS);
+            firstJump.resize(icg.labelCount, NO_POS);
+            lastJump.resize(icg.labelCount, 0);
+        }
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (code[i].op == OP_LABEL)
+            {
+                labelPos[code[i].dst.id] = i;
+                firstJump[code[i].dst.id] = NO_POS;
+                lastJump[code[i].dst.id] = 0;
+            }
+        }
+
+        vector<Loop> candidates;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (!isJumpOp(code[i].op))
+                continue;
+            icg.forEachJumpTarget(code[i], [&](int label)
+                                  {
+                                      firstJump[label] = min(firstJump[label], i);
+                                      lastJump[label] = max(lastJump[label], i);
+                                      if (labelPos[label] <= i)
+                                          candidates.push_back(Loop{labelPos[label], i, -1});
+                                  });
+        }
+        sort(candidates.begin(), candidates.end(), [](const Loop &a, const Loop &b)
+             { return a.start != b.start ? a.start < b.start : a.end > b.end; });
+
+        // Loops with one entry nest like the statements they came from
+        loops.clear();
+        vector<size_t> open;
+        for (size_t k = 0; k < candidates.size(); k++)
+        {
+            const Loop &loop = candidates[k];
+            if (k > 0 && candidates[k - 1].start == loop.start)
+                continue;
+            while (!open.empty() && loops[open.back()].end < loop.start)
+                open.pop_back();
+            if (!open.empty() && loops[open.back()].end < loop.end)
+                continue;
+            if (!hasOneEntry(loop))
+                continue;
+            open.push_back(loops.size());
+            loops.push_back(loop);
+        }
+    }
+
+    bool hasOneEntry(const Loop &loop) const
+    {
+        const vector<Quad> &code = icg.instructions;
+        for (size_t i = loop.start; i <= loop.end; i++)
+        {
+            if (code[i].op != OP_LABEL)
+                continue;
+            int label = code[i].dst.id;
+            if (firstJump[label] != NO_POS && (firstJump[label] < loop.start || lastJump[label] > loop.end))
+                return false;
+        }
+        return true;
+    }
+
+    int slotOf(const Operand &operand) const
+    {
+        return operand.kind == OPND_VAR ? operand.id : slotBase + operand.id;
+    }
+
+    void indexStores(size_t first)
+    {
+        const vector<Quad> &code = icg.instructions;
+        for (int slot : storeSlots)
+            storeCount[slot] = 0;
+        storeSlots.clear();
+
+        slotBase = icg.variableCount();
+        size_t slots = (size_t)slotBase + icg.tempCount;
+        if (storeCount.size() < slots)
+        {
+            storeStart.resize(slots, 0);
+            storeCount.resize(slots, 0);
+            hoistedTo.resize(slots, -1);
+        }
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (isDefinitionOp(code[i].op) && storeCount[slotOf(code[i].dst)]++ == 0)
+                storeSlots.push_back(slotOf(code[i].dst));
+        }
+        int start = 0;
+        for (int slot : storeSlots)
+        {
+            storeStart[slot] = start;
+            start += storeCount[slot];
+            storeCount[slot] = 0;
+        }
+        stores.resize(start);
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (isDefinitionOp(code[i].op))
+            {
+                int slot = slotOf(code[i].dst);
+                stores[storeStart[slot] + storeCount[slot]++] = i;
+            }
+        }
+    }
+
+    bool storedIn(int slot, const Loop &loop) const
+    {
+        auto begin = stores.begin() + storeStart[slot];
+        auto end = begin + storeCount[slot];
+        auto it = lower_bound(begin, end, loop.start);
+        return it != end && *it <= loop.end;
+    }
+
+    // Whether the operand has the same value all through the loop, counting
+    // stores already moved out in front of it
+    bool isInvariant(const Operand &operand, const Loop &loop) const
+    {
+        if (operand.kind != OPND_VAR && operand.kind != OPND_TEMP)
+            return true;
+        int slot = slotOf(operand);
+        if (hoistedTo[slot] != -1 && loops[hoistedTo[slot]].level != -1)
+            return loop.level >= loops[hoistedTo[slot]].level;
+        return !storedIn(slot, loop);
+    }
+
+    // Runs on every entry instead of only where it was: an operation into a
+    // temp stored nowhere else, and no division that could fault
+    bool canHoist(const Quad &q) const
+    {
+        return isBinaryOp(q.op) && q.dst.kind == OPND_TEMP && storeCount[slotOf(q.dst)] == 1 && !icg.mayFault(q);
+    }
+
+    void hoistInvariants(size_t first)
+    {
+        vector<Quad> &code = icg.instructions;
+        indexStores(first);
+
+        // Moves as (loop, instruction), in instruction order
+        vector<pair<int, size_t>> moves;
+        vector<int> open;
+        size_t next = 0;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            while (!open.empty() && loops[open.back()].end < i)
+            {
+                loops[open.back()].level = -1;
+                open.pop_back();
+            }
+            if (next < loops.size() && loops[next].start == i)
+            {
+                loops[next].level = (int)open.size();
+                open.push_back((int)next++);
+            }
+            if (open.empty() || !canHoist(code[i]))
+                continue;
+
+            // Invariant in a loop means invariant in the loops inside it
+            for (int loop : open)
+            {
+                if (isInvariant(code[i].src1, loops[loop]) && isInvariant(code[i].src2, loops[loop]))
+                {
+                    moves.push_back({loop, i});
+                    hoistedTo[slotOf(code[i].dst)] = loop;
+                    break;
+                }
+            }
+        }
+        for (int loop : open)
+            loops[loop].level = -1;
+        for (const auto &move : moves)
+            hoistedTo[slotOf(code[move.second].dst)] = -1;
+        if (moves.empty())
+            return;
+        hoisted += moves.size();
+
+        stable_sort(moves.begin(), moves.end(), [&](const pair<int, size_t> &a, const pair<int, size_t> &b)
+                    { return loops[a.first].start < loops[b.first].start; });
+        vector<bool> moved(code.size() - first, false);
+        for (const auto &move : moves)
+            moved[move.second - first] = true;
+
+        vector<Quad> tail;
+        tail.reserve(code.size() - first);
+        size_t m = 0;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (; m < moves.size() && loops[moves[m].first].start == i; m++)
+                tail.push_back(code[moves[m].second]);
+            if (!moved[i - first])
+                tail.push_back(code[i]);
+        }
+        code.erase(code.begin() + first, code.end());
+        code.insert(code.end(), tail.begin(), tail.end());
+    }
+
+    // The constant a loop adds to a variable stored once in it, as v = v + c,
+    // v = v - c or t = v + c; v = t
+    bool findStep(int variable, const Loop &loop, size_t &store, int64_t &step) const
+    {
+        const vector<Quad> &code = icg.instructions;
+        if (icg.variableTypes[variable] != VT_INT)
+            return false;
+        auto begin = stores.begin() + storeStart[variable];
+        auto end = begin + storeCount[variable];
+        auto it = lower_bound(begin, end, loop.start);
+        if (it == end || *it > loop.end || (it + 1 != end && *(it + 1) <= loop.end))
+            return false;
+        store = *it;
+
+        Operand self(OPND_VAR, variable);
+        const Quad *q = &code[store];
+        if (q->op == OP_ASSIGN && q->src1.kind == OPND_TEMP && store > loop.start && code[store - 1].dst == q->src1 &&
+            isBinaryOp(code[store - 1].op))
+            q = &code[store - 1];
+        if (q->op == OP_ADD && q->src1 == self && icg.intConstant(q->src2, step))
+            return true;
+        if (q->op == OP_ADD && q->src2 == self && icg.intConstant(q->src1, step))
+            return true;
+        if (q->op == OP_SUB && q->src1 == self && icg.intConstant(q->src2, step))
+        {
+            step = -step;
+            return true;
+        }
+        return false;
+    }
+
+    static bool isProductCandidate(const Quad &q)
+    {
+        return q.op == OP_MUL && q.dst.kind == OPND_TEMP &&
+               ((q.src1.kind == OPND_VAR && q.src2.kind == OPND_CONST) ||
+                (q.src1.kind == OPND_CONST && q.src2.kind == OPND_VAR));
+    }
+
+    void reduceStrength(size_t first)
+    {
+        vector<Quad> &code = icg.instructions;
+        if (none_of(code.begin() + first, code.end(), isProductCandidate))
+            return;
+        indexStores(first);
+
+        if ((int)reads.size() < icg.tempCount)
+            reads.resize(icg.tempCount, 0);
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (const Operand *operand : {&code[i].src1, &code[i].src2})
+            {
+                if (operand->kind == OPND_TEMP)
+                    reads[operand->id] = 0;
+            }
+        }
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (const Operand *operand : {&code[i].src1, &code[i].src2})
+            {
+                if (operand->kind == OPND_TEMP)
+                    reads[operand->id]++;
+            }
+        }
+
+        // Inner loops first; each product is reduced in the innermost loop
+        // that can
+        vector<size_t> order(loops.size());
+        for (size_t k = 0; k < order.size(); k++)
+            order[k] = k;
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                    { return loops[a].end - loops[a].start < loops[b].end - loops[b].start; });
+
+        vector<pair<size_t, Quad>> inserts; // Instruction placed before a position
+        vector<bool> removed(code.size() - first, false);
+        vector<bool> done(code.size() - first, false);
+        vector<Operand *> uses;
+        for (size_t k : order)
+        {
+            const Loop &loop = loops[k];
+            for (size_t p = loop.start; p <= loop.end; p++)
+            {
+                Quad &q = code[p];
+                if (!isProductCandidate(q) || done[p - first] || icg.typeOf(q.dst) != VT_INT ||
+                    storeCount[slotOf(q.dst)] != 1)
+                    continue;
+                int64_t factor;
+                Operand variable = q.src1;
+                if (!icg.intConstant(q.src2, factor))
+                {
+                    variable = q.src2;
+                    if (!icg.intConstant(q.src1, factor))
+                        continue;
+                }
+                size_t store;
+                int64_t step;
+                if (variable.kind != OPND_VAR || !findStep(variable.id, loop, store, step))
+                    continue;
+
+                Operand product = icg.newTemp(VT_INT);
+                inserts.push_back({loop.start, Quad(OP_MUL, product, q.src1, q.src2)});
+                string increment = to_string((int32_t)(uint32_t)(factor * step));
+                inserts.push_back({store + 1, Quad(OP_ADD, product, product, icg.constant(VT_INT, increment))});
+                done[p - first] = true;
+                reduced++;
+
+                // Reads of the old temp up to the variable's next store see
+                // the same value; any other read keeps a copy
+                uses.clear();
+                for (size_t i = p + 1; i <= loop.end && code[i].op != OP_LABEL; i++)
+                {
+                    for (Operand *operand : {&code[i].src1, &code[i].src2})
+                    {
+                        if (*operand == q.dst)
+                            uses.push_back(operand);
+                    }
+                    if (isJumpOp(code[i].op) || (isDefinitionOp(code[i].op) && code[i].dst == variable))
+                        break;
+                }
+                if ((int)uses.size() == reads[q.dst.id])
+                {
+                    for (Operand *operand : uses)
+                        *operand = product;
+                    removed[p - first] = true;
+                }
+                else
+                {
+                    q = Quad(OP_ASSIGN, q.dst, product);
+                }
+            }
+        }
+        if (inserts.empty())
+            return;
+
+        stable_sort(inserts.begin(), inserts.end(), [](const pair<size_t, Quad> &a, const pair<size_t, Quad> &b)
+                    { return a.first < b.first; });
+        vector<Quad> tail;
+        tail.reserve(code.size() - first + inserts.size());
+        size_t n = 0;
+        for (size_t i = first; i < code.size(); i++)
+        {
+            for (; n < inserts.size() && inserts[n].first == i; n++)
+                tail.push_back(inserts[n].second);
+            if (!removed[i - first])
+                tail.push_back(code[i]);
+        }
+        for (; n < inserts.size(); n++)
+            tail.push_back(inserts[n].second);
+        code.erase(code.begin() + first, code.end());
+        code.insert(code.end(), tail.begin(), tail.end());
+    }
+};
+
+// What AssemblyGenerator writes: 32-bit MASM, or x86-64 GNU assembler
+// (Intel syntax) for the System V ABI
+enum Target
+{
+    TARGET_MASM32,
+    TARGET_X86_64
+};
+
+// Linear-scan register allocation (Poletto and Sarkar) for the code from an
+// instruction to the end. Each variable and temp gets one interval, from its
+// first mention to its last, stretched over every block it is live across,
+// and keeps a register or its memory slot for all of it. Under pressure the
+// interval with the fewest uses per instruction it covers stays in memory;
+// a use inside a loop counts 8 times per loop level. Floats stay in memory,
+// where the FPU reads them.
+class RegisterAllocator
+{
+private:
+    static constexpr int MAX_REGISTERS = 6;
+    static constexpr size_t NO_POS = (size_t)-1;
+    // Kept across printf calls; eax, ecx and edx are scratch. The x86-64
+    // ones are callee-saved under System V, since esi and edi carry printf
+    // arguments there.
+    static constexpr const char *masmRegisters[] = {"ebx", "esi", "edi", "ebp"};
+    static constexpr const char *x86_64Registers[MAX_REGISTERS] = {"ebx", "ebp", "r12d", "r13d", "r14d", "r15d"};
+
+    struct Interval
+    {
+        size_t start = NO_POS; // Positions: a read at instruction i is 2i, a write 2i + 1
+        size_t end = 0;
+        double weight = 0;
+        bool written = false;
+        bool loaded = false;
+        int entryBlock = -1; // First block starting a region that the value is live into
+    };
+
+    const IntermediateCodeGnerator &icg;
+    SlotNumbering slots;
+    vector<int> assigned; // Per slot, register index or -1
+    const char *const *registerNames;
+    int registerCount;
+
+public:
+    size_t candidates = 0; // Values that could live in a register
+    size_t spilled = 0;    // Of those, left in memory for lack of registers
+    vector<Operand> loadAtEntry; // In a register and live on entry to the range
+    vector<Operand> storeAtExit; // Variables in a register that the range writes
+
+    // With variablesLiveAtExit, later code reads every variable from memory
+    RegisterAllocator(const IntermediateCodeGnerator &icg, size_t first, bool variablesLiveAtExit,
+                      Target target = TARGET_MASM32)
+        : icg(icg), slots(icg), assigned(slots.slotCount, -1),
+          registerNames(target == TARGET_X86_64 ? x86_64Registers : masmRegisters),
+          registerCount(target == TARGET_X86_64 ? MAX_REGISTERS : 4)
+    {
+        const vector<Quad> &code = icg.instructions;
+        if (first >= code.size())
+            return;
+        ControlFlowGraph cfg(icg, first);
+        Liveness liveness(icg, cfg, variablesLiveAtExit);
+        vector<int> depth = loopDepths(first);
+
+        vector<Interval> intervals(slots.slotCount);
+        auto mention = [&](const Operand &operand, size_t position, double weight)
+        {
+            Interval &interval = intervals[slots.slotOf(operand)];
+            interval.start = min(interval.start, position);
+            interval.end = max(interval.end, position);
+            interval.weight += weight;
+        };
+        for (size_t i = first; i < code.size(); i++)
+        {
+            const Quad &q = code[i];
+            double weight = (double)(1ull << (3 * min(depth[i - first], 10)));
+            for (const Operand *operand : {&q.src1, &q.src2})
+            {
+                if (SlotNumbering::isSlot(*operand))
+                    mention(*operand, 2 * i, weight);
+            }
+            if (isDefinitionOp(q.op))
+            {
+                mention(q.dst, 2 * i + 1, weight);
+                intervals[slots.slotOf(q.dst)].written = true;
+            }
+        }
+        liveness.forEachLiveBlock([&](int block, const Operand &operand, bool liveIn, bool liveOut)
+        {
+            Interval &interval = intervals[slots.slotOf(operand)];
+            const ControlFlowGraph::Block &b = cfg.blocks[block];
+            if (liveIn)
+                interval.start = min(interval.start, 2 * b.first);
+            if (liveOut)
+                interval.end = max(interval.end, 2 * b.last - 1);
+            if (liveIn && cfg.regions[cfg.regionOf(block)].first == block &&
+                (interval.entryBlock == -1 || block < interval.entryBlock))
+                interval.entryBlock = block;
+        });
+
+        // Regions up to the first one that loops forever run in turn from
+        // the start. A value live into the first region that mentions it
+        // comes from before the range.
+        int reachedRegions = 0;
+        while (reachedRegions < (int)cfg.regions.size() && cfg.fallsOut(reachedRegions))
+            reachedRegions++;
+        auto liveAtEntry = [&](const Interval &interval)
+        {
+            return interval.entryBlock != -1 && cfg.regionOf(interval.entryBlock) <= reachedRegions &&
+                   interval.start == 2 * cfg.blocks[interval.entryBlock].first;
+        };
+
+        vector<int> order;
+        for (int slot = 0; slot < slots.slotCount; slot++)
+        {
+            Interval &interval = intervals[slot];
+            // Floats are read by the FPU or SSE from memory; x86-64 strings
+            // are 64-bit pointers
+            ValueType type = icg.typeOf(slots.operandOf(slot));
+            if (interval.start == NO_POS || type == VT_FLOAT || (type == VT_STRING && target == TARGET_X86_64))
+                continue;
+            // Loaded at the start and stored back at the end, so nothing
+            // else may take the register before or after
+            if (liveAtEntry(interval))
+            {
+                interval.loaded = true;
+                interval.start = 2 * first;
+            }
+            if (variablesLiveAtExit && slot < slots.slotBase)
+                interval.end = 2 * code.size();
+            order.push_back(slot);
+        }
+        candidates = order.size();
+        sort(order.begin(), order.end(), [&](int a, int b) { return intervals[a].start < intervals[b].start; });
+
+        auto density = [&](int slot)
+        {
+            const Interval &interval = intervals[slot];
+            return interval.weight / (double)(interval.end - interval.start + 1);
+        };
+        vector<int> active; // At most registerCount slots
+        for (int slot : order)
+        {
+            const Interval &current = intervals[slot];
+            unsigned freeRegisters = (1u << registerCount) - 1;
+            size_t kept = 0;
+            for (int other : active)
+            {
+                if (intervals[other].end >= current.start)
+                {
+                    active[kept++] = other;
+                    freeRegisters &= ~(1u << assigned[other]);
+                }
+            }
+            active.resize(kept);
+
+            if (freeRegisters)
+            {
+                assigned[slot] = __builtin_ctz(freeRegisters);
+                active.push_back(slot);
+                continue;
+            }
+
+            // Evict the active interval worth least per instruction, unless
+            // the new one is worth less still
+            size_t victim = 0;
+            for (size_t k = 1; k < active.size(); k++)
+            {
+                if (density(active[k]) < density(active[victim]))
+                    victim = k;
+            }
+            spilled++;
+            if (density(slot) <= density(active[victim]))
+                continue;
+            assigned[slot] = assigned[active[victim]];
+            assigned[active[victim]] = -1;
+            active[victim] = slot;
+        }
+
+        for (int slot : order)
+        {
+            if (assigned[slot] == -1)
+                continue;
+            if (intervals[slot].loaded)
+                loadAtEntry.push_back(slots.operandOf(slot));
+            if (variablesLiveAtExit && slot < slots.slotBase && intervals[slot].written)
+                storeAtExit.push_back(slots.operandOf(slot));
+        }
+    }
+
+    // Register holding the operand, nullptr if it lives in memory
+    const char *registerOf(const Operand &operand) const
+    {
+        if (!SlotNumbering::isSlot(operand))
+            return nullptr;
+        int r = assigned[slots.slotOf(operand)];
+        return r == -1 ? nullptr : registerNames[r];
+    }
+
+    string summary() const
+    {
+        return to_string(candidates - spilled) + " values in registers, " + to_string(spilled) + " spilled";
+    }
+
+private:
+    // Per instruction from first, how many loops contain it. A loop spans
+    // a backward jump and its target.
+    vector<int> loopDepths(size_t first) const
+    {
+        const vector<Quad> &code = icg.instructions;
+        vector<size_t> labelPos(icg.labelCount, NO_POS);
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (code[i].op == OP_LABEL)
+                labelPos[code[i].dst.id] = i;
+        }
+        vector<int> depth(code.size() - first + 1, 0);
+        for (size_t i = first; i < code.size(); i++)
+        {
+            if (!isJumpOp(code[i].op))
+                continue;
+            icg.forEachJumpTarget(code[i], [&](int label)
+                                  {
+                                      if (labelPos[label] <= i)
+                                      {
+                                          depth[labelPos[label] - first]++;
+                                          depth[i + 1 - first]--;
+                                      }
+                                  });
+        }
+        for (size_t k = 1; k < depth.size(); k++)
+            depth[k] += depth[k - 1];
+        return depth;
+    }
+};
+
+// Rewrites the code section on its way out. Lines are parsed into a window
+// of the most recent ones, and after each instruction the rule table is
+// tried at the end of the window until no rule fires, so a rewrite that
+// exposes another pattern is taken too. Comments do not break patterns;
+// one left with no instruction after it is dropped.
+class PeepholeOptimizer : private streambuf
+{
+private:
+    static const size_t WINDOW = 32; // Lines kept back for matching
+
+    enum LineKind
+    {
+        LINE_INSTRUCTION,
+        LINE_LABEL,
+        LINE_COMMENT,
+        LINE_OTHER
+    };
+
+    // Operation and operands are views into the text
+    struct Line
+    {
+        LineKind kind;
+        string text; // Without the newline
+        int argCount;
+        size_t opEnd;
+        size_t argStart[2];
+        size_t argEnd[2];
+
+        string_view op() const
+        {
+            return string_view(text).substr(1, opEnd - 1);
+        }
+
+        string_view arg(int k) const
+        {
+            return string_view(text).substr(argStart[k], argEnd[k] - argStart[k]);
+        }
+
+        string_view label() const
+        {
+            return string_view(text).substr(0, text.size() - 1);
+        }
+    };
+
+    struct Rule
+    {
+        const char *name;
+        bool (PeepholeOptimizer::*apply)();
+    };
+    static const int RULE_COUNT = 6;
+
+    ostream &target;
+    ostream in;
+    bool inCode = false;
+    string partial;
+    // Lines are recycled so their text keeps its capacity: the first
+    // `used` are the window, in order
+    vector<Line> lines;
+    size_t used = 0;
+    vector<int> jumpTargets; // Per label number (L<n>), the label its code jumps straight to, or -1
+    bool nextTestDead = false; // The value the next line tests is read nowhere else
+    bool testDead = false;     // Same, for the line being added
+    size_t fired[RULE_COUNT] = {};
+
+public:
+    PeepholeOptimizer(ostream &target) : target(target), in(this), lines(2 * WINDOW) {}
+
+    ostream &stream()
+    {
+        return in;
+    }
+
+    // Lines before this pass through untouched
+    void startCode()
+    {
+        in.flush();
+        inCode = true;
+    }
+
+    // Label L<label> whose first instruction is "jmp L<target>"
+    void addJumpTarget(int label, int target)
+    {
+        if (label >= (int)jumpTargets.size())
+            jumpTargets.resize(label + 1, -1);
+        jumpTargets[label] = target;
+    }
+
+    // The next line is a jz on a value that nothing else reads
+    void lastTest()
+    {
+        nextTestDead = true;
+    }
+
+    // Writes out everything still held back
+    void finish()
+    {
+        if (!partial.empty())
+            addLine();
+        writeFront(used);
+    }
+
+    string summary() const
+    {
+        string text;
+        for (int k = 0; k < RULE_COUNT; k++)
+            text += (k ? ", " : "") + to_string(fired[k]) + " " + rules()[k].name;
+        return text;
+    }
+
+private:
+    static const array<Rule, RULE_COUNT> &rules()
+    {
+        static const array<Rule, RULE_COUNT> table = {{
+            {"redundant moves", &PeepholeOptimizer::removeRedundantMove},
+            {"jumps to next", &PeepholeOptimizer::removeJumpToNext},
+            {"jumps to jumps", &PeepholeOptimizer::threadJump},
+            {"zeroing xors", &PeepholeOptimizer::zeroWithXor},
+            {"flag branches", &PeepholeOptimizer::branchOnFlags},
+            {"inverted branches", &PeepholeOptimizer::invertBranch},
+        }};
+        return table;
+    }
+
+    int overflow(int c) override
+    {
+        if (c == EOF)
+            return 0;
+        if (c == '\n')
+            addLine();
+        else
+            partial += (char)c;
+        return c;
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        for (const char *end = s + n; s < end;)
+        {
+            const char *newline = (const char *)memchr(s, '\n', end - s);
+            if (!newline)
+            {
+                partial.append(s, end);
+                break;
+            }
+            partial.append(s, newline);
+            addLine();
+            s = newline + 1;
+        }
+        return n;
+    }
+
+    // Takes the line collected in partial
+    void addLine()
+    {
+        if (!inCode)
+        {
+            target << partial << '\n';
+            partial.clear();
+            return;
+        }
+        if (used == lines.size())
+            writeFront(WINDOW);
+        Line &line = lines[used++];
+        line.text.assign(partial);
+        partial.clear();
+        parse(line);
+        testDead = nextTestDead;
+        nextTestDead = false;
+        if (line.kind != LINE_INSTRUCTION && line.kind != LINE_LABEL)
+            return;
+
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (int k = 0; k < RULE_COUNT && !changed; k++)
+            {
+                if ((this->*rules()[k].apply)())
+                {
+                    fired[k]++;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    static void parse(Line &line)
+    {
+        const string &text = line.text;
+        line.argCount = 0;
+        if (text.size() > 1 && text[0] == '\t' && (text[1] == ';' || text[1] == '#'))
+            line.kind = LINE_COMMENT;
+        else if (!text.empty() && text[0] != '\t' && text.back() == ':')
+            line.kind = LINE_LABEL;
+        else if (text.size() > 1 && text[0] == '\t')
+            line.kind = LINE_INSTRUCTION;
+        else
+            line.kind = LINE_OTHER;
+        if (line.kind != LINE_INSTRUCTION)
+            return;
+
+        size_t space = text.find(' ');
+        line.opEnd = space == string::npos ? text.size() : space;
+        if (space == string::npos)
+            return;
+        size_t comma = text.find(", ", space);
+        line.argStart[0] = space + 1;
+        line.argEnd[0] = comma == string::npos ? text.size() : comma;
+        line.argCount = 1;
+        if (comma != string::npos)
+        {
+            line.argStart[1] = comma + 2;
+            line.argEnd[1] = text.size();
+            line.argCount = 2;
+        }
+    }
+
+    // Writes the first count lines of the window and moves the rest up
+    void writeFront(size_t count)
+    {
+        for (size_t k = 0; k < count; k++)
+        {
+            const Line &line = lines[k];
+            // A comment whose instructions were all removed
+            bool orphan = line.kind == LINE_COMMENT && k + 1 < used &&
+                          (lines[k + 1].kind == LINE_COMMENT || lines[k + 1].kind == LINE_LABEL);
+            if (!orphan)
+                target << line.text << '\n';
+        }
+        rotate(lines.begin(), lines.begin() + count, lines.end());
+        used -= count;
+    }
+
+    void erase(int index)
+    {
+        rotate(lines.begin() + index, lines.begin() + index + 1, lines.begin() + used);
+        used--;
+    }
+
+    // Index of the last instruction or label before index, skipping
+    // comments; -1 if there is none in the window
+    int previous(int index) const
+    {
+        while (--index >= 0)
+        {
+            if (lines[index].kind != LINE_COMMENT)
+                return index;
+        }
+        return -1;
+    }
+
+    int last() const
+    {
+        return previous((int)used);
+    }
+
+    bool isInstruction(int index, string_view op) const
+    {
+        return index >= 0 && lines[index].kind == LINE_INSTRUCTION && lines[index].op() == op;
+    }
+
+    bool isJump(int index) const
+    {
+        return index >= 0 && lines[index].kind == LINE_INSTRUCTION && lines[index].op()[0] == 'j' &&
+               lines[index].argCount == 1;
+    }
+
+    static bool isRegister(string_view operand)
+    {
+        static const string_view names[] = {"eax", "ebx", "ecx", "edx", "esi", "edi", "ebp", "r12d", "r13d", "r14d", "r15d"};
+        return find(begin(names), end(names), operand) != end(names);
+    }
+
+    // Replaces an instruction's text and parses it again
+    static void rewrite(Line &line, string_view op, string_view first, string_view second = {})
+    {
+        string text = "\t" + string(op) + " " + string(first);
+        if (!second.empty())
+            text += ", " + string(second);
+        line.text = move(text);
+        parse(line);
+    }
+
+    // mov x, x, or a move straight back: mov a, b; mov b, a
+    bool removeRedundantMove()
+    {
+        int index = last();
+        if (!isInstruction(index, "mov") || lines[index].argCount != 2)
+            return false;
+        const Line &copy = lines[index];
+        int before = previous(index);
+        if (copy.arg(0) != copy.arg(1) &&
+            !(isInstruction(before, "mov") && lines[before].argCount == 2 && lines[before].arg(0) == copy.arg(1) &&
+              lines[before].arg(1) == copy.arg(0)))
+            return false;
+        erase(index);
+        return true;
+    }
+
+    // A jump to a label that directly follows it
+    bool removeJumpToNext()
+    {
+        int index = last();
+        if (index < 0 || lines[index].kind != LINE_LABEL)
+            return false;
+        int jump = index;
+        while (jump >= 0 && lines[jump].kind == LINE_LABEL)
+            jump = previous(jump);
+        if (!isJump(jump))
+            return false;
+        for (int label = index; label > jump; label = previous(label))
+        {
+            if (lines[label].label() == lines[jump].arg(0))
+            {
+                erase(jump);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A jump to a label whose code is another jump goes to its target
+    bool threadJump()
+    {
+        int index = last();
+        if (!isJump(index) || jumpTargets.empty())
+            return false;
+        string_view label = lines[index].arg(0);
+        int start = 0;
+        if (label.size() < 2 || label[0] != 'L' ||
+            from_chars(label.data() + 1, label.data() + label.size(), start).ptr != label.data() + label.size())
+            return false;
+        int destination = start;
+        for (int hops = 0; hops < 16; hops++)
+        {
+            int next = destination < (int)jumpTargets.size() ? jumpTargets[destination] : -1;
+            if (next == -1 || next == start)
+                break;
+            destination = next;
+        }
+        if (destination == start)
+            return false;
+        rewrite(lines[index], lines[index].op(), "L" + to_string(destination));
+        return true;
+    }
+
+    // mov reg, 0 is longer than xor reg, reg. The code generator never
+    // puts a move between setting flags and reading them, so clobbering
+    // them here is safe.
+    bool zeroWithXor()
+    {
+        int index = last();
+        if (!isInstruction(index, "mov") || lines[index].argCount != 2 || lines[index].arg(1) != "0" ||
+            !isRegister(lines[index].arg(0)))
+            return false;
+        string reg(lines[index].arg(0));
+        rewrite(lines[index], "xor", reg, reg);
+        return true;
+    }
+
+    // setcc al; movzx r, al; [stores of r]; test r, r; jz label: the flags
+    // from before setcc still hold, so jump on the opposite condition. When
+    // the tested value is read nowhere else, the setcc, movzx and stores go
+    // too.
+    bool branchOnFlags()
+    {
+        int jump = last();
+        if (!isInstruction(jump, "jz"))
+            return false;
+        int test = previous(jump);
+        if (!isInstruction(test, "test") || lines[test].arg(0) != lines[test].arg(1))
+            return false;
+        string_view reg = lines[test].arg(0);
+        int index = previous(test);
+        while (isInstruction(index, "mov") && !isRegister(lines[index].arg(0)))
+            index = previous(index);
+        if (!isInstruction(index, "movzx") || lines[index].arg(0) != reg || lines[index].arg(1) != "al")
+            return false;
+        int set = previous(index);
+        if (set < 0 || lines[set].kind != LINE_INSTRUCTION)
+            return false;
+
+        static const pair<string_view, string_view> opposites[] = {
+            {"sete", "jne"}, {"setne", "je"}, {"setl", "jge"}, {"setg", "jle"}, {"setle", "jg"}, {"setge", "jl"},
+            {"seta", "jbe"}, {"setae", "jb"}};
+        for (const auto &opposite : opposites)
+        {
+            if (lines[set].op() == opposite.first)
+            {
+                string label(lines[jump].arg(0));
+                rewrite(lines[jump], opposite.second, label);
+                for (int k = test; k >= set; k--)
+                {
+                    if (k == test || (testDead && lines[k].kind == LINE_INSTRUCTION))
+                        erase(k);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // jcc a; jmp b; a: branches on the opposite condition straight to b
+    bool invertBranch()
+    {
+        int label = last();
+        if (label < 0 || lines[label].kind != LINE_LABEL)
+            return false;
+        int jump = previous(label);
+        if (!isInstruction(jump, "jmp") || !isJump(jump) || lines[jump].arg(0)[0] != 'L')
+            return false;
+        int branch = previous(jump);
+        if (!isJump(branch) || lines[branch].arg(0) != lines[label].label())
+            return false;
+
+        static const pair<string_view, string_view> opposites[] = {
+            {"je", "jne"}, {"jne", "je"}, {"jz", "jnz"}, {"jnz", "jz"}, {"jl", "jge"}, {"jge", "jl"},
+            {"jg", "jle"}, {"jle", "jg"}, {"ja", "jbe"}, {"jbe", "ja"}};
+        for (const auto &opposite : opposites)
+        {
+            if (lines[branch].op() == opposite.first)
+            {
+                string target(lines[jump].arg(0));
+                rewrite(lines[branch], opposite.second, target);
+                erase(jump);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+class AssemblyGenerator
+{
+private:
+    const IntermediateCodeGnerator &icg;
+    bool optimize;
+    Target target;
+    bool gas; // x86-64 GNU assembler output
+    unique_ptr<RegisterAllocator> registers; // Null when every value lives in memory
+    PeepholeOptimizer peephole;
+    ostream &out; // Through the peephole optimizer when optimizing
+    vector<int> tempReads; // Per temp, reads in the code being optimized
+
+public:
+    // With optimize, values are kept in registers and the code goes through
+    // the peephole optimizer
+    AssemblyGenerator(const IntermediateCodeGnerator &icg, ostream &out, bool optimize = false,
+                      Target target = TARGET_MASM32)
+        : icg(icg), optimize(optimize), target(target), gas(target == TARGET_X86_64), peephole(out),
+          out(optimize ? peephole.stream() : out) {}
+
+    void generateAssembly()
+    {
+        if (optimize)
+            registers = make_unique<RegisterAllocator>(icg, 0, false, target);
+        writeHeader();
+        writeDataSection();
+        beginCodeSection();
+        writeCode(0, icg.instructions.size());
+        endCodeSection();
+        peephole.finish();
+    }
+
+    // Code for the instructions from first to the end, after which the
+    // variables are read from memory, as when statements are compiled one
+    // at a time
+    void generateStatement(size_t first)
+    {
+        if (optimize)
+            registers = make_unique<RegisterAllocator>(icg, first, true, target);
+        writeCode(first, icg.instructions.size());
+        peephole.finish();
+    }
+
+    string summary() const
+    {
+        if (!optimize)
+            return "no register allocation";
+        return (registers ? registers->summary() : "") + ", peephole: " + peephole.summary();
+    }
+
+    void writeHeader()
+    {
+        if (gas)
+        {
+            out << "\t.intel_syntax noprefix\n";
+            out << "\t.globl main\n\n";
+            return;
+        }
+        // SSE for float arithmetic
+        out << ".686\n";
+        out << ".xmm\n";
+        out << ".model flat, c\n";
+        out << ".stack 4096\n\n";
+
+        out << "extern printf:near\n";
+        out << "extern exit:near\n";
+        if (usesConcat())
+        {
+            out << "extern strlen:near\n";
+            out << "extern malloc:near\n";
+            out << "extern strcpy:near\n";
+            out << "extern strcat:near\n";
+        }
+        out << "\n";
+    }
+
+    void writeDataSection()
+    {
+        out << (gas ? "\t.data\n" : ".data\n");
+
+        declareString("_printIntFormat", "%d");
+        declareString("_printFloatFormat", "%f");
+        declareString("_printStrFormat", "%s");
+        declareString("_printCharFormat", "%c");
+        if (usesConcat())
+            declareString("_emptyString", "");
+        out << "\n";
+
+        // String and float literals need storage, everything else is an immediate
+        for (size_t i = 0; i < icg.constants.size(); i++)
+        {
+            const Constant &c = icg.constants[i];
+            if (c.type == VT_STRING)
+            {
+                declareString("_c" + to_string(i), icg.constantText((int)i));
+            }
+            else if (c.type == VT_FLOAT)
+            {
+                if (gas)
+                    out << "_c" << i << ":\t.float " << icg.constantText((int)i) << "\n";
+                else
+                    out << "\t_c" << i << " REAL4 " << icg.constantText((int)i) << "\n";
+            }
+        }
+
+        // Declare variables and temporaries. Variables that never overlap may
+        // share a name (and so one slot), see IntermediateCodeGnerator::variableName.
+        // A shared slot is sized for a string if any of them is one, since
+        // x86-64 pointers are wider than the other types.
+        vector<pair<string, ValueType>> slots;
+        unordered_map<string, size_t> slotIndex;
+        for (int variable = 0; variable < icg.variableCount(); variable++)
+        {
+            if (icg.variableSymbols[variable] == -1)
+                continue;
+            ValueType type = icg.variableTypes[variable];
+            auto inserted = slotIndex.emplace(icg.variableName(variable), slots.size());
+            if (inserted.second)
+                slots.emplace_back(inserted.first->first, type);
+            else if (type == VT_STRING)
+                slots[inserted.first->second].second = VT_STRING;
+        }
+        for (const auto &slot : slots)
+            declareStorage(slot.first, slot.second);
+        for (int i = 0; i < icg.tempCount; i++)
+        {
+            if (icg.tempUsed[i] && !registerOf(Operand(OPND_TEMP, i)))
+                declareStorage("t" + to_string(i), icg.tempTypes[i]);
+        }
+        out << "\n";
+    }
+
+    void declareString(const string &name, string_view text)
+    {
+        if (gas)
+            out << name << ":\t.asciz " << gasString(text) << "\n";
+        else
+            out << "\t" << name << " BYTE " << masmString(text) << "\n";
+    }
+
+    void declareStorage(const string &name, ValueType type)
+    {
+        if (gas)
+        {
+            // Strings hold a 64-bit pointer
+            out << name << (type == VT_FLOAT ? ":\t.float 0.0\n" : type == VT_STRING ? ":\t.quad 0\n" : ":\t.long 0\n");
+            return;
+        }
+        if (type == VT_FLOAT)
+        {
+            out << "\t" << name << " REAL4 0.0\n";
+        }
+        else
+        {
+            out << "\t" << name << " DWORD 0\n";
+        }
+    }
+
+    // main never returns (it calls exit), so it only has to align the
+    // stack to 16 bytes for the calls it makes
+    void beginCodeSection()
+    {
+        if (gas)
+        {
+            out << "\t.text\n";
+            out << "main:\n";
+            out << "\tsub rsp, 8\n";
+            return;
+        }
+        out << ".code\n";
+        out << "main PROC\n";
+    }
+
+    // Code for instructions [first, last)
+    void writeCode(size_t first, size_t last)
+    {
+        if (optimize)
+            startPeephole(first, last);
+        if (registers && !registers->loadAtEntry.empty())
+        {
+            comment("Load register values");
+            for (const Operand &operand : registers->loadAtEntry)
+                out << "\tmov " << registerOf(operand) << ", " << memoryRef(operand) << "\n";
+        }
+        for (size_t i = first; i < last; i++)
+        {
+            processInstruction(icg.instructions[i]);
+        }
+        if (registers && !registers->storeAtExit.empty())
+        {
+            comment("Store register values");
+            for (const Operand &operand : registers->storeAtExit)
+                out << "\tmov " << memoryRef(operand) << ", " << registerOf(operand) << "\n";
+        }
+    }
+
+    void endCodeSection()
+    {
+        out << "\n";
+        comment("Program exit");
+        if (gas)
+        {
+            out << "\txor edi, edi\n";
+            out << "\tcall exit@PLT\n";
+            if (usesConcat())
+                writeGasConcat();
+            out << "\t.section .note.GNU-stack,\"\",@progbits\n";
+            return;
+        }
+        out << "\tpush 0\n";
+        out << "\tcall exit\n";
+        out << "main ENDP\n";
+        if (usesConcat())
+            writeMasmConcat();
+        out << "END main\n";
+    }
+
+private:
+    void comment(string_view text)
+    {
+        out << (gas ? "\t# " : "\t; ") << text << "\n";
+    }
+
+    bool isFloat(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_FLOAT;
+    }
+
+    bool isString(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_STRING;
+    }
+
+    // String + string results are string temps, which nothing else makes
+    bool usesConcat() const
+    {
+        for (int i = 0; i < icg.tempCount; i++)
+        {
+            if (icg.tempUsed[i] && icg.tempTypes[i] == VT_STRING)
+                return true;
+        }
+        return false;
+    }
+
+    // x86-64 strings are 64-bit pointers and take 64-bit moves
+    bool isWide(const Operand &operand) const
+    {
+        return gas && icg.typeOf(operand) == VT_STRING;
+    }
+
+    // Loads any value into a 64-bit register; narrower ones are sign-extended
+    void loadWide(const char *reg, const Operand &operand)
+    {
+        if (operand.kind == OPND_CONST && icg.constants[operand.id].type == VT_STRING)
+            out << "\tlea " << reg << ", [rip + _c" << operand.id << "]\n";
+        else if (isWide(operand))
+            out << "\tmov " << reg << ", " << memoryRef(operand) << "\n";
+        else if (operand.kind == OPND_CONST)
+            out << "\tmov " << reg << ", " << operandRef(operand) << "\n";
+        else
+            out << "\tmovsxd " << reg << ", " << operandRef(operand) << "\n";
+    }
+
+    void processInstruction(const Quad &q)
+    {
+        if (isComparisonOp(q.op))
+        {
+            processComparison(q);
+            return;
+        }
+        if (isBinaryOp(q.op))
+        {
+            processArithmetic(q);
+            return;
+        }
+
+        switch (q.op)
+        {
+        case OP_LABEL:
+            out << icg.operandToString(q.dst) << ":\n";
+            break;
+        case OP_GOTO:
+            out << "\tjmp " << icg.operandToString(q.dst) << "\n";
+            break;
+        case OP_IF_FALSE:
+            processConditionalJump(q);
+            break;
+        case OP_IF_NE:
+            comment("Case test");
+            // An unordered (NaN) float compare sets ZF as if equal
+            if (writeCompare(q.src1, q.src2))
+                out << "\tjp " << icg.operandToString(q.dst) << "\n";
+            out << "\tjne " << icg.operandToString(q.dst) << "\n";
+            break;
+        case OP_JUMP_TABLE:
+            processJumpTable(q);
+            break;
+        case OP_ASSIGN:
+            processSimpleAssignment(q);
+            break;
+        case OP_PRINT:
+            processPrint(q);
+            break;
+        default:
+            throw runtime_error("Cannot generate code for " + icg.instructionToString(q));
+        }
+    }
+
+    void processSimpleAssignment(const Quad &q)
+    {
+        const char *target = registerOf(q.dst);
+        const char *source = registerOf(q.src1);
+        if (target && target == source)
+            return;
+
+        comment("Assignment");
+        if (isFloat(q.dst) != isFloat(q.src1) && !isString(q.dst) && !isString(q.src1))
+        {
+            loadFloat("xmm0", q.src1);
+            storeFloat(q.dst, "xmm0");
+            return;
+        }
+        if (isWide(q.dst) || isWide(q.src1))
+        {
+            loadWide("rax", q.src1);
+            out << "\tmov " << operandRef(q.dst) << (isWide(q.dst) ? ", rax\n" : ", eax\n");
+            return;
+        }
+        if (target || source)
+        {
+            out << "\tmov " << operandRef(q.dst) << ", " << operandRef(q.src1) << "\n";
+            return;
+        }
+        out << "\tmov eax, " << operandRef(q.src1) << "\n";
+        out << "\tmov " << operandRef(q.dst) << ", eax\n";
+    }
+
+    void processArithmetic(const Quad &q)
+    {
+        if (isString(q.dst) || isString(q.src1) || isString(q.src2))
+        {
+            if (q.op != OP_ADD)
+                throw runtime_error("Cannot generate code for " + icg.instructionToString(q));
+            writeConcatCall(q);
+            return;
+        }
+        if (isFloat(q.dst) || isFloat(q.src1) || isFloat(q.src2))
+        {
+            static const char *const instructions[] = {"addss", "subss", "mulss", "divss"};
+            comment("Float arithmetic");
+            loadFloat("xmm0", q.src1);
+            loadFloat("xmm1", q.src2);
+            out << "\t" << instructions[q.op - OP_ADD] << " xmm0, xmm1\n";
+            storeFloat(q.dst, "xmm0");
+            return;
+        }
+
+        comment("Arithmetic");
+        // Work in the result's register unless the second operand is in
+        // it too; division needs eax and edx
+        const char *target = registerOf(q.dst);
+        bool viaEax = !target || target == registerOf(q.src2) || q.op == OP_DIV;
+        if (viaEax)
+            target = "eax";
+        if (target != registerOf(q.src1))
+            out << "\tmov " << target << ", " << operandRef(q.src1) << "\n";
+        switch (q.op)
+        {
+        case OP_ADD:
+            out << "\tadd " << target << ", " << operandRef(q.src2) << "\n";
+            break;
+        case OP_SUB:
+            out << "\tsub " << target << ", " << operandRef(q.src2) << "\n";
+            break;
+        case OP_MUL:
+            out << "\timul " << target << ", " << operandRef(q.src2) << "\n";
+            break;
+        default:
+            if (q.src2.kind == OPND_CONST)
+            {
+                out << "\tmov ecx, " << operandRef(q.src2) << "\n";
+                out << "\tcdq\n";
+                out << "\tidiv ecx\n";
+            }
+            else
+            {
+                out << "\tcdq\n";
+                out << "\tidiv " << operandRef(q.src2) << "\n";
+            }
+            break;
+        }
+        if (viaEax)
+            out << "\tmov " << operandRef(q.dst) << ", eax\n";
+    }
+
+    void processComparison(const Quad &q)
+    {
+        comment("Comparison");
+        if (isFloat(q.src1) || isFloat(q.src2))
+        {
+            writeFloatCondition(q);
+        }
+        else
+        {
+            writeCompare(q.src1, q.src2);
+            string setInstruction;
+            switch (q.op)
+            {
+            case OP_EQ:
+                setInstruction = "sete";
+                break;
+            case OP_NE:
+                setInstruction = "setne";
+                break;
+            case OP_LT:
+                setInstruction = "setl";
+                break;
+            case OP_GT:
+                setInstruction = "setg";
+                break;
+            case OP_LE:
+                setInstruction = "setle";
+                break;
+            default:
+                setInstruction = "setge";
+                break;
+            }
+            out << "\t" << setInstruction << " al\n";
+        }
+
+        if (const char *target = registerOf(q.dst))
+        {
+            out << "\tmovzx " << target << ", al\n";
+            return;
+        }
+        out << "\tmovzx eax, al\n";
+        out << "\tmov " << operandRef(q.dst) << ", eax\n";
+    }
+
+    void processConditionalJump(const Quad &q)
+    {
+        comment("Conditional jump");
+        if (isWide(q.src1))
+        {
+            loadWide("rax", q.src1);
+            out << "\ttest rax, rax\n";
+        }
+        else if (const char *source = registerOf(q.src1))
+        {
+            out << "\ttest " << source << ", " << source << "\n";
+        }
+        else
+        {
+            out << "\tmov eax, " << operandRef(q.src1) << "\n";
+            out << "\ttest eax, eax\n";
+        }
+        if (optimize && q.src1.kind == OPND_TEMP && tempReads[q.src1.id] == 1)
+            peephole.lastTest();
+        out << "\tjz " << icg.operandToString(q.dst) << "\n";
+    }
+
+    // One unsigned compare catches values on both sides of the table. The
+    // table sits in the code right after the jump that reads it.
+    void processJumpTable(const Quad &q)
+    {
+        const JumpTable &table = icg.jumpTables[q.src2.id];
+        comment("Jump table");
+        out << "\tmov eax, " << operandRef(q.src1) << "\n";
+        if (table.low != 0)
+            out << "\tsub eax, " << table.low << "\n";
+        out << "\tcmp eax, " << table.targets.size() - 1 << "\n";
+        out << "\tja " << icg.operandToString(q.dst) << "\n";
+        if (gas)
+        {
+            // Position independent: entries are offsets from the table
+            out << "\tlea rdx, [rip + L" << table.label << "]\n";
+            out << "\tmovsxd rax, DWORD PTR [rdx + rax*4]\n";
+            out << "\tadd rax, rdx\n";
+            out << "\tjmp rax\n";
+            out << "L" << table.label << ":";
+            for (size_t i = 0; i < table.targets.size(); i++)
+            {
+                out << (i % 8 == 0 ? "\n\t.long " : ", ") << "L" << table.targets[i] << " - L" << table.label;
+            }
+            out << "\n";
+            return;
+        }
+        out << "\tjmp DWORD PTR [L" << table.label << " + eax*4]\n";
+        for (size_t i = 0; i < table.targets.size(); i++)
+        {
+            if (i % 8 == 0)
+                out << (i ? "\n\tDWORD L" : "L" + to_string(table.label) + " DWORD L");
+            else
+                out << ", L";
+            out << table.targets[i];
+        }
+        out << "\n";
+    }
+
+    // Sets the flags for left - right; cmp takes a register or memory first.
+    // True when they come from ucomiss.
+    bool writeCompare(const Operand &left, const Operand &right)
+    {
+        if (isFloat(left) || isFloat(right))
+        {
+            loadFloat("xmm0", left);
+            loadFloat("xmm1", right);
+            out << "\tucomiss xmm0, xmm1\n";
+            return true;
+        }
+        if (isWide(left) || isWide(right))
+        {
+            loadWide("rax", left);
+            loadWide("rcx", right);
+            out << "\tcmp rax, rcx\n";
+            return false;
+        }
+        if (const char *source = registerOf(left))
+        {
+            out << "\tcmp " << source << ", " << operandRef(right) << "\n";
+            return false;
+        }
+        out << "\tmov eax, " << operandRef(left) << "\n";
+        out << "\tcmp eax, " << operandRef(right) << "\n";
+        return false;
+    }
+
+    // Leaves a float comparison's 0 or 1 in al. ucomiss reports NaN as
+    // unordered, setting ZF, PF and CF, so < and <= swap their operands to
+    // test with seta and setae, and == and != check PF. As in C, every
+    // comparison with NaN is false except !=.
+    void writeFloatCondition(const Quad &q)
+    {
+        bool swapped = q.op == OP_LT || q.op == OP_LE;
+        loadFloat("xmm0", swapped ? q.src2 : q.src1);
+        loadFloat("xmm1", swapped ? q.src1 : q.src2);
+        out << "\tucomiss xmm0, xmm1\n";
+        switch (q.op)
+        {
+        case OP_EQ:
+            out << "\tsete al\n";
+            out << "\tsetnp cl\n";
+            out << "\tand al, cl\n";
+            break;
+        case OP_NE:
+            out << "\tsetne al\n";
+            out << "\tsetp cl\n";
+            out << "\tor al, cl\n";
+            break;
+        case OP_LT:
+        case OP_GT:
+            out << "\tseta al\n";
+            break;
+        default:
+            out << "\tsetae al\n";
+            break;
+        }
+    }
+
+    // Floats never get a register; ints are converted, through eax when
+    // they are immediates
+    void loadFloat(const char *xmm, const Operand &operand)
+    {
+        if (isFloat(operand))
+        {
+            out << "\tmovss " << xmm << ", " << operandRef(operand) << "\n";
+            return;
+        }
+        if (operand.kind == OPND_CONST)
+        {
+            out << "\tmov eax, " << operandRef(operand) << "\n";
+            out << "\tcvtsi2ss " << xmm << ", eax\n";
+            return;
+        }
+        out << "\tcvtsi2ss " << xmm << ", " << operandRef(operand) << "\n";
+    }
+
+    // Int targets take the value truncated toward zero
+    void storeFloat(const Operand &dst, const char *xmm)
+    {
+        if (isFloat(dst))
+        {
+            out << "\tmovss " << memoryRef(dst) << ", " << xmm << "\n";
+            return;
+        }
+        if (const char *target = registerOf(dst))
+        {
+            out << "\tcvttss2si " << target << ", " << xmm << "\n";
+            return;
+        }
+        out << "\tcvttss2si eax, " << xmm << "\n";
+        out << "\tmov " << operandRef(dst) << ", eax\n";
+    }
+
+    // The result is a new heap string, never freed
+    void writeConcatCall(const Quad &q)
+    {
+        comment("Concatenation");
+        if (gas)
+        {
+            loadWide("rdi", q.src1);
+            loadWide("rsi", q.src2);
+            out << "\tcall _concat\n";
+            out << "\tmov " << memoryRef(q.dst) << ", rax\n";
+            return;
+        }
+        writePush(q.src2);
+        writePush(q.src1);
+        out << "\tcall _concat\n";
+        out << "\tadd esp, 8\n";
+        out << "\tmov " << operandRef(q.dst) << ", eax\n";
+    }
+
+    // _concat(left, right): malloc'd left + right, with a null pointer (an
+    // unassigned string) read as "". Keeps the callee-saved registers the
+    // allocator uses.
+    void writeGasConcat()
+    {
+        out << "\n_concat:\n";
+        out << "\tpush rbx\n";
+        out << "\tpush r12\n";
+        out << "\tpush r13\n";
+        out << "\tlea rax, [rip + _emptyString]\n";
+        out << "\ttest rdi, rdi\n";
+        out << "\tcmovz rdi, rax\n";
+        out << "\ttest rsi, rsi\n";
+        out << "\tcmovz rsi, rax\n";
+        out << "\tmov rbx, rdi\n";
+        out << "\tmov r12, rsi\n";
+        out << "\tcall strlen@PLT\n";
+        out << "\tmov r13, rax\n";
+        out << "\tmov rdi, r12\n";
+        out << "\tcall strlen@PLT\n";
+        out << "\tlea rdi, [r13 + rax + 1]\n";
+        out << "\tcall malloc@PLT\n";
+        out << "\tmov rdi, rax\n";
+        out << "\tmov rsi, rbx\n";
+        out << "\tcall strcpy@PLT\n";
+        out << "\tmov rdi, rax\n";
+        out << "\tmov rsi, r12\n";
+        out << "\tcall strcat@PLT\n";
+        out << "\tpop r13\n";
+        out << "\tpop r12\n";
+        out << "\tpop rbx\n";
+        out << "\tret\n";
+    }
+
+    void writeMasmConcat()
+    {
+        out << "\n_concat PROC\n";
+        out << "\tpush ebx\n";
+        out << "\tpush esi\n";
+        out << "\tpush edi\n";
+        out << "\tmov esi, [esp + 16]\n";
+        out << "\tmov edi, [esp + 20]\n";
+        out << "\tmov eax, OFFSET _emptyString\n";
+        out << "\ttest esi, esi\n";
+        out << "\tcmovz esi, eax\n";
+        out << "\ttest edi, edi\n";
+        out << "\tcmovz edi, eax\n";
+        out << "\tpush esi\n";
+        out << "\tcall strlen\n";
+        out << "\tmov ebx, eax\n";
+        out << "\tpush edi\n";
+        out << "\tcall strlen\n";
+        out << "\tadd esp, 8\n";
+        out << "\tlea eax, [ebx + eax + 1]\n";
+        out << "\tpush eax\n";
+        out << "\tcall malloc\n";
+        out << "\tmov [esp], esi\n";
+        out << "\tpush eax\n";
+        out << "\tcall strcpy\n";
+        out << "\tmov [esp + 4], edi\n";
+        out << "\tcall strcat\n";
+        out << "\tadd esp, 8\n";
+        out << "\tpop edi\n";
+        out << "\tpop esi\n";
+        out << "\tpop ebx\n";
+        out << "\tret\n";
+        out << "_concat ENDP\n";
+    }
+
+    void processPrint(const Quad &q)
+    {
+        comment("Print");
+        if (gas)
+        {
+            writeGasPrint(q.src1);
+            return;
+        }
+        switch (icg.typeOf(q.src1))
+        {
+        case VT_FLOAT:
+            // printf expects a double on the stack
+            out << "\tsub esp, 8\n";
+            out << "\tfld " << operandRef(q.src1) << "\n";
+            out << "\tfstp QWORD PTR [esp]\n";
+            out << "\tpush OFFSET _printFloatFormat\n";
+            out << "\tcall printf\n";
+            out << "\tadd esp, 12\n";
+            return;
+        case VT_STRING:
+            writePush(q.src1);
+            out << "\tpush OFFSET _printStrFormat\n";
+            break;
+        case VT_CHAR:
+            writePush(q.src1);
+            out << "\tpush OFFSET _printCharFormat\n";
+            break;
+        default:
+            writePush(q.src1);
+            out << "\tpush OFFSET _printIntFormat\n";
+            break;
+        }
+        out << "\tcall printf\n";
+        out << "\tadd esp, 8\n";
+    }
+
+    // System V: the format goes in rdi, the value in esi/rsi or xmm0, and al
+    // holds the number of vector registers used
+    void writeGasPrint(const Operand &operand)
+    {
+        switch (icg.typeOf(operand))
+        {
+        case VT_FLOAT:
+            out << "\tcvtss2sd xmm0, " << operandRef(operand) << "\n";
+            out << "\tlea rdi, [rip + _printFloatFormat]\n";
+            out << "\tmov eax, 1\n";
+            out << "\tcall printf@PLT\n";
+            return;
+        case VT_STRING:
+            loadWide("rsi", operand);
+            out << "\tlea rdi, [rip + _printStrFormat]\n";
+            break;
+        case VT_CHAR:
+            out << "\tmov esi, " << operandRef(operand) << "\n";
+            out << "\tlea rdi, [rip + _printCharFormat]\n";
+            break;
+        default:
+            out << "\tmov esi, " << operandRef(operand) << "\n";
+            out << "\tlea rdi, [rip + _printIntFormat]\n";
+            break;
+        }
+        out << "\txor eax, eax\n";
+        out << "\tcall printf@PLT\n";
+    }
+    void writePush(const Operand &operand)
+    {
+        if (const char *source = registerOf(operand))
+        {
+            out << "\tpush " << source << "\n";
+            return;
+        }
+        out << "\tmov eax, " << operandRef(operand) << "\n";
+        out << "\tpush eax\n";
+    }
+
+    // Code from here on is rewritten. Each label whose code is a goto tells
+    // the optimizer where jumps to it can go instead, and reads are counted
+    // so a branch can tell it when the value it tests is dead.
+    void startPeephole(size_t first, size_t last)
+    {
+        peephole.startCode();
+        tempReads.assign(icg.tempCount, 0);
+        for (size_t i = first; i < last; i++)
+        {
+            for (const Operand *operand : {&icg.instructions[i].src1, &icg.instructions[i].src2})
+            {
+                if (operand->kind == OPND_TEMP)
+                    tempReads[operand->id]++;
+            }
+        }
+        for (size_t i = first; i < last; i++)
+        {
+            if (icg.instructions[i].op != OP_LABEL)
+                continue;
+            size_t next = i + 1;
+            while (next < last && icg.instructions[next].op == OP_LABEL)
+                next++;
+            if (next < last && icg.instructions[next].op == OP_GOTO)
+            {
+                peephole.addJumpTarget(icg.instructions[i].dst.id, icg.instructions[next].dst.id);
+            }
+        }
+    }
+
+    // Register holding a variable or temp, nullptr if it lives in memory
+    const char *registerOf(const Operand &operand) const
+    {
+        return registers ? registers->registerOf(operand) : nullptr;
+    }
+
+    // Memory slot of a variable or temp
+    string memoryRef(const Operand &operand)
+    {
+        if (gas)
+            return (isWide(operand) ? "QWORD PTR [rip + " : "DWORD PTR [rip + ") + icg.operandToString(operand) + "]";
+        string ref = "[" + icg.operandToString(operand) + "]";
+        return icg.typeOf(operand) == VT_FLOAT ? "DWORD PTR " + ref : ref;
+    }
+
+    // Source operand text for a quad operand: immediates for int/bool/char
+    // constants, registers or memory for variables and temps, memory for
+    // float literals.
+    string operandRef(const Operand &operand)
+    {
+        if (operand.kind != OPND_CONST)
+        {
+            const char *reg = registerOf(operand);
+            return reg ? string(reg) : memoryRef(operand);
+        }
+
+        string_view text = icg.constantText(operand.id);
+        switch (icg.constants[operand.id].type)
+        {
+        case VT_STRING:
+            return "OFFSET _c" + to_string(operand.id);
+        case VT_FLOAT:
+            return (gas ? "DWORD PTR [rip + _c" : "DWORD PTR [_c") + to_string(operand.id) + "]";
+        case VT_CHAR:
+            return to_string((int)(unsigned char)text[0]);
+        case VT_BOOL:
+            return text == "true" ? "1" : "0";
+        default:
+            return string(text);
+        }
+    }
+
+    // MASM has no escape sequences inside quotes, so \n and friends become byte values
+    string masmString(string_view text)
+    {
+        string result;
+        string chunk;
+        auto flush = [&]()
+        {
+            if (!chunk.empty())
+            {
+                result += (result.empty() ? "\"" : ", \"") + chunk + "\"";
+                chunk.clear();
+            }
+        };
+        auto byte = [&](int value)
+        {
+            flush();
+            result += (result.empty() ? "" : ", ") + to_string(value);
+        };
+
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            char ch = text[i];
+            if (ch == '\\' && i + 1 < text.size())
+            {
+                char next = text[++i];
+                if (next == 'n')
+                    byte(10);
+                else if (next == 't')
+                    byte(9);
+                else if (next == '0')
+                    byte(0);
+                else
+                    chunk += next;
+            }
+            else if (ch == '"')
+            {
+                chunk += "\"\"";
+            }
+            else
+            {
+                chunk += ch;
+            }
+        }
+        flush();
+        return result.empty() ? "0" : result + ", 0";
+    }
+
+    // GAS strings take C-style escapes; anything unusual becomes octal so a
+    // following digit can never extend the escape
+    string gasString(string_view text)
+    {
+        string result = "\"";
+        auto byte = [&](unsigned char value)
+        {
+            if (value == '"' || value == '\\' || value < 32 || value > 126)
+            {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\%03o", value);
+                result += escape;
+            }
+            else
+            {
+                result += (char)value;
+            }
+        };
+
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            char ch = text[i];
+            if (ch == '\\' && i + 1 < text.size())
+            {
+                char next = text[++i];
+                byte(next == 'n' ? 10 : next == 't' ? 9 : next == '0' ? 0 : next);
+            }
+            else
+            {
+                byte(ch);
+            }
+        }
+        return result + "\"";
+    }
+};
+
+// The bytes of a string literal for the in-memory engines: \n, \t and \0
+// as in AssemblyGenerator::masmString, any other escaped character stands
+// for itself
+inline string decodeStringLiteral(string_view text)
+{
+    string result;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char ch = text[i];
+        if (ch == '\\' && i + 1 < text.size())
+        {
+            char next = text[++i];
+            ch = next == 'n' ? '\n' : next == 't' ? '\t' : next == '0' ? '\0' : next;
+        }
+        result += ch;
+    }
+    return result;
+}
+
+#ifdef JIT_X86_64
+// Compiles the TAC straight to x86-64 machine code in memory and runs it in
+// process, for --run. One mapping holds a data region (an 8-byte cell per
+// variable and temp, then the float and string literals) and, on the next
+// page, the code, which addresses the data rip-relative. The code is a
+// System V function returning 0, or 1 after a division by zero. print and
+// string concatenation call back into the host. Registers come from
+// RegisterAllocator's x86-64 set, which are all callee-saved, so the calls
+// only clobber scratch registers.
+class JitCompiler
+{
+private:
+    enum Register
+    {
+        RAX,
+        RCX,
+        RDX,
+        RBX,
+        RSP,
+        RBP,
+        RSI,
+        RDI,
+        R12 = 12,
+        R13,
+        R14,
+        R15
+    };
+    enum Condition
+    {
+        CC_B = 0x2,
+        CC_AE = 0x3,
+        CC_E = 0x4,
+        CC_NE = 0x5,
+        CC_BE = 0x6,
+        CC_A = 0x7,
+        CC_P = 0xA,
+        CC_NP = 0xB,
+        CC_L = 0xC,
+        CC_GE = 0xD,
+        CC_LE = 0xE,
+        CC_G = 0xF
+    };
+    // ModRM reg field of the 0x81/0x83 group, and of the matching "reg, r/m" opcode
+    enum AluOp
+    {
+        ALU_ADD = 0,
+        ALU_SUB = 5,
+        ALU_CMP = 7
+    };
+    enum LocationKind
+    {
+        LOC_REGISTER,
+        LOC_MEMORY, // value is an offset into the data region
+        LOC_IMMEDIATE
+    };
+    struct Location
+    {
+        LocationKind kind;
+        int value;
+    };
+    static constexpr size_t PAGE = 4096;
+    static constexpr size_t CELL = 8; // Per variable and temp; strings are pointers
+
+    const IntermediateCodeGnerator &icg;
+    bool optimize;
+    SlotNumbering slots;
+    unique_ptr<RegisterAllocator> registers;
+    vector<int> slotRegister;   // Per slot, register number or -1
+    vector<int> constantOffset; // Per constant, data offset for floats and strings, else -1
+    vector<uint8_t> data;       // Initial contents of the data region
+    vector<uint8_t> code;
+    size_t codeStart = 0; // Offset of the code in the mapping
+
+    vector<size_t> labelPos;
+    vector<pair<size_t, int>> jumpFixups; // rel32 position, label
+    struct TableFixup
+    {
+        size_t position; // Of the entry
+        size_t table;
+        int label;
+    };
+    vector<TableFixup> tableFixups;
+    vector<size_t> divideByZeroFixups; // rel32 positions
+
+    uint8_t *memory = nullptr;
+    size_t mappedSize = 0;
+    ostream *out = nullptr;
+    deque<string> heapStrings; // Results of string concatenation
+
+public:
+    JitCompiler(const IntermediateCodeGnerator &icg, bool optimize)
+        : icg(icg), optimize(optimize), slots(icg) {}
+
+    ~JitCompiler()
+    {
+        if (memory)
+            munmap(memory, mappedSize);
+    }
+
+    JitCompiler(const JitCompiler &) = delete;
+    JitCompiler &operator=(const JitCompiler &) = delete;
+
+    // Encodes the program and maps it executable
+    void compile()
+    {
+        if (optimize)
+            registers = make_unique<RegisterAllocator>(icg, 0, false, TARGET_X86_64);
+        slotRegister.assign(slots.slotCount, -1);
+        for (int slot = 0; registers && slot < slots.slotCount; slot++)
+            slotRegister[slot] = registerNumber(registers->registerOf(slots.operandOf(slot)));
+        layOutData();
+
+        writePrologue();
+        if (registers)
+        {
+            for (const Operand &operand : registers->loadAtEntry)
+            {
+                int slot = slots.slotOf(operand);
+                load(slotRegister[slot], Location{LOC_MEMORY, (int)(slot * CELL)});
+            }
+        }
+        labelPos.assign(icg.labelCount, 0);
+        for (const Quad &q : icg.instructions)
+            processInstruction(q);
+        writeEpilogue();
+        resolveFixups();
+        map();
+    }
+
+    // Runs the program with its print output going to out. Every run
+    // starts from the initial data. False after a division by zero.
+    bool execute(ostream &output)
+    {
+        out = &output;
+        memcpy(memory, data.data(), data.size());
+        auto entry = reinterpret_cast<int (*)()>(memory + codeStart);
+        return entry() == 0;
+    }
+
+    string summary() const
+    {
+        return to_string(code.size()) + " bytes of code, " + to_string(data.size()) + " bytes of data" +
+               (registers ? ", " + registers->summary() : "");
+    }
+
+private:
+    static int registerNumber(const char *name)
+    {
+        static const pair<const char *, int> numbers[] = {
+            {"ebx", RBX}, {"ebp", RBP}, {"r12d", R12}, {"r13d", R13}, {"r14d", R14}, {"r15d", R15}};
+        for (const auto &entry : numbers)
+        {
+            if (name && strcmp(name, entry.first) == 0)
+                return entry.second;
+        }
+        return -1;
+    }
+
+    // Slots first, then the literals that need storage
+    void layOutData()
+    {
+        data.assign(slots.slotCount * CELL, 0);
+        constantOffset.assign(icg.constants.size(), -1);
+        for (size_t i = 0; i < icg.constants.size(); i++)
+        {
+            const Constant &c = icg.constants[i];
+            if (c.type == VT_FLOAT)
+            {
+                constantOffset[i] = (int)data.size();
+                float value = strtof(string(icg.constantText((int)i)).c_str(), nullptr);
+                data.resize(data.size() + sizeof(value));
+                memcpy(data.data() + constantOffset[i], &value, sizeof(value));
+            }
+            else if (c.type == VT_STRING)
+            {
+                constantOffset[i] = (int)data.size();
+                string text = decodeStringLiteral(icg.constantText((int)i));
+                data.insert(data.end(), text.begin(), text.end());
+                data.push_back(0);
+            }
+        }
+        codeStart = (data.size() + PAGE - 1) / PAGE * PAGE;
+        if (codeStart == 0)
+            codeStart = PAGE;
+    }
+
+    Location locate(const Operand &operand) const
+    {
+        if (operand.kind == OPND_CONST)
+        {
+            if (constantOffset[operand.id] != -1)
+                return Location{LOC_MEMORY, constantOffset[operand.id]};
+            string_view text = icg.constantText(operand.id);
+            switch (icg.constants[operand.id].type)
+            {
+            case VT_CHAR:
+                return Location{LOC_IMMEDIATE, (int)(unsigned char)text[0]};
+            case VT_BOOL:
+                return Location{LOC_IMMEDIATE, text == "true" ? 1 : 0};
+            default:
+                return Location{LOC_IMMEDIATE, (int)(int32_t)strtoll(string(text).c_str(), nullptr, 10)};
+            }
+        }
+        int slot = slots.slotOf(operand);
+        if (slotRegister[slot] != -1)
+            return Location{LOC_REGISTER, slotRegister[slot]};
+        return Location{LOC_MEMORY, (int)(slot * CELL)};
+    }
+
+    static Location inRegister(int reg)
+    {
+        return Location{LOC_REGISTER, reg};
+    }
+
+    bool isFloat(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_FLOAT;
+    }
+
+    bool isString(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_STRING;
+    }
+
+    // Encoding
+
+    void byte(int value)
+    {
+        code.push_back((uint8_t)value);
+    }
+
+    void dword(int32_t value)
+    {
+        for (int k = 0; k < 4; k++)
+            byte((value >> (8 * k)) & 0xff);
+    }
+
+    void qword(uint64_t value)
+    {
+        for (int k = 0; k < 8; k++)
+            byte((int)((value >> (8 * k)) & 0xff));
+    }
+
+    void patch(size_t position, int32_t value)
+    {
+        memcpy(code.data() + position, &value, sizeof(value));
+    }
+
+    // [prefix] [REX] opcode ModRM [disp32]. A memory operand is rip-relative
+    // to the data region, so its displacement depends on how many immediate
+    // bytes follow it.
+    void instruction(int prefix, bool wide, initializer_list<int> opcode, int reg, const Location &rm,
+                     int immediateBytes = 0)
+    {
+        if (prefix != -1)
+            byte(prefix);
+        int rmNumber = rm.kind == LOC_REGISTER ? rm.value : 0;
+        int rex = 0x40 | (wide ? 8 : 0) | ((reg >> 3) & 1) << 2 | ((rmNumber >> 3) & 1);
+        if (rex != 0x40)
+            byte(rex);
+        for (int b : opcode)
+            byte(b);
+        if (rm.kind == LOC_REGISTER)
+        {
+            byte(0xC0 | (reg & 7) << 3 | (rmNumber & 7));
+            return;
+        }
+        byte(0x05 | (reg & 7) << 3);
+        dword((int32_t)((int64_t)rm.value - (int64_t)(codeStart + code.size() + 4 + immediateBytes)));
+    }
+
+    // Short forms for registers 8 and up take a REX.B prefix
+    void registerOpcode(int base, int reg, bool wide = false)
+    {
+        if (wide || reg >= 8)
+            byte(0x40 | (wide ? 8 : 0) | ((reg >> 3) & 1));
+        byte(base + (reg & 7));
+    }
+
+    // mov reg, value (32 bits)
+    void load(int reg, const Location &source)
+    {
+        if (source.kind == LOC_IMMEDIATE)
+        {
+            if (source.value == 0)
+            {
+                instruction(-1, false, {0x31}, reg, inRegister(reg));
+                return;
+            }
+            registerOpcode(0xB8, reg);
+            dword(source.value);
+            return;
+        }
+        if (source.kind == LOC_REGISTER && source.value == reg)
+            return;
+        instruction(-1, false, {0x8B}, reg, source);
+    }
+
+    // mov target, reg (32 bits)
+    void store(const Location &target, int reg)
+    {
+        if (target.kind == LOC_REGISTER && target.value == reg)
+            return;
+        instruction(-1, false, {0x89}, reg, target);
+    }
+
+    void alu(AluOp op, int reg, const Location &source)
+    {
+        if (source.kind == LOC_IMMEDIATE)
+        {
+            bool small = source.value >= -128 && source.value <= 127;
+            instruction(-1, false, {small ? 0x83 : 0x81}, op, inRegister(reg));
+            if (small)
+                byte(source.value);
+            else
+                dword(source.value);
+            return;
+        }
+        instruction(-1, false, {0x03 + op * 8}, reg, source);
+    }
+
+    void multiply(int reg, const Location &source)
+    {
+        if (source.kind == LOC_IMMEDIATE)
+        {
+            bool small = source.value >= -128 && source.value <= 127;
+            instruction(-1, false, {small ? 0x6B : 0x69}, reg, inRegister(reg));
+            if (small)
+                byte(source.value);
+            else
+                dword(source.value);
+            return;
+        }
+        instruction(-1, false, {0x0F, 0xAF}, reg, source);
+    }
+
+    // Any value into a 64-bit register: string literals by address, string
+    // slots as they are, everything else sign-extended
+    void loadWide(int reg, const Operand &operand)
+    {
+        Location source = locate(operand);
+        if (operand.kind == OPND_CONST && isString(operand))
+            instruction(-1, true, {0x8D}, reg, source);
+        else if (isString(operand))
+            instruction(-1, true, {0x8B}, reg, source);
+        else if (source.kind == LOC_IMMEDIATE)
+        {
+            instruction(-1, true, {0xC7}, 0, inRegister(reg));
+            dword(source.value);
+        }
+        else
+            instruction(-1, true, {0x63}, reg, source);
+    }
+
+    // Ints are converted, floats loaded as they are
+    void loadFloat(int xmm, const Operand &operand)
+    {
+        Location source = locate(operand);
+        if (isFloat(operand))
+        {
+            instruction(0xF3, false, {0x0F, 0x10}, xmm, source);
+            return;
+        }
+        if (source.kind == LOC_IMMEDIATE)
+        {
+            load(RAX, source);
+            source = inRegister(RAX);
+        }
+        instruction(0xF3, false, {0x0F, 0x2A}, xmm, source);
+    }
+
+    void storeFloat(const Operand &operand, int xmm)
+    {
+        if (isFloat(operand))
+        {
+            instruction(0xF3, false, {0x0F, 0x11}, xmm, locate(operand));
+            return;
+        }
+        instruction(0xF3, false, {0x0F, 0x2C}, RAX, inRegister(xmm)); // cvttss2si
+        store(locate(operand), RAX);
+    }
+
+    void jump(int label)
+    {
+        byte(0xE9);
+        jumpFixups.emplace_back(code.size(), label);
+        dword(0);
+    }
+
+    // setcc into the low byte of reg, one of RAX to RBX
+    void setFlag(Condition condition, int reg)
+    {
+        byte(0x0F);
+        byte(0x90 + condition);
+        byte(0xC0 + reg);
+    }
+
+    void jumpIf(Condition condition, int label)
+    {
+        byte(0x0F);
+        byte(0x80 + condition);
+        jumpFixups.emplace_back(code.size(), label);
+        dword(0);
+    }
+
+    // Conditionally, or always without a condition
+    void jumpToDivideByZero(int condition = -1)
+    {
+        if (condition == -1)
+        {
+            byte(0xE9);
+        }
+        else
+        {
+            byte(0x0F);
+            byte(0x80 + condition);
+        }
+        divideByZeroFixups.push_back(code.size());
+        dword(0);
+    }
+
+    // mov rdi, context; mov rax, function; call rax
+    void callHost(uintptr_t function)
+    {
+        registerOpcode(0xB8, RDI, true);
+        qword(reinterpret_cast<uintptr_t>(this));
+        registerOpcode(0xB8, RAX, true);
+        qword(function);
+        byte(0xFF);
+        byte(0xD0);
+    }
+
+    // Pushes the registers RegisterAllocator may hand out and aligns the
+    // stack to 16 bytes for the host calls
+    void writePrologue()
+    {
+        for (int reg : {RBX, RBP, R12, R13, R14, R15})
+            registerOpcode(0x50, reg);
+        code.insert(code.end(), {0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+    }
+
+    // Returns 0; the division by zero exit returns 1 through the same path
+    void writeEpilogue()
+    {
+        instruction(-1, false, {0x31}, RAX, inRegister(RAX));
+        size_t exit = code.size();
+        code.insert(code.end(), {0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+        for (int reg : {R15, R14, R13, R12, RBP, RBX})
+            registerOpcode(0x58, reg);
+        byte(0xC3);
+
+        size_t divideByZero = code.size();
+        registerOpcode(0xB8, RAX);
+        dword(1);
+        byte(0xE9);
+        dword((int32_t)(exit - (code.size() + 4)));
+        for (size_t position : divideByZeroFixups)
+            patch(position, (int32_t)(divideByZero - (position + 4)));
+    }
+
+    void resolveFixups()
+    {
+        for (const auto &fixup : jumpFixups)
+            patch(fixup.first, (int32_t)(labelPos[fixup.second] - (fixup.first + 4)));
+        for (const TableFixup &fixup : tableFixups)
+            patch(fixup.position, (int32_t)(labelPos[fixup.label] - fixup.table));
+    }
+
+    // Data on the first pages, code after it; the code pages lose write
+    // access before anything runs
+    void map()
+    {
+        mappedSize = (codeStart + code.size() + PAGE - 1) / PAGE * PAGE;
+        void *mapping = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            throw runtime_error("Cannot map memory for the JIT");
+        memory = static_cast<uint8_t *>(mapping);
+        memcpy(memory + codeStart, code.data(), code.size());
+        if (mprotect(memory + codeStart, mappedSize - codeStart, PROT_READ | PROT_EXEC) != 0)
+            throw runtime_error("Cannot make JIT code executable");
+    }
+
+    // Instructions, as in AssemblyGenerator
+
+    void processInstruction(const Quad &q)
+    {
+        if (isComparisonOp(q.op))
+        {
+            processComparison(q);
+            return;
+        }
+        if (isBinaryOp(q.op))
+        {
+            processArithmetic(q);
+            return;
+        }
+
+        switch (q.op)
+        {
+        case OP_LABEL:
+            labelPos[q.dst.id] = code.size();
+            break;
+        case OP_GOTO:
+            jump(q.dst.id);
+            break;
+        case OP_IF_FALSE:
+            processConditionalJump(q);
+            break;
+        case OP_IF_NE:
+            // An unordered (NaN) float compare sets ZF as if equal
+            if (compare(q.src1, q.src2))
+                jumpIf(CC_P, q.dst.id);
+            jumpIf(CC_NE, q.dst.id);
+            break;
+        case OP_JUMP_TABLE:
+            processJumpTable(q);
+            break;
+        case OP_ASSIGN:
+            processAssignment(q);
+            break;
+        case OP_PRINT:
+            processPrint(q);
+            break;
+        default:
+            throw runtime_error("--run cannot execute " + icg.instructionToString(q));
+        }
+    }
+
+    void processAssignment(const Quad &q)
+    {
+        if (isString(q.dst) || isString(q.src1))
+        {
+            loadWide(RAX, q.src1);
+            if (isString(q.dst))
+                instruction(-1, true, {0x89}, RAX, locate(q.dst));
+            else
+                store(locate(q.dst), RAX);
+            return;
+        }
+        if (isFloat(q.dst) || isFloat(q.src1))
+        {
+            loadFloat(0, q.src1);
+            storeFloat(q.dst, 0);
+            return;
+        }
+
+        Location target = locate(q.dst);
+        Location source = locate(q.src1);
+        if (target.kind == LOC_REGISTER)
+        {
+            load(target.value, source);
+        }
+        else if (source.kind == LOC_REGISTER)
+        {
+            store(target, source.value);
+        }
+        else if (source.kind == LOC_IMMEDIATE)
+        {
+            instruction(-1, false, {0xC7}, 0, target, 4);
+            dword(source.value);
+        }
+        else
+        {
+            load(RAX, source);
+            store(target, RAX);
+        }
+    }
+
+    void processArithmetic(const Quad &q)
+    {
+        if (isString(q.dst) || isString(q.src1) || isString(q.src2))
+        {
+            if (q.op != OP_ADD)
+                throw runtime_error("--run cannot execute " + icg.instructionToString(q));
+            loadWide(RSI, q.src1);
+            loadWide(RDX, q.src2);
+            callHost(reinterpret_cast<uintptr_t>(&concatenate));
+            if (isString(q.dst))
+                instruction(-1, true, {0x89}, RAX, locate(q.dst));
+            else
+                store(locate(q.dst), RAX);
+            return;
+        }
+        if (isFloat(q.dst) || isFloat(q.src1) || isFloat(q.src2))
+        {
+            static const int opcodes[] = {0x58, 0x5C, 0x59, 0x5E}; // addss, subss, mulss, divss
+            loadFloat(0, q.src1);
+            loadFloat(1, q.src2);
+            instruction(0xF3, false, {0x0F, opcodes[q.op - OP_ADD]}, 0, inRegister(1));
+            storeFloat(q.dst, 0);
+            return;
+        }
+
+        // Work in the result's register unless the second operand is in
+        // it too; division needs eax and edx
+        Location target = locate(q.dst);
+        Location right = locate(q.src2);
+        int reg = target.kind == LOC_REGISTER ? target.value : -1;
+        bool viaEax = reg == -1 || (right.kind == LOC_REGISTER && right.value == reg) || q.op == OP_DIV;
+        if (viaEax)
+            reg = RAX;
+        load(reg, locate(q.src1));
+        switch (q.op)
+        {
+        case OP_ADD:
+            alu(ALU_ADD, reg, right);
+            break;
+        case OP_SUB:
+            alu(ALU_SUB, reg, right);
+            break;
+        case OP_MUL:
+            multiply(reg, right);
+            break;
+        default:
+            writeDivision(right);
+            break;
+        }
+        if (viaEax)
+            store(target, RAX);
+    }
+
+    // eax /= divisor. Dividing by zero leaves the program, and dividing by
+    // -1 negates, since idiv faults on INT_MIN / -1.
+    void writeDivision(const Location &divisor)
+    {
+        if (divisor.kind == LOC_IMMEDIATE && divisor.value == 0)
+        {
+            jumpToDivideByZero();
+            return;
+        }
+        if (divisor.kind == LOC_IMMEDIATE && divisor.value == -1)
+        {
+            instruction(-1, false, {0xF7}, 3, inRegister(RAX)); // neg eax
+            return;
+        }
+        load(RCX, divisor);
+        if (divisor.kind != LOC_IMMEDIATE)
+        {
+            instruction(-1, false, {0x85}, RCX, inRegister(RCX)); // test ecx, ecx
+            jumpToDivideByZero(CC_E);
+            alu(ALU_CMP, RCX, Location{LOC_IMMEDIATE, -1});
+            code.insert(code.end(), {0x75, 0x04}); // jne +4
+            instruction(-1, false, {0xF7}, 3, inRegister(RAX)); // neg eax
+            code.insert(code.end(), {0xEB, 0x03}); // jmp +3
+        }
+        byte(0x99);                                      // cdq
+        instruction(-1, false, {0xF7}, 7, inRegister(RCX)); // idiv ecx
+    }
+
+    // Sets the flags for left - right. True when they come from ucomiss.
+    bool compare(const Operand &left, const Operand &right)
+    {
+        if (isFloat(left) || isFloat(right))
+        {
+            loadFloat(0, left);
+            loadFloat(1, right);
+            instruction(-1, false, {0x0F, 0x2E}, 0, inRegister(1)); // ucomiss xmm0, xmm1
+            return true;
+        }
+        if (isString(left) || isString(right))
+        {
+            loadWide(RAX, left);
+            loadWide(RCX, right);
+            instruction(-1, true, {0x3B}, RAX, inRegister(RCX));
+            return false;
+        }
+        Location source = locate(left);
+        int reg = source.kind == LOC_REGISTER ? source.value : RAX;
+        load(reg, source);
+        alu(ALU_CMP, reg, locate(right));
+        return false;
+    }
+
+    // A NaN operand makes ucomiss report unordered, setting ZF, PF and CF,
+    // so < and <= swap the operands to test with A and AE, and == and !=
+    // check PF. As in C, every comparison with NaN is false except !=.
+    void processComparison(const Quad &q)
+    {
+        if (isFloat(q.src1) || isFloat(q.src2))
+        {
+            bool swapped = q.op == OP_LT || q.op == OP_LE;
+            compare(swapped ? q.src2 : q.src1, swapped ? q.src1 : q.src2);
+            switch (q.op)
+            {
+            case OP_EQ:
+                setFlag(CC_E, RAX);
+                setFlag(CC_NP, RCX);
+                code.insert(code.end(), {0x20, 0xC8}); // and al, cl
+                break;
+            case OP_NE:
+                setFlag(CC_NE, RAX);
+                setFlag(CC_P, RCX);
+                code.insert(code.end(), {0x08, 0xC8}); // or al, cl
+                break;
+            case OP_LT:
+            case OP_GT:
+                setFlag(CC_A, RAX);
+                break;
+            default:
+                setFlag(CC_AE, RAX);
+                break;
+            }
+        }
+        else
+        {
+            compare(q.src1, q.src2);
+            Condition condition;
+            switch (q.op)
+            {
+            case OP_EQ:
+                condition = CC_E;
+                break;
+            case OP_NE:
+                condition = CC_NE;
+                break;
+            case OP_LT:
+                condition = CC_L;
+                break;
+            case OP_GT:
+                condition = CC_G;
+                break;
+            case OP_LE:
+                condition = CC_LE;
+                break;
+            default:
+                condition = CC_GE;
+                break;
+            }
+            setFlag(condition, RAX);
+        }
+        Location target = locate(q.dst);
+        int reg = target.kind == LOC_REGISTER ? target.value : RAX;
+        instruction(-1, false, {0x0F, 0xB6}, reg, inRegister(RAX)); // movzx reg, al
+        store(target, reg);
+    }
+
+    void processConditionalJump(const Quad &q)
+    {
+        if (isString(q.src1))
+        {
+            loadWide(RAX, q.src1);
+            instruction(-1, true, {0x85}, RAX, inRegister(RAX));
+        }
+        else
+        {
+            Location source = locate(q.src1);
+            int reg = source.kind == LOC_REGISTER ? source.value : RAX;
+            load(reg, source);
+            instruction(-1, false, {0x85}, reg, inRegister(reg));
+        }
+        jumpIf(CC_E, q.dst.id);
+    }
+
+    // As in the x86-64 assembly: entries are offsets from the table, which
+    // follows the jump
+    void processJumpTable(const Quad &q)
+    {
+        const JumpTable &table = icg.jumpTables[q.src2.id];
+        load(RAX, locate(q.src1));
+        if (table.low != 0)
+            alu(ALU_SUB, RAX, Location{LOC_IMMEDIATE, table.low});
+        alu(ALU_CMP, RAX, Location{LOC_IMMEDIATE, (int)table.targets.size() - 1});
+        jumpIf(CC_A, q.dst.id);
+        code.insert(code.end(), {0x48, 0x8D, 0x15}); // lea rdx, [rip + table]
+        dword(9);                                   // Past the next three instructions
+        code.insert(code.end(), {0x48, 0x63, 0x04, 0x82}); // movsxd rax, DWORD PTR [rdx + rax*4]
+        code.insert(code.end(), {0x48, 0x01, 0xD0});       // add rax, rdx
+        code.insert(code.end(), {0xFF, 0xE0});             // jmp rax
+        size_t start = code.size();
+        for (int label : table.targets)
+        {
+            tableFixups.push_back(TableFixup{code.size(), start, label});
+            dword(0);
+        }
+    }
+
+    void processPrint(const Quad &q)
+    {
+        ValueType type = icg.typeOf(q.src1);
+        if (type == VT_STRING)
+            loadWide(RSI, q.src1);
+        else
+            load(RSI, locate(q.src1)); // Floats go as their bits
+        load(RDX, Location{LOC_IMMEDIATE, (int)type});
+        callHost(reinterpret_cast<uintptr_t>(&printValue));
+    }
+
+    // Host side of print, formatted like the printf calls in the assembly
+    static void printValue(JitCompiler *jit, int64_t value, int type)
+    {
+        ostream &out = *jit->out;
+        switch (type)
+        {
+        case VT_FLOAT:
+        {
+            uint32_t bits = (uint32_t)value;
+            float number;
+            memcpy(&number, &bits, sizeof(number));
+            char text[64];
+            snprintf(text, sizeof(text), "%f", (double)number);
+            out << text;
+            break;
+        }
+        case VT_STRING:
+        {
+            const char *text = reinterpret_cast<const char *>((uintptr_t)value);
+            out << (text ? text : "(null)");
+            break;
+        }
+        case VT_CHAR:
+            out.put((char)value);
+            break;
+        default:
+            out << (int32_t)value;
+            break;
+        }
+    }
+
+    // Strings live until the JitCompiler goes
+    static const char *concatenate(JitCompiler *jit, const char *left, const char *right)
+    {
+        jit->heapStrings.push_back(string(left ? left : "") + (right ? right : ""));
+        return jit->heapStrings.back().c_str();
+    }
+};
+#endif // JIT_X86_64
+
+// Portable interpreter for the TAC, for --run=vm and for hosts without the
+// JIT. The TAC is translated to a register bytecode: every variable, temp
+// and constant has an 8-byte register, so an instruction names its operands
+// by index and needs no operand decoding. Types are resolved during
+// translation, so each opcode handles exactly one kind of value. Two
+// superinstructions cover the most common pairs: an int comparison whose
+// result only feeds the next ifFalse becomes one compare-and-branch, and an
+// operation whose temp is only copied by the next instruction writes the
+// copy's destination directly. Handlers dispatch with computed goto where
+// the compiler has it. Results match JitCompiler: ints wrap, a division by
+// -1 negates and a division by zero stops the program.
+class BytecodeVM
+{
+private:
+    enum VmOp : uint8_t
+    {
+        VM_MOVE,          // a = b
+        VM_INT_TO_FLOAT,  // a = (float)b
+        VM_FLOAT_TO_INT,  // a = (int)b, truncated
+        VM_ADD,           // a = b + c, also SUB to DIV
+        VM_SUB,
+        VM_MUL,
+        VM_DIV,
+        VM_FADD,
+        VM_FSUB,
+        VM_FMUL,
+        VM_FDIV,
+        VM_CONCAT,
+        VM_EQ,            // a = b == c, also NE to GE
+        VM_NE,
+        VM_LT,
+        VM_GT,
+        VM_LE,
+        VM_GE,
+        VM_FEQ,
+        VM_FNE,
+        VM_FLT,
+        VM_FGT,
+        VM_FLE,
+        VM_FGE,
+        VM_WEQ,           // 64-bit, for strings
+        VM_WNE,
+        VM_WLT,
+        VM_WGT,
+        VM_WLE,
+        VM_WGE,
+        VM_JUMP,          // goto c
+        VM_JUMP_IF_ZERO,  // if (a == 0) goto c
+        VM_JUMP_IF_ZERO_WIDE,
+        VM_JUMP_EQ,       // if (a == b) goto c, also NE to GE
+        VM_JUMP_NE,
+        VM_JUMP_LT,
+        VM_JUMP_GT,
+        VM_JUMP_LE,
+        VM_JUMP_GE,
+        VM_JUMP_FNE,
+        VM_JUMP_WNE,
+        VM_JUMP_TABLE,    // goto entry a - low of table b, c if out of range
+        VM_PRINT_INT,
+        VM_PRINT_FLOAT,
+        VM_PRINT_STRING,
+        VM_PRINT_CHAR,
+        VM_HALT,
+        VM_OP_COUNT
+    };
+
+    struct Instruction
+    {
+        VmOp op;
+        int32_t a;
+        int32_t b;
+        int32_t c;
+    };
+
+    // Ints are kept sign-extended and floats zero-extended, so a 64-bit
+    // compare or copy works on any register
+    union Register
+    {
+        int64_t wide;
+        int32_t i;
+        float f;
+        const char *s;
+    };
+
+    struct Table
+    {
+        int low;
+        vector<int32_t> targets; // Instruction indices
+    };
+
+    const IntermediateCodeGnerator &icg;
+    SlotNumbering slots;
+    int constantBase; // Registers: slots, then constants, then two scratch registers
+    int scratch;
+    vector<Instruction> code;
+    vector<Register> initial;     // Register contents before the program runs
+    vector<Table> tables;
+    vector<int32_t> labelPos;
+    vector<size_t> labelFixups;   // Instructions whose c is still a label
+    vector<int> tempReads;
+    deque<string> literals;       // Decoded string constants
+    deque<string> heapStrings;    // Results of concatenation, per run
+    size_t fusedBranches = 0;
+    size_t fusedCopies = 0;
+
+public:
+    BytecodeVM(const IntermediateCodeGnerator &icg)
+        : icg(icg), slots(icg), constantBase(slots.slotCount), scratch(constantBase + (int)icg.constants.size()) {}
+
+    void compile()
+    {
+        initial.assign(scratch + 2, Register{0});
+        for (size_t i = 0; i < icg.constants.size(); i++)
+        {
+            // Released by dead code elimination
+            if (icg.constants[i].symbol != -1)
+                initial[constantBase + i] = constantValue((int)i);
+        }
+
+        tempReads.assign(icg.tempCount, 0);
+        for (const Quad &q : icg.instructions)
+        {
+            for (const Operand *operand : {&q.src1, &q.src2})
+            {
+                if (operand->kind == OPND_TEMP)
+                    tempReads[operand->id]++;
+            }
+        }
+
+        labelPos.assign(icg.labelCount, 0);
+        const vector<Quad> &tac = icg.instructions;
+        for (size_t i = 0; i < tac.size(); i++)
+        {
+            const Quad *next = i + 1 < tac.size() ? &tac[i + 1] : nullptr;
+            if (next && fusesWithBranch(tac[i], *next))
+            {
+                emit(branchUnless(tac[i].op), reg(tac[i].src1), reg(tac[i].src2), label(next->dst));
+                fusedBranches++;
+                i++;
+            }
+            else if (next && fusesWithCopy(tac[i], *next))
+            {
+                Quad q = tac[i];
+                q.dst = next->dst;
+                translate(q);
+                fusedCopies++;
+                i++;
+            }
+            else
+            {
+                translate(tac[i]);
+            }
+        }
+        emit(VM_HALT);
+
+        for (size_t index : labelFixups)
+            code[index].c = labelPos[code[index].c];
+        for (Table &table : tables)
+        {
+            for (int32_t &target : table.targets)
+                target = labelPos[target];
+        }
+    }
+
+    // Runs the program with its print output going to out. Every run
+    // starts from the initial registers. False after a division by zero.
+    bool execute(ostream &out)
+    {
+        vector<Register> registers = initial;
+        heapStrings.clear();
+        return interpret(registers.data(), out);
+    }
+
+    string summary() const
+    {
+        return to_string(code.size()) + " instructions, " + to_string(initial.size()) + " registers, " +
+               to_string(fusedBranches) + " compare+branch fused, " + to_string(fusedCopies) + " copies fused";
+    }
+
+private:
+    int reg(const Operand &operand) const
+    {
+        return operand.kind == OPND_CONST ? constantBase + operand.id : slots.slotOf(operand);
+    }
+
+    Register constantValue(int id)
+    {
+        Register value{0};
+        string_view text = icg.constantText(id);
+        switch (icg.constants[id].type)
+        {
+        case VT_FLOAT:
+        {
+            float number = strtof(string(text).c_str(), nullptr);
+            uint32_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            value.wide = bits;
+            break;
+        }
+        case VT_STRING:
+            literals.push_back(decodeStringLiteral(text));
+            value.s = literals.back().c_str();
+            break;
+        case VT_CHAR:
+            value.wide = (unsigned char)text[0];
+            break;
+        case VT_BOOL:
+            value.wide = text == "true" ? 1 : 0;
+            break;
+        default:
+            value.wide = (int32_t)strtoll(string(text).c_str(), nullptr, 10);
+            break;
+        }
+        return value;
+    }
+
+    bool isFloat(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_FLOAT;
+    }
+
+    bool isString(const Operand &operand) const
+    {
+        return icg.typeOf(operand) == VT_STRING;
+    }
+
+    bool isPlainInt(const Operand &operand) const
+    {
+        return !isFloat(operand) && !isString(operand);
+    }
+
+    bool readOnce(const Operand &operand) const
+    {
+        return operand.kind == OPND_TEMP && tempReads[operand.id] == 1;
+    }
+
+    // t = a < b; ifFalse t goto L, with ints and t read nowhere else
+    bool fusesWithBranch(const Quad &q, const Quad &next) const
+    {
+        return isComparisonOp(q.op) && next.op == OP_IF_FALSE && next.src1 == q.dst && readOnce(q.dst) &&
+               isPlainInt(q.src1) && isPlainInt(q.src2);
+    }
+
+    // t = a op b; x = t, with t read nowhere else and no conversion in the copy
+    bool fusesWithCopy(const Quad &q, const Quad &next) const
+    {
+        return isDefinitionOp(q.op) && next.op == OP_ASSIGN && next.src1 == q.dst && readOnce(q.dst) &&
+               icg.typeOf(next.dst) == icg.typeOf(q.dst);
+    }
+
+    static VmOp branchUnless(OpCode op)
+    {
+        switch (op)
+        {
+        case OP_EQ:
+            return VM_JUMP_NE;
+        case OP_NE:
+            return VM_JUMP_EQ;
+        case OP_LT:
+            return VM_JUMP_GE;
+        case OP_GT:
+            return VM_JUMP_LE;
+        case OP_LE:
+            return VM_JUMP_GT;
+        default:
+            return VM_JUMP_LT;
+        }
+    }
+
+    void emit(VmOp op, int a = 0, int b = 0, int c = 0)
+    {
+        code.push_back(Instruction{op, a, b, c});
+    }
+
+    int label(const Operand &operand)
+    {
+        labelFixups.push_back(code.size());
+        return operand.id;
+    }
+
+    // Register holding the operand as a float, converting ints into a
+    // scratch register first
+    int floatOperand(const Operand &operand, int scratchIndex)
+    {
+        if (isFloat(operand))
+            return reg(operand);
+        emit(VM_INT_TO_FLOAT, scratch + scratchIndex, reg(operand));
+        return scratch + scratchIndex;
+    }
+
+    // Writes a float result from the scratch register to dst
+    void storeFloat(const Operand &dst)
+    {
+        emit(isFloat(dst) ? VM_MOVE : VM_FLOAT_TO_INT, reg(dst), scratch);
+    }
+
+    void translate(const Quad &q)
+    {
+        if (isBinaryOp(q.op))
+        {
+            translateBinary(q);
+            return;
+        }
+
+        switch (q.op)
+        {
+        case OP_LABEL:
+            labelPos[q.dst.id] = (int32_t)code.size();
+            break;
+        case OP_GOTO:
+            emit(VM_JUMP, 0, 0, label(q.dst));
+            break;
+        case OP_IF_FALSE:
+            emit(isString(q.src1) ? VM_JUMP_IF_ZERO_WIDE : VM_JUMP_IF_ZERO, reg(q.src1), 0, label(q.dst));
+            break;
+        case OP_IF_NE:
+            if (isFloat(q.src1) || isFloat(q.src2))
+            {
+                // Conversions go first
+                int left = floatOperand(q.src1, 0);
+                int right = floatOperand(q.src2, 1);
+                emit(VM_JUMP_FNE, left, right, label(q.dst));
+            }
+            else
+                emit(isString(q.src1) || isString(q.src2) ? VM_JUMP_WNE : VM_JUMP_NE, reg(q.src1), reg(q.src2),
+                     label(q.dst));
+            break;
+        case OP_JUMP_TABLE:
+        {
+            const JumpTable &table = icg.jumpTables[q.src2.id];
+            tables.push_back(Table{table.low, vector<int32_t>(table.targets.begin(), table.targets.end())});
+            emit(VM_JUMP_TABLE, reg(q.src1), (int)tables.size() - 1, label(q.dst));
+            break;
+        }
+        case OP_ASSIGN:
+            if (isFloat(q.dst) != isFloat(q.src1) && !isString(q.dst) && !isString(q.src1))
+                emit(isFloat(q.dst) ? VM_INT_TO_FLOAT : VM_FLOAT_TO_INT, reg(q.dst), reg(q.src1));
+            else if (q.dst != q.src1)
+                emit(VM_MOVE, reg(q.dst), reg(q.src1));
+            break;
+        case OP_PRINT:
+            switch (icg.typeOf(q.src1))
+            {
+            case VT_FLOAT:
+                emit(VM_PRINT_FLOAT, reg(q.src1));
+                break;
+            case VT_STRING:
+                emit(VM_PRINT_STRING, reg(q.src1));
+                break;
+            case VT_CHAR:
+                emit(VM_PRINT_CHAR, reg(q.src1));
+                break;
+            default:
+                emit(VM_PRINT_INT, reg(q.src1));
+                break;
+            }
+            break;
+        default:
+            throw runtime_error("--run cannot execute " + icg.instructionToString(q));
+        }
+    }
+
+    // Operand types pick the opcode family in the same order as
+    // JitCompiler: comparisons check for floats first, arithmetic for strings
+    void translateBinary(const Quad &q)
+    {
+        bool floating = isFloat(q.src1) || isFloat(q.src2);
+        bool wide = isString(q.src1) || isString(q.src2);
+        if (isComparisonOp(q.op))
+        {
+            int offset = q.op - OP_EQ;
+            if (floating)
+            {
+                int left = floatOperand(q.src1, 0);
+                int right = floatOperand(q.src2, 1);
+                emit((VmOp)(VM_FEQ + offset), reg(q.dst), left, right);
+            }
+            else
+            {
+                emit((VmOp)((wide ? VM_WEQ : VM_EQ) + offset), reg(q.dst), reg(q.src1), reg(q.src2));
+            }
+            return;
+        }
+
+        int offset = q.op - OP_ADD;
+        if (wide || isString(q.dst))
+        {
+            if (q.op != OP_ADD)
+                throw runtime_error("--run cannot execute " + icg.instructionToString(q));
+            emit(VM_CONCAT, reg(q.dst), reg(q.src1), reg(q.src2));
+        }
+        else if (floating || isFloat(q.dst))
+        {
+            int left = floatOperand(q.src1, 0);
+            int right = floatOperand(q.src2, 1);
+            if (isFloat(q.dst))
+            {
+                emit((VmOp)(VM_FADD + offset), reg(q.dst), left, right);
+                return;
+            }
+            emit((VmOp)(VM_FADD + offset), scratch, left, right);
+            storeFloat(q.dst);
+        }
+        else
+        {
+            emit((VmOp)(VM_ADD + offset), reg(q.dst), reg(q.src1), reg(q.src2));
+        }
+    }
+
+    // Range and NaN checks as cvttss2si: anything out of range is INT_MIN
+    static int32_t truncate(float value)
+    {
+        if (!(value >= -2147483648.0f && value < 2147483648.0f))
+            return INT32_MIN;
+        return (int32_t)value;
+    }
+
+    static int64_t floatBits(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    bool interpret(Register *r, ostream &out)
+    {
+        const Instruction *ip = code.data();
+        char text[64];
+
+#if defined(__GNUC__)
+        // In VmOp order
+        static const void *const handlers[] = {
+            &&op_MOVE, &&op_INT_TO_FLOAT, &&op_FLOAT_TO_INT, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV,
+            &&op_FADD, &&op_FSUB, &&op_FMUL, &&op_FDIV, &&op_CONCAT, &&op_EQ, &&op_NE, &&op_LT, &&op_GT,
+            &&op_LE, &&op_GE, &&op_FEQ, &&op_FNE, &&op_FLT, &&op_FGT, &&op_FLE, &&op_FGE, &&op_WEQ,
+            &&op_WNE, &&op_WLT, &&op_WGT, &&op_WLE, &&op_WGE, &&op_JUMP, &&op_JUMP_IF_ZERO,
+            &&op_JUMP_IF_ZERO_WIDE, &&op_JUMP_EQ, &&op_JUMP_NE, &&op_JUMP_LT, &&op_JUMP_GT, &&op_JUMP_LE,
+            &&op_JUMP_GE, &&op_JUMP_FNE, &&op_JUMP_WNE, &&op_JUMP_TABLE, &&op_PRINT_INT, &&op_PRINT_FLOAT,
+            &&op_PRINT_STRING, &&op_PRINT_CHAR, &&op_HALT};
+        static_assert(sizeof(handlers) / sizeof(handlers[0]) == VM_OP_COUNT, "a handler per opcode");
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() goto *handlers[ip->op]
+        VM_NEXT();
+#else
+#define VM_CASE(name) case VM_##name:
+#define VM_NEXT() continue
+        for (;;)
+            switch (ip->op)
+            {
+#endif
+        // Int results wrap, so they are computed unsigned
+#define VM_INT_OP(name, expression) \
+    VM_CASE(name)                   \
+    {                               \
+        uint32_t x = (uint32_t)r[ip->b].i; \
+        uint32_t y = (uint32_t)r[ip->c].i; \
+        r[ip->a].wide = (int32_t)(expression); \
+        ip++;                       \
+        VM_NEXT();                  \
+    }
+#define VM_FLOAT_OP(name, expression) \
+    VM_CASE(name)                     \
+    {                                 \
+        float x = r[ip->b].f;         \
+        float y = r[ip->c].f;         \
+        r[ip->a].wide = floatBits(expression); \
+        ip++;                         \
+        VM_NEXT();                    \
+    }
+#define VM_COMPARE(name, field, op) \
+    VM_CASE(name)                   \
+    {                               \
+        r[ip->a].wide = r[ip->b].field op r[ip->c].field; \
+        ip++;                       \
+        VM_NEXT();                  \
+    }
+#define VM_BRANCH(name, field, op) \
+    VM_CASE(name)                  \
+    {                              \
+        ip = r[ip->a].field op r[ip->b].field ? code.data() + ip->c : ip + 1; \
+        VM_NEXT();                 \
+    }
+
+        VM_CASE(MOVE)
+        {
+            r[ip->a] = r[ip->b];
+            ip++;
+            VM_NEXT();
+        }
+        VM_CASE(INT_TO_FLOAT)
+        {
+            r[ip->a].wide = floatBits((float)r[ip->b].i);
+            ip++;
+            VM_NEXT();
+        }
+        VM_CASE(FLOAT_TO_INT)
+        {
+            r[ip->a].wide = truncate(r[ip->b].f);
+            ip++;
+            VM_NEXT();
+        }
+        VM_INT_OP(ADD, x + y)
+        VM_INT_OP(SUB, x - y)
+        VM_INT_OP(MUL, x * y)
+        VM_CASE(DIV)
+        {
+            int32_t x = r[ip->b].i;
+            int32_t y = r[ip->c].i;
+            if (y == 0)
+                return false;
+            r[ip->a].wide = y == -1 ? (int32_t)(0u - (uint32_t)x) : x / y;
+            ip++;
+            VM_NEXT();
+        }
+        VM_FLOAT_OP(FADD, x + y)
+        VM_FLOAT_OP(FSUB, x - y)
+        VM_FLOAT_OP(FMUL, x * y)
+        VM_FLOAT_OP(FDIV, x / y)
+        VM_CASE(CONCAT)
+        {
+            const char *x = r[ip->b].s;
+            const char *y = r[ip->c].s;
+            heapStrings.push_back(string(x ? x : "") + (y ? y : ""));
+            r[ip->a].s = heapStrings.back().c_str();
+            ip++;
+            VM_NEXT();
+        }
+        VM_COMPARE(EQ, i, ==)
+        VM_COMPARE(NE, i, !=)
+        VM_COMPARE(LT, i, <)
+        VM_COMPARE(GT, i, >)
+        VM_COMPARE(LE, i, <=)
+        VM_COMPARE(GE, i, >=)
+        VM_COMPARE(FEQ, f, ==)
+        VM_COMPARE(FNE, f, !=)
+        VM_COMPARE(FLT, f, <)
+        VM_COMPARE(FGT, f, >)
+        VM_COMPARE(FLE, f, <=)
+        VM_COMPARE(FGE, f, >=)
+        VM_COMPARE(WEQ, wide, ==)
+        VM_COMPARE(WNE, wide, !=)
+        VM_COMPARE(WLT, wide, <)
+        VM_COMPARE(WGT, wide, >)
+        VM_COMPARE(WLE, wide, <=)
+        VM_COMPARE(WGE, wide, >=)
+        VM_CASE(JUMP)
+        {
+            ip = code.data() + ip->c;
+            VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_ZERO)
+        {
+            ip = r[ip->a].i == 0 ? code.data() + ip->c : ip + 1;
+            VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_ZERO_WIDE)
+        {
+            ip = r[ip->a].wide == 0 ? code.data() + ip->c : ip + 1;
+            VM_NEXT();
+        }
+        VM_BRANCH(JUMP_EQ, i, ==)
+        VM_BRANCH(JUMP_NE, i, !=)
+        VM_BRANCH(JUMP_LT, i, <)
+        VM_BRANCH(JUMP_GT, i, >)
+        VM_BRANCH(JUMP_LE, i, <=)
+        VM_BRANCH(JUMP_GE, i, >=)
+        VM_BRANCH(JUMP_FNE, f, !=)
+        VM_BRANCH(JUMP_WNE, wide, !=)
+        VM_CASE(JUMP_TABLE)
+        {
+            const Table &table = tables[ip->b];
+            uint32_t index = (uint32_t)r[ip->a].i - (uint32_t)table.low;
+            ip = code.data() + (index < table.targets.size() ? table.targets[index] : ip->c);
+            VM_NEXT();
+        }
+        VM_CASE(PRINT_INT)
+        {
+            out << r[ip->a].i;
+            ip++;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT_FLOAT)
+        {
+            snprintf(text, sizeof(text), "%f", (double)r[ip->a].f);
+            out << text;
+            ip++;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT_STRING)
+        {
+            out << (r[ip->a].s ? r[ip->a].s : "(null)");
+            ip++;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT_CHAR)
+        {
+            out.put((char)r[ip->a].i);
+            ip++;
+            VM_NEXT();
+        }
+        VM_CASE(HALT)
+        {
+            return true;
+        }
+#if !defined(__GNUC__)
+            default:
+                return true;
+            }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_INT_OP
+#undef VM_FLOAT_OP
+#undef VM_COMPARE
+#undef VM_BRANCH
+    }
+};
+
+// Destination for compiler output: a file, stdout/stderr or a string. Writes are
+// collected in a 1 MB buffer and reach the file in large chunks. A file is
+// only created on the first write, so a sink that stays empty can still be
+// filled by the compile cache.
+class OutputSink : private streambuf
+{
+private:
+    enum Kind
+    {
+        SINK_FILE,
+        SINK_STDOUT,
+        SINK_STDERR,
+        SINK_MEMORY
+    };
+
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+    Kind kind;
+    string filePath;
+    FILE *file = nullptr;
+    bool failed = false;
+    vector<char> buffer;
+    string memory;
+    ostream out;
+
+    OutputSink(Kind kind, const string &filePath)
+        : kind(kind), filePath(filePath), buffer(BUFFER_SIZE), out(this)
+    {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+public:
+    static unique_ptr<OutputSink> toFile(const string &path)
+    {
+        return unique_ptr<OutputSink>(new OutputSink(SINK_FILE, path));
+    }
+
+    static unique_ptr<OutputSink> toStdout()
+    {
+        return unique_ptr<OutputSink>(new OutputSink(SINK_STDOUT, ""));
+    }
+
+    static unique_ptr<OutputSink> toStderr()
+    {
+        return unique_ptr<OutputSink>(new OutputSink(SINK_STDERR, ""));
+    }
+
+    static unique_ptr<OutputSink> toMemory()
+    {
+        return unique_ptr<OutputSink>(new OutputSink(SINK_MEMORY, ""));
+    }
+
+    ~OutputSink()
+    {
+        drain();
+        if (kind == SINK_FILE && file)
+            fclose(file);
+        else if (file)
+            fflush(file);
+    }
+
+    ostream &stream()
+    {
+        return out;
+    }
+
+    bool isFile() const
+    {
+        return kind == SINK_FILE;
+    }
+
+    bool isMemory() const
+    {
+        return kind == SINK_MEMORY;
+    }
+
+    const string &path() const
+    {
+        return filePath;
+    }
+
+    // For messages: "output.asm file", "stdout", "stderr" or "memory"
+    string name() const
+    {
+        switch (kind)
+        {
+        case SINK_FILE:
+            return filePath + " file";
+        case SINK_STDOUT:
+            return "stdout";
+        case SINK_STDERR:
+            return "stderr";
+        default:
+            return "memory";
+        }
+    }
+
+    // Everything written to a memory sink so far
+    const string &contents()
+    {
+        drain();
+        return memory;
+    }
+
+    // Pushes buffered output to its destination; throws if any write failed
+    void flush()
+    {
+        drain();
+        if (file && fflush(file) != 0)
+            failed = true;
+        if (failed)
+        {
+            throw runtime_error(kind == SINK_FILE && !file ? "Could not open " + name() : "Could not write to " + name());
+        }
+    }
+
+private:
+    int overflow(int c) override
+    {
+        drain();
+        if (c == EOF)
+            return 0;
+        *pptr() = (char)c;
+        pbump(1);
+        return c;
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        if (n > epptr() - pptr())
+        {
+            drain();
+            if (n >= (streamsize)buffer.size())
+            {
+                write(s, (size_t)n);
+                return n;
+            }
+        }
+        memcpy(pptr(), s, (size_t)n);
+        pbump((int)n);
+        return n;
+    }
+
+    int sync() override
+    {
+        drain();
+        return 0;
+    }
+
+    void drain()
+    {
+        write(pbase(), (size_t)(pptr() - pbase()));
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    void write(const char *data, size_t size)
+    {
+        if (size == 0 || failed)
+            return;
+        if (kind == SINK_MEMORY)
+        {
+            memory.append(data, size);
+            return;
+        }
+        if (!file)
+        {
+            file = kind == SINK_STDOUT ? stdout : kind == SINK_STDERR ? stderr : fopen(filePath.c_str(), "wb");
+            if (!file)
+            {
+                failed = true;
+                return;
+            }
+        }
+        if (fwrite(data, 1, size, file) != size)
+            failed = true;
+    }
+};
+
+// Bumped by hand when the generated code changes; the build stamp makes
+// sure a rebuilt compiler never reuses artifacts of an older one
+const char *const COMPILER_VERSION = "parser 0.12 " __DATE__ " " __TIME__;
+
+struct CacheKey
+{
+    uint64_t high;
+    uint64_t low;
+
+    string toHex() const
+    {
+        char text[33];
+        snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)high, (unsigned long long)low);
+        return text;
+    }
+};
+
+inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Word-at-a-time hash of a byte range; two seeds give the 128-bit cache key
+inline uint64_t hashBytes(string_view data, uint64_t seed)
+{
+    const uint64_t k1 = 0x9e3779b97f4a7c15ull;
+    const uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+    uint64_t h = seed ^ (data.size() * k1);
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data.data() + i, 8);
+        h ^= mix64(word * k2);
+        h = ((h << 27) | (h >> 37)) * k1 + k2;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data.data() + i, data.size() - i);
+    h ^= mix64(tail * k2 + (data.size() - i));
+    return mix64(h);
+}
+
+// On-disk cache of generated assembly (and the TAC listing) keyed by the
+// source bytes, compiler version and code generation options. Entries are
+// written to a temporary name and renamed, so concurrent batch workers and
+// interrupted runs never leave a half-written entry behind.
+class CompileCache
+{
+private:
+    filesystem::path dir;
+    atomic<size_t> hits;
+    atomic<size_t> misses;
+    atomic<size_t> stores;
+
+    static long processId()
+    {
+#ifndef _WIN32
+        return (long)getpid();
+#else
+        return (long)_getpid();
+#endif
+    }
+
+public:
+    CompileCache(const string &directory) : dir(directory), hits(0), misses(0), stores(0)
+    {
+        filesystem::create_directories(dir);
+    }
+
+    CacheKey keyFor(string_view source, const string &optionsText) const
+    {
+        string salt = string(COMPILER_VERSION) + '\0' + optionsText;
+        uint64_t seedHigh = hashBytes(salt, 0x5bd1e995u);
+        uint64_t seedLow = hashBytes(salt, 0x27d4eb2fu);
+        return CacheKey{hashBytes(source, seedHigh), hashBytes(source, seedLow)};
+    }
+
+    // Copies the cached assembly to `output` and loads the cached TAC
+    // listing. False on a miss. A hard link would let a later compile to the
+    // same path rewrite the entry through the shared inode.
+    bool fetch(const CacheKey &key, OutputSink &output, string &tacText)
+    {
+        filesystem::path asmEntry = dir / (key.toHex() + ".asm");
+        error_code ec;
+        if (!filesystem::exists(asmEntry, ec))
+        {
+            misses++;
+            return false;
+        }
+
+        if (output.isFile())
+        {
+            // Unlinks first, so a link left by an older build is not written through
+            filesystem::remove(output.path(), ec);
+            filesystem::copy_file(asmEntry, output.path(), filesystem::copy_options::overwrite_existing, ec);
+            if (ec)
+            {
+                misses++;
+                return false;
+            }
+        }
+        else
+        {
+            ifstream assembly(asmEntry, ios::binary);
+            output.stream() << assembly.rdbuf();
+        }
+
+        ifstream tac(dir / (key.toHex() + ".tac"), ios::binary);
+        tacText.assign(istreambuf_iterator<char>(tac), istreambuf_iterator<char>());
+        hits++;
+        return true;
+    }
+
+    // `output` must have been flushed. Output sent to stdout is not kept, so
+    // it cannot be stored.
+    void store(const CacheKey &key, OutputSink &output, const string &tacText)
+    {
+        if (!output.isFile() && !output.isMemory())
+            return;
+
+        string name = key.toHex();
+        // Unique across processes sharing the directory and across batch workers
+        string temp = "." + name + "." + to_string(processId()) + "." + to_string(stores++) + ".tmp";
+        error_code ec;
+
+        {
+            ofstream tac(dir / (temp + "tac"), ios::binary);
+            tac << tacText;
+        }
+        filesystem::rename(dir / (temp + "tac"), dir / (name + ".tac"), ec);
+
+        if (output.isFile())
+        {
+            filesystem::copy_file(output.path(), dir / (temp + "asm"), filesystem::copy_options::overwrite_existing, ec);
+        }
+        else
+        {
+            ofstream assembly(dir / (temp + "asm"), ios::binary);
+            assembly << output.contents();
+        }
+        if (!ec)
+            filesystem::rename(dir / (temp + "asm"), dir / (name + ".asm"), ec);
+    }
+
+    size_t hitCount() const
+    {
+        return hits;
+    }
+
+    size_t missCount() const
+    {
+        return misses;
+    }
+};
+
+// Build state of one top-level statement for incremental compilation.
+// Fragment spans tile the source: each starts at the statement's first token
+// (the first fragment at offset 0) and runs up to the next statement.
+struct Fragment
+{
+    struct Variable
+    {
+        int id;
+        ValueType type;
+        bool shadows;
+        bool global; // Declared by the statement itself, visible to later ones
+        string name;
+    };
+
+    size_t start = 0;
+    size_t length = 0;
+    int lines = 0;     // Newlines in the span
+    uint64_t hash = 0; // hashBytes of the span
+    vector<Variable> variables;
+    vector<pair<string, int>> lookups; // Outside names used and the variable each resolved to (-1 = none)
+    vector<pair<int, ValueType>> temps;
+    vector<tuple<int, ValueType, string>> constants;
+    string tac;
+    string assembly;
+};
+
+// Recompiles only the top-level statements that changed since the last run
+// (or whose outside names now resolve differently) and splices the TAC and
+// assembly of the rest from the state file. New statements number their
+// temps, labels, constants and variables past everything handed out before,
+// so reused code stays valid byte for byte.
+class IncrementalCompiler
+{
+private:
+    string statePath;
+    string version;
+
+    // State from the previous run
+    vector<Fragment> previous;
+    size_t previousSize = 0;
+    int nextTemp = 0;
+    int nextLabel = 0;
+    int nextConstant = 0;
+    int nextVariable = 0;
+
+    string_view source;
+    StringInterner strings;
+    SymbolTable symTable;
+    IntermediateCodeGnerator icg;
+    AstArena ast;
+    vector<Fragment> fragments;
+    ptrdiff_t shift = 0; // Offset change of statements after the edit
+    size_t reused = 0;
+
+    // Statements are optimized one at a time, so no constants carry over
+    // from one top-level statement to the next
+    bool optimize;
+    Target target;
+    ConstantPropagation optimizer;
+    GlobalValueNumbering valueNumbering;
+    LoopOptimization loops;
+    DeadCodeElimination deadCode;
+
+public:
+    IncrementalCompiler(const string &statePath, const string &version, bool optimize, Target target)
+        : statePath(statePath), version(version), symTable(strings), icg(strings), optimize(optimize), target(target), optimizer(icg), valueNumbering(icg), loops(icg), deadCode(icg)
+    {
+        loadState();
+    }
+
+    void compile(string_view text)
+    {
+        source = text;
+        shift = (ptrdiff_t)source.size() - (ptrdiff_t)previousSize;
+        symTable.reserveVariables(nextVariable);
+        fragments.reserve(previous.size() + 1);
+
+        // Unchanged statements at the start keep their offsets. The last one
+        // only counts if nothing was appended (it may end in a comment).
+        size_t prefix = 0;
+        size_t prefixEnd = 0;
+        int prefixLine = 1;
+        while (prefix < previous.size() && spanMatches(previous[prefix], prefixEnd) &&
+               (prefix + 1 < previous.size() || source.size() == previousSize))
+        {
+            prefixEnd += previous[prefix].length;
+            prefixLine += previous[prefix].lines;
+            prefix++;
+        }
+        // An `if` followed by a new `else` has to be parsed again
+        while (prefix > 0 && prefixEnd < source.size() &&
+               Lexer(source, strings, prefixEnd, prefixLine).next().type == T_ELSE)
+        {
+            prefix--;
+            prefixEnd -= previous[prefix].length;
+            prefixLine -= previous[prefix].lines;
+        }
+
+        // Unchanged statements at the end moved by `shift`
+        size_t suffix = previous.size();
+        while (suffix > prefix && shiftedStart(suffix - 1) >= (ptrdiff_t)prefixEnd &&
+               spanMatches(previous[suffix - 1], (size_t)shiftedStart(suffix - 1)))
+        {
+            suffix--;
+        }
+
+        size_t pos = 0;
+        int line = 1;
+        for (size_t k = 0; k < prefix && reuse(previous[k], pos); k++)
+        {
+            pos += previous[k].length;
+            line += previous[k].lines;
+        }
+
+        // Everything else is compiled until a statement starts where an
+        // unchanged one did; that one is reused unless its outside names
+        // now resolve to different declarations
+        size_t next = suffix;
+        while (true)
+        {
+            bool aligned = next < previous.size() && shiftedStart(next) == (ptrdiff_t)pos;
+            if (aligned && reuse(previous[next], pos))
+            {
+                pos += previous[next].length;
+                line += previous[next].lines;
+                next++;
+                continue;
+            }
+            if (pos == source.size())
+                break;
+            compileRange(pos, line, next, aligned);
+        }
+
+        nextVariable = max(nextVariable, (int)symTable.size());
+        finishSpans();
+    }
+
+    size_t reusedCount() const
+    {
+        return reused;
+    }
+
+    size_t statementCount() const
+    {
+        return fragments.size();
+    }
+
+    size_t instructionCount() const
+    {
+        size_t count = 0;
+        for (const auto &fragment : fragments)
+            count += std::count(fragment.tac.begin(), fragment.tac.end(), '\n');
+        return count;
+    }
+
+    string tacText() const
+    {
+        string text;
+        for (const auto &fragment : fragments)
+            text += fragment.tac;
+        return text;
+    }
+
+    void writeAssembly(ostream &out) const
+    {
+        AssemblyGenerator asmGen(icg, out, false, target);
+        asmGen.writeHeader();
+        asmGen.writeDataSection();
+        asmGen.beginCodeSection();
+        for (const auto &fragment : fragments)
+            out << fragment.assembly;
+        asmGen.endCodeSection();
+    }
+
+    // Written next to the target and renamed into place
+    void saveState() const
+    {
+        string text;
+        text.reserve(previousSize + 64 * fragments.size());
+        appendBlob(text, version);
+        appendNumbers(text, {(int64_t)previousSize, nextTemp, nextLabel, nextConstant, nextVariable, (int64_t)fragments.size()});
+        for (const auto &f : fragments)
+        {
+            appendNumbers(text, {(int64_t)f.start, (int64_t)f.length, f.lines, (int64_t)f.hash});
+            appendNumbers(text, {(int64_t)f.variables.size()});
+            for (const auto &v : f.variables)
+            {
+                appendNumbers(text, {v.id, v.type, v.shadows, v.global});
+                appendBlob(text, v.name);
+            }
+            appendNumbers(text, {(int64_t)f.lookups.size()});
+            for (const auto &lookup : f.lookups)
+            {
+                appendNumbers(text, {lookup.second});
+                appendBlob(text, lookup.first);
+            }
+            appendNumbers(text, {(int64_t)f.temps.size()});
+            for (const auto &temp : f.temps)
+                appendNumbers(text, {temp.first, temp.second});
+            appendNumbers(text, {(int64_t)f.constants.size()});
+            for (const auto &c : f.constants)
+            {
+                appendNumbers(text, {get<0>(c), get<1>(c)});
+                appendBlob(text, get<2>(c));
+            }
+            appendBlob(text, f.tac);
+            appendBlob(text, f.assembly);
+        }
+
+        string temp = statePath + ".tmp";
+        {
+            ofstream out(temp, ios::binary);
+            if (!out.is_open())
+            {
+                throw runtime_error("Could not open " + temp + " file");
+            }
+            out.write(text.data(), text.size());
+        }
+        error_code ec;
+        filesystem::rename(temp, statePath, ec);
+        if (ec)
+        {
+            throw runtime_error("Could not write " + statePath + ": " + ec.message());
+        }
+    }
+
+private:
+    ptrdiff_t shiftedStart(size_t k) const
+    {
+        return (ptrdiff_t)previous[k].start + shift;
+    }
+
+    bool spanMatches(const Fragment &fragment, size_t start) const
+    {
+        return start + fragment.length <= source.size() &&
+               hashBytes(source.substr(start, fragment.length), 0) == fragment.hash;
+    }
+
+    // Replays a fragment from the previous run if every outside name it used
+    // still resolves to the same variable
+    bool reuse(Fragment &fragment, size_t start)
+    {
+        for (const auto &lookup : fragment.lookups)
+        {
+            if (symTable.lookup(strings.intern(lookup.first)) != lookup.second)
+                return false;
+        }
+
+        for (const auto &v : fragment.variables)
+        {
+            int symbol = strings.intern(v.name);
+            icg.declareVariable(v.id, symbol, v.type, v.shadows);
+            if (v.global)
+                symTable.restoreGlobal(v.id, symbol, v.type);
+        }
+        for (const auto &temp : fragment.temps)
+            icg.restoreTemp(temp.first, temp.second);
+        for (const auto &c : fragment.constants)
+            icg.restoreConstant(get<0>(c), get<1>(c), strings.intern(get<2>(c)));
+
+        fragments.push_back(move(fragment)); // Only the span fields are read afterwards
+        fragments.back().start = start;
+        reused++;
+        return true;
+    }
+
+    // Compiles statements from `pos` until one starts where previous fragment
+    // `next` now does (the first one regardless when `force` is set) or the
+    // input ends; `pos` and `line` are left at that statement
+    void compileRange(size_t &pos, int &line, size_t &next, bool force)
+    {
+        Lexer lexer(source, strings, pos, line);
+        Parser parser(lexer, symTable, ast);
+        while (true)
+        {
+            size_t first = parser.upcoming().start;
+            while (next < previous.size() && shiftedStart(next) < (ptrdiff_t)first)
+                next++; // Overwritten by the edit
+            bool aligned = next < previous.size() && shiftedStart(next) == (ptrdiff_t)first;
+            if (parser.atEnd() || (aligned && !force))
+            {
+                pos = first;
+                line = parser.upcoming().line;
+                return;
+            }
+            force = false;
+            compileStatement(parser, first);
+        }
+    }
+
+    void compileStatement(Parser &parser, size_t start)
+    {
+        Fragment fragment;
+        fragment.start = start;
+
+        int firstVariable = (int)symTable.size();
+        vector<pair<int, int>> lookups;
+        symTable.logLookups(&lookups);
+        NodeId statement = parser.parseTopLevelStatement();
+        symTable.logLookups(nullptr);
+
+        icg.beginFragment(nextTemp, nextLabel, nextConstant);
+        size_t firstInstruction = icg.instructions.size();
+        AstLowering lowering(ast, icg);
+        lowering.lowerTopLevelStatement(statement);
+        if (optimize)
+        {
+            optimizer.run(firstInstruction);
+            valueNumbering.run(firstInstruction);
+            loops.run(firstInstruction);
+            deadCode.run(firstInstruction, nextTemp, nextConstant, false);
+        }
+
+        sort(lookups.begin(), lookups.end());
+        lookups.erase(unique(lookups.begin(), lookups.end()), lookups.end());
+        for (const auto &lookup : lookups)
+            fragment.lookups.push_back({string(strings.name(lookup.first)), lookup.second});
+
+        for (int id = firstVariable; id < (int)symTable.size(); id++)
+        {
+            fragment.variables.push_back(Fragment::Variable{
+                id, symTable.getVariableType(id), symTable.shadows(id),
+                ast[statement].kind == N_DECL, string(strings.name(symTable.getVariableSymbol(id)))});
+        }
+        for (int id = nextTemp; id < icg.tempCount; id++)
+        {
+            if (icg.tempUsed[id])
+                fragment.temps.push_back({id, icg.tempTypes[id]});
+        }
+        for (int id = nextConstant; id < (int)icg.constants.size(); id++)
+        {
+            if (icg.constants[id].symbol != -1)
+                fragment.constants.emplace_back(id, icg.constants[id].type, string(icg.constantText(id)));
+        }
+
+        for (size_t i = firstInstruction; i < icg.instructions.size(); i++)
+            fragment.tac += icg.instructionToString(icg.instructions[i]) + "\n";
+        ostringstream assembly;
+        AssemblyGenerator asmGen(icg, assembly, optimize, target);
+        asmGen.generateStatement(firstInstruction);
+        fragment.assembly = assembly.str();
+
+        nextTemp = icg.tempCount;
+        nextLabel = icg.labelCount;
+        nextConstant = (int)icg.constants.size();
+        fragments.push_back(move(fragment));
+    }
+
+    // Stretches the fragments over the whole source and hashes the spans
+    // that changed
+    void finishSpans()
+    {
+        for (size_t k = 0; k < fragments.size(); k++)
+        {
+            Fragment &f = fragments[k];
+            size_t start = k == 0 ? 0 : f.start;
+            size_t end = k + 1 < fragments.size() ? fragments[k + 1].start : source.size();
+            if (start == f.start && end - start == f.length && f.hash != 0)
+                continue;
+            string_view span = source.substr(start, end - start);
+            f.start = start;
+            f.length = span.size();
+            f.lines = (int)std::count(span.begin(), span.end(), '\n');
+            f.hash = hashBytes(span, 0);
+        }
+        previousSize = source.size();
+    }
+
+    // The state file is whitespace separated numbers and length-prefixed
+    // strings ("5:hello")
+    static void appendNumbers(string &text, initializer_list<int64_t> numbers)
+    {
+        for (int64_t number : numbers)
+        {
+            text += to_string(number);
+            text += ' ';
+        }
+        text.back() = '\n';
+    }
+
+    static void appendBlob(string &text, string_view blob)
+    {
+        text += to_string(blob.size());
+        text += ':';
+        text += blob;
+        text += '\n';
+    }
+
+    struct StateReader
+    {
+        string_view text;
+        size_t pos = 0;
+        bool ok = true;
+
+        int64_t number()
+        {
+            while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n'))
+                pos++;
+            int64_t value = 0;
+            auto result = from_chars(text.data() + pos, text.data() + text.size(), value);
+            ok = ok && result.ec == errc();
+            pos = result.ptr - text.data();
+            return value;
+        }
+
+        string blob()
+        {
+            size_t size = (size_t)number();
+            if (!ok || pos + size + 2 > text.size() || text[pos] != ':')
+            {
+                ok = false;
+                return string();
+            }
+            string value(text.substr(pos + 1, size));
+            pos += size + 2;
+            return value;
+        }
+    };
+
+    // A missing, stale or damaged state file just means a full compile
+    void loadState()
+    {
+        SourceFile file;
+        if (!file.load(statePath.c_str()))
+            return;
+        StateReader in{file.text()};
+        if (in.blob() != version)
+            return;
+
+        previousSize = (size_t)in.number();
+        nextTemp = (int)in.number();
+        nextLabel = (int)in.number();
+        nextConstant = (int)in.number();
+        nextVariable = (int)in.number();
+        size_t count = (size_t)in.number();
+        if (in.ok)
+            previous.reserve(count);
+        for (size_t k = 0; in.ok && k < count; k++)
+        {
+            Fragment f;
+            f.start = (size_t)in.number();
+            f.length = (size_t)in.number();
+            f.lines = (int)in.number();
+            f.hash = (uint64_t)in.number();
+            for (size_t i = 0, n = (size_t)in.number(); in.ok && i < n; i++)
+            {
+                Fragment::Variable v;
+                v.id = (int)in.number();
+                v.type = (ValueType)in.number();
+                v.shadows = in.number() != 0;
+                v.global = in.number() != 0;
+                v.name = in.blob();
+                f.variables.push_back(move(v));
+            }
+            for (size_t i = 0, n = (size_t)in.number(); in.ok && i < n; i++)
+            {
+                int variable = (int)in.number();
+                f.lookups.push_back({in.blob(), variable});
+            }
+            for (size_t i = 0, n = (size_t)in.number(); in.ok && i < n; i++)
+            {
+                int id = (int)in.number();
+                f.temps.push_back({id, (ValueType)in.number()});
+            }
+            for (size_t i = 0, n = (size_t)in.number(); in.ok && i < n; i++)
+            {
+                int id = (int)in.number();
+                ValueType type = (ValueType)in.number();
+                f.constants.emplace_back(id, type, in.blob());
+            }
+            f.tac = in.blob();
+            f.assembly = in.blob();
+            previous.push_back(move(f));
+        }
+
+        if (!in.ok)
+        {
+            previous.clear();
+            previousSize = 0;
+            nextTemp = nextLabel = nextConstant = nextVariable = 0;
+        }
+    }
+};
+
+// What --run executes the program with
+enum Engine
+{
+    ENGINE_JIT, // JitCompiler, x86-64 hosts with mmap only
+    ENGINE_VM   // BytecodeVM, anywhere
+};
+
+struct CompileOptions
+{
+    bool echoSource = true;        // Print the source before compiling
+    bool printIntermediate = true; // Print the TAC and progress messages
+    CompileCache *cache = nullptr; // Reuse and store artifacts when set
+    Profiler *profiler = nullptr;  // Phase timings and trace spans when set
+    ostream *console = &cout;      // Source echo, TAC dump and progress messages
+    string incrementalState;       // Statement-level build state file, empty = full compile
+    bool optimize = true;          // Optimize the TAC and keep values in registers
+    Target target = TARGET_MASM32; // Assembly dialect and ABI
+    bool run = false;              // Execute in memory instead of writing assembly
+#ifdef JIT_X86_64
+    Engine engine = ENGINE_JIT;
+#else
+    Engine engine = ENGINE_VM;
+#endif
+
+    // Everything that changes the generated code goes into the cache key
+    string codegenOptionsText() const
+    {
+        return string(target == TARGET_X86_64 ? "target=x86-64" : "target=masm32") + (optimize ? " -O1" : " -O0");
+    }
+};
+
+struct PhaseStats
+{
+    string name;
+    double milliseconds;
+    size_t bytesWritten;
+    string details;
+};
+
+struct CompileStats
+{
+    size_t sourceBytes = 0;
+    size_t instructions = 0;
+    bool cacheHit = false;
+    vector<PhaseStats> phases; // Only filled when profiling
+};
+
+// Times one phase into the profiler and CompileStats::phases; does nothing
+// without a profiler
+class PhaseTimer
+{
+private:
+    Profiler *profiler;
+    CompileStats &stats;
+    string name;
+    size_t span = 0;
+
+public:
+    PhaseTimer(Profiler *profiler, CompileStats &stats, const string &name)
+        : profiler(profiler), stats(stats), name(name)
+    {
+        if (profiler)
+            span = profiler->begin(name);
+    }
+
+    void finish(const string &details, size_t bytesWritten = 0)
+    {
+        if (!profiler)
+            return;
+        string args = "\"details\":" + Profiler::jsonString(details);
+        if (bytesWritten)
+            args += ",\"bytesWritten\":" + to_string(bytesWritten);
+        stats.phases.push_back(PhaseStats{name, profiler->end(span, args), bytesWritten, details});
+    }
+};
+
+// Forwards to another stream buffer, counting the bytes
+class CountingBuffer : public streambuf
+{
+private:
+    streambuf *target;
+    size_t bytes = 0;
+
+public:
+    CountingBuffer(streambuf *target) : target(target) {}
+
+    size_t count() const
+    {
+        return bytes;
+    }
+
+protected:
+    int overflow(int c) override
+    {
+        if (c == EOF)
+            return 0;
+        bytes++;
+        return target->sputc((char)c);
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        bytes += n;
+        return target->sputn(s, n);
+    }
+
+    int sync() override
+    {
+        return target->pubsync();
+    }
+};
+
+// Pipeline of compileFile with --incremental; the state file is only
+// updated after a successful compile. The compile cache is not used, its
+// output differs from a full compile and a hit would skip the state update.
+CompileStats compileIncremental(string_view input, OutputSink &output, const CompileOptions &options,
+                                CompileStats stats)
+{
+    ostream &console = *options.console;
+    PhaseTimer compileTimer(options.profiler, stats, "incremental compile");
+    IncrementalCompiler compiler(options.incrementalState, string(COMPILER_VERSION) + " " + options.codegenOptionsText(),
+                                 options.optimize, options.target);
+    compiler.compile(input);
+    string tacText = compiler.tacText();
+    stats.instructions = compiler.instructionCount();
+    compileTimer.finish("reused " + to_string(compiler.reusedCount()) + " of " + to_string(compiler.statementCount()) +
+                        " statements, " + to_string(stats.instructions) + " instructions");
+
+    if (options.printIntermediate)
+    {
+        PhaseTimer printTimer(options.profiler, stats, "print TAC");
+        CountingBuffer counter(console.rdbuf());
+        ostream out(&counter);
+        out << '\n';
+        out << "------------------------------------------------" << '\n';
+        out << "Parsing completed successfully! No Syntax Error" << '\n';
+        out << "Reused " << compiler.reusedCount() << " of " << compiler.statementCount() << " top-level statements" << '\n';
+        out << "------------------------------------------------" << '\n';
+        out << "Intermediate Code Generated" << '\n';
+        out << "------------------------------------------------" << '\n';
+        out << tacText << '\n';
+        out << "------------------------------------------------" << '\n';
+        printTimer.finish("to stdout", counter.count());
+    }
+
+    PhaseTimer codegenTimer(options.profiler, stats, "codegen");
+    CountingBuffer asmCounter(output.stream().rdbuf());
+    ostream asmOut(&asmCounter);
+    compiler.writeAssembly(asmOut);
+    output.flush();
+    codegenTimer.finish("to " + output.name(), asmCounter.count());
+    if (options.printIntermediate)
+    {
+        console << "Assembly generated in " << output.name() << '\n';
+    }
+
+    PhaseTimer saveTimer(options.profiler, stats, "save state");
+    compiler.saveState();
+    saveTimer.finish("to " + options.incrementalState);
+    return stats;
+}
+
+// Compiles with JitCompiler or BytecodeVM and runs the program
+template <typename Executor>
+void compileAndRun(Executor &executor, const string &phase, OutputSink &output, const CompileOptions &options,
+                   CompileStats &stats)
+{
+    PhaseTimer compileTimer(options.profiler, stats, phase);
+    executor.compile();
+    compileTimer.finish(executor.summary());
+
+    // Compiler messages come first
+    options.console->flush();
+    PhaseTimer runTimer(options.profiler, stats, "run");
+    CountingBuffer counter(output.stream().rdbuf());
+    ostream programOut(&counter);
+    bool finished = executor.execute(programOut);
+    output.flush();
+    runTimer.finish(finished ? "finished" : "division by zero", counter.count());
+    if (!finished)
+        throw runtime_error("Runtime error: division by zero");
+}
+
+// --run: the program's output goes to output instead of the assembly
+void runInMemory(const IntermediateCodeGnerator &icg, OutputSink &output, const CompileOptions &options,
+                 CompileStats &stats)
+{
+    if (options.engine == ENGINE_VM)
+    {
+        BytecodeVM vm(icg);
+        compileAndRun(vm, "bytecode", output, options, stats);
+        return;
+    }
+#ifdef JIT_X86_64
+    JitCompiler jit(icg, options.optimize);
+    compileAndRun(jit, "jit", output, options, stats);
+#else
+    throw runtime_error("--run=jit needs an x86-64 host with mmap");
+#endif
+}
+
+// Runs the whole pipeline for one source file; every phase reports errors
+// by throwing runtime_error
+CompileStats compileFile(const string &inputPath, OutputSink &output, const CompileOptions &options)
+{
+    ostream &console = *options.console;
+    CompileStats stats;
+
+    // Map (or stream) the source file
+    PhaseTimer readTimer(options.profiler, stats, "read source");
+    SourceFile source;
+    if (!source.load(inputPath.c_str()))
+    {
+        throw runtime_error("File " + inputPath + " not found.");
+    }
+
+    string_view input = source.text();
+    stats.sourceBytes = input.size();
+    readTimer.finish(to_string(input.size()) + " bytes");
+    if (options.echoSource)
+    {
+        console << '\n';
+        console << "Given code" << '\n';
+        console << "------------------------------------------------" << '\n';
+        console << input << '\n';
+    }
+
+    if (!options.incrementalState.empty())
+    {
+        return compileIncremental(input, output, options, stats);
+    }
+
+    CacheKey key{0, 0};
+    if (options.cache && !options.run)
+    {
+        PhaseTimer cacheTimer(options.profiler, stats, "cache lookup");
+        key = options.cache->keyFor(input, options.codegenOptionsText());
+        string tacText;
+        bool hit = options.cache->fetch(key, output, tacText);
+        if (hit)
+            output.flush();
+        cacheTimer.finish(hit ? "hit" : "miss");
+        if (hit)
+        {
+            if (options.printIntermediate)
+            {
+                console << '\n';
+                console << "------------------------------------------------" << '\n';
+                console << "Compile cache hit, pipeline skipped" << '\n';
+                console << "------------------------------------------------" << '\n';
+                console << "Intermediate Code Generated" << '\n';
+                console << "------------------------------------------------" << '\n';
+                console << tacText << '\n';
+                console << "------------------------------------------------" << '\n';
+                console << "Assembly generated in " << output.name() << '\n';
+            }
+            stats.cacheHit = true;
+            return stats;
+        }
+    }
+
+    // Main Parsing
+    PhaseTimer parseTimer(options.profiler, stats, "lex + parse");
+    StringInterner strings;
+    Lexer lexer(input, strings);
+
+    SymbolTable symTable(strings);
+    IntermediateCodeGnerator icg(strings);
+
+    AstArena ast;
+
+    Parser parser(lexer, symTable, ast);
+    if (options.profiler)
+    {
+        lexer.enableTiming();
+        if (options.profiler->wantsStatementSpans())
+            parser.setProfiler(options.profiler);
+    }
+    NodeId program = parser.parseProgram();
+    if (options.profiler)
+    {
+        double lexSeconds = lexer.lexSeconds();
+        size_t tokensPerSecond = lexSeconds > 0 ? (size_t)(lexer.tokensProduced() / lexSeconds) : 0;
+        parseTimer.finish(to_string(lexer.tokensProduced()) + " tokens, " + to_string(tokensPerSecond) +
+                          " tokens/s lexing, " + to_string(strings.size()) + " symbols, " +
+                          to_string(symTable.size()) + " variables, " + to_string(ast.size()) + " AST nodes");
+    }
+
+    PhaseTimer lowerTimer(options.profiler, stats, "lower to TAC");
+    AstLowering lowering(ast, icg);
+    lowering.lowerProgram(program);
+    lowerTimer.finish(to_string(icg.instructions.size()) + " instructions, " + to_string(icg.tempCount) + " temps, " +
+                      to_string(icg.labelCount) + " labels, " + to_string(icg.constants.size()) + " constants");
+
+    if (options.optimize)
+    {
+        PhaseTimer optimizeTimer(options.profiler, stats, "optimize");
+        ConstantPropagation optimizer(icg);
+        optimizer.run();
+        optimizeTimer.finish(optimizer.summary() + ", " + to_string(icg.instructions.size()) + " instructions left");
+
+        PhaseTimer valueNumberingTimer(options.profiler, stats, "value numbering");
+        GlobalValueNumbering valueNumbering(icg);
+        valueNumbering.run();
+        valueNumberingTimer.finish(valueNumbering.summary() + ", " + to_string(icg.instructions.size()) + " instructions");
+
+        PhaseTimer loopsTimer(options.profiler, stats, "loops");
+        LoopOptimization loops(icg);
+        loops.run();
+        loopsTimer.finish(loops.summary() + ", " + to_string(icg.instructions.size()) + " instructions");
+
+        PhaseTimer deadCodeTimer(options.profiler, stats, "dead code");
+        DeadCodeElimination deadCode(icg);
+        deadCode.run();
+        deadCodeTimer.finish(deadCode.summary() + ", " + to_string(icg.instructions.size()) + " instructions left");
+    }
+
+    if (options.printIntermediate)
+    {
+        PhaseTimer printTimer(options.profiler, stats, "print TAC");
+        CountingBuffer counter(console.rdbuf());
+        ostream out(&counter);
+        out << '\n';
+        out << "------------------------------------------------" << '\n';
+        out << "Parsing completed successfully! No Syntax Error" << '\n';
+        out << "------------------------------------------------" << '\n';
+        icg.printInstructions(out);
+        out << "------------------------------------------------" << '\n';
+        printTimer.finish("to stdout", counter.count());
+    }
+
+    stats.instructions = icg.instructions.size();
+    if (options.run)
+    {
+        runInMemory(icg, output, options, stats);
+        return stats;
+    }
+
+    PhaseTimer codegenTimer(options.profiler, stats, "codegen");
+    CountingBuffer asmCounter(output.stream().rdbuf());
+    ostream asmOut(&asmCounter);
+    AssemblyGenerator asmGen(icg, asmOut, options.optimize, options.target);
+    asmGen.generateAssembly();
+    output.flush();
+    codegenTimer.finish(asmGen.summary() + ", to " + output.name(), asmCounter.count());
+    if (options.printIntermediate)
+    {
+        console << "Assembly generated in " << output.name() << '\n';
+    }
+
+    if (options.cache)
+    {
+        ostringstream tac;
+        icg.writeInstructions(tac);
+        options.cache->store(key, output, tac.str());
+    }
+    return stats;
+}
+
+// --stats report
+void printPhaseStats(const CompileStats &stats, ostream &out)
+{
+    double total = 0;
+    out << '\n';
+    out << "Phase                 Time (ms)   Written (bytes)  Details" << '\n';
+    out << "------------------------------------------------" << '\n';
+    for (const auto &phase : stats.phases)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), "%-20s %10.3f %17zu  ", phase.name.c_str(), phase.milliseconds, phase.bytesWritten);
+        out << line << phase.details << '\n';
+        total += phase.milliseconds;
+    }
+    char line[64];
+    snprintf(line, sizeof(line), "%-20s %10.3f", "total", total);
+    out << line << '\n';
+}
+
+// Thread pool with one task deque per worker. A worker takes work from the
+// back of its own deque and steals from the front of the others when it
+// runs dry. All tasks are submitted before run(), so workers simply exit
+// once every deque is empty.
+class WorkStealingPool
+{
+private:
+    struct TaskQueue
+    {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<TaskQueue>> queues;
+    size_t nextQueue = 0;
+
+public:
+    WorkStealingPool(unsigned threadCount)
+    {
+        for (unsigned i = 0; i < max(1u, threadCount); i++)
+            queues.emplace_back(new TaskQueue());
+    }
+
+    void submit(function<void()> task)
+    {
+        queues[nextQueue]->tasks.push_back(move(task));
+        nextQueue = (nextQueue + 1) % queues.size();
+    }
+
+    void run()
+    {
+        vector<thread> workers;
+        for (size_t i = 0; i < queues.size(); i++)
+            workers.emplace_back([this, i]() { work(i); });
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+private:
+    void work(size_t self)
+    {
+        function<void()> task;
+        while (takeOwn(self, task) || steal(self, task))
+        {
+            task();
+        }
+    }
+
+    bool takeOwn(size_t self, function<void()> &task)
+    {
+        TaskQueue &queue = *queues[self];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+            return false;
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, function<void()> &task)
+    {
+        for (size_t offset = 1; offset < queues.size(); offset++)
+        {
+            TaskQueue &victim = *queues[(self + offset) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
     }
 };
 
+// foo/bar.txt -> foo/bar.asm, or foo/bar.s for x86-64
+string batchOutputPath(const string &inputPath, Target target)
+{
+    const char *extension = target == TARGET_X86_64 ? ".s" : ".asm";
+    size_t slash = inputPath.find_last_of("/\\");
+    size_t dot = inputPath.find_last_of('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return inputPath + extension;
+    return inputPath.substr(0, dot) + extension;
+}
+
+// Compiles every input concurrently, one .asm (or .s) next to each source, and
+// prints a throughput summary. Returns the number of failed files.
+int runBatch(const vector<string> &inputs, unsigned threadCount, CompileOptions options)
+{
+    options.echoSource = false;
+    options.printIntermediate = false;
+
+    atomic<size_t> totalBytes(0);
+    atomic<size_t> totalInstructions(0);
+    atomic<int> failures(0);
+    mutex errorLock;
+
+    auto start = chrono::steady_clock::now();
+    WorkStealingPool pool(threadCount);
+    for (const string &input : inputs)
+    {
+        pool.submit([&, input]()
+        {
+            try
+            {
+                unique_ptr<OutputSink> output = OutputSink::toFile(batchOutputPath(input, options.target));
+                CompileStats stats = compileFile(input, *output, options);
+                totalBytes += stats.sourceBytes;
+                totalInstructions += stats.instructions;
+            }
+            catch (const exception &e)
+            {
+                failures++;
+                lock_guard<mutex> guard(errorLock);
+                cerr << input << ": " << e.what() << endl;
+            }
+        });
+    }
+    pool.run();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Batch compiled " << inputs.size() - failures << "/" << inputs.size() << " files on "
+         << max(1u, threadCount) << " threads in " << seconds << " s" << endl;
+    cout << "  " << totalBytes << " source bytes, " << totalInstructions << " TAC instructions" << endl;
+    if (seconds > 0)
+    {
+        cout << "  " << (totalBytes / seconds / 1e6) << " MB/s, " << (inputs.size() / seconds) << " files/s" << endl;
+    }
+    if (options.cache)
+    {
+        cout << "  cache: " << options.cache->hitCount() << " hits, " << options.cache->missCount() << " misses" << endl;
+    }
+    return failures;
+}
+
+// bench.cpp includes this file for the compiler classes and brings its own main
+#ifndef PARSER_NO_MAIN
+void printUsage(const char *program)
+{
+    cerr << "Usage: " << program << " [-o output.asm|-] [-q] [--no-echo] [--no-tac] [-O0] [--cache-dir dir]" << endl;
+    cerr << "       " << string(strlen(program), ' ') << " [--target=masm32|x86-64] [--incremental state_file] [--stats]" << endl;
+    cerr << "       " << string(strlen(program), ' ') << " [--trace=file.json] <source_file>" << endl;
+    cerr << "       " << program << " --run[=jit|vm] [-O0] [--stats] <source_file>" << endl;
+    cerr << "       " << program << " --batch [-j threads] [-O0] [--target=...] [--cache-dir dir] <source_file>..." << endl;
+    cerr << "       " << program << " --manifest <list_file> [-j threads] [-O0] [--target=...] [--cache-dir dir]" << endl;
+}
+
 int main(int argc, char *argv[])
 {
+    bool batch = false;
+    unsigned threadCount = thread::hardware_concurrency();
+    string cacheDir;
+    string incrementalState;
+    bool printStats = false;
+    string tracePath;
+    string outputPath; // output.asm, or output.s for x86-64
+    bool echoSource = true;
+    bool printIntermediate = true;
+    bool optimize = true;
+    Target target = TARGET_MASM32;
+    bool run = false;
+    CompileOptions defaults;
+    Engine engine = defaults.engine;
+    vector<string> inputs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--batch")
+        {
+            batch = true;
+        }
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            threadCount = (unsigned)atoi(argv[++i]);
+        }
+        else if (arg == "--cache-dir" && i + 1 < argc)
+        {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            outputPath = argv[++i]; // "-" is stdout
+        }
+        else if (arg == "--no-echo")
+        {
+            echoSource = false;
+        }
+        else if (arg == "--no-tac")
+        {
+            printIntermediate = false;
+        }
+        else if (arg == "-O0" || arg == "-O1")
+        {
+            optimize = arg == "-O1";
+        }
+        else if (arg == "--run" || arg == "--run=jit" || arg == "--run=vm")
+        {
+            run = true;
+            if (arg != "--run")
+                engine = arg == "--run=vm" ? ENGINE_VM : ENGINE_JIT;
+        }
+        else if (arg.compare(0, 6, "--run=") == 0)
+        {
+            cerr << "Unknown engine " << arg.substr(6) << ", expected jit or vm" << endl;
+            return 1;
+        }
+        else if (arg == "--target=masm32" || arg == "--target=x86-64")
+        {
+            target = arg == "--target=x86-64" ? TARGET_X86_64 : TARGET_MASM32;
+        }
+        else if (arg.compare(0, 9, "--target=") == 0)
+        {
+            cerr << "Unknown target " << arg.substr(9) << ", expected masm32 or x86-64" << endl;
+            return 1;
+        }
+        else if (arg == "-q" || arg == "--quiet")
+        {
+            echoSource = false;
+            printIntermediate = false;
+        }
+        else if (arg == "--stats")
+        {
+            printStats = true;
+        }
+        else if (arg.compare(0, 8, "--trace=") == 0)
+        {
+            tracePath = arg.substr(8);
+        }
+        else if (arg == "--incremental" && i + 1 < argc)
+        {
+            incrementalState = argv[++i];
+        }
+        else if (arg == "--manifest" && i + 1 < argc)
+        {
+            // One source path per line
+            batch = true;
+            ifstream manifest(argv[++i]);
+            if (!manifest)
+            {
+                cerr << "File " << argv[i] << " not found." << endl;
+                return 1;
+            }
+            string line;
+            while (getline(manifest, line))
+            {
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                if (!line.empty())
+                    inputs.push_back(line);
+            }
+        }
+        else
+        {
+            inputs.push_back(arg);
+        }
+    }
+
     // Check if the user provided a filename
-    if (argc < 2)
+    if (inputs.empty())
     {
-        cerr << "Usage: " << argv[0] << " <source_file>" << endl;
+        printUsage(argv[0]);
         return 1;
     }
 
-    // Open the source file provided as a command line argument
-    ifstream file(argv[1]);
-    if (!file)
+    if (!batch && inputs.size() > 1)
     {
-        cerr << "File " << argv[1] << " not found." << endl;
+        cerr << "More than one source file given (" << inputs[0];
+        for (size_t k = 1; k < inputs.size(); k++)
+            cerr << ", " << inputs[k];
+        cerr << "); use --batch to compile several" << endl;
         return 1;
     }
 
-    string input;
-    string line;
-    // Read the file line by line
-    while (getline(file, line))
+    if (run && (batch || !incrementalState.empty()))
     {
-        input.append(line);
-        input.append("\n");
+        cerr << "--run cannot be combined with --batch, --manifest or --incremental" << endl;
+        return 1;
     }
-    file.close();
-    cout << endl;
-    cout << "Given code" << endl;
-    cout << "------------------------------------------------" << endl;
-    cout << input << endl;
 
-    // Main Parsing
-    Lexer lexer(input);
-    vector<Token> tokens = lexer.tokenize();
+    // With --run the program prints to stdout and compiler messages go to stderr
+    if (outputPath.empty())
+        outputPath = run ? "-" : target == TARGET_X86_64 ? "output.s" : "output.asm";
 
-    SymbolTable symTable;
-    IntermediateCodeGnerator icg;
+    // Console text shares stdout unless the assembly goes there
+    unique_ptr<OutputSink> console = outputPath == "-" ? OutputSink::toStderr() : OutputSink::toStdout();
 
-    Parser parser(tokens, symTable, icg);
-    parser.parseProgram();
-    auto intermediateCode = parser.getIntermediateCode();
-    cout << "------------------------------------------------" << endl;
-    AssemblyGenerator asmGen(intermediateCode);
-    asmGen.generateAssembly();
+    try
+    {
+        unique_ptr<CompileCache> cache;
+        if (!cacheDir.empty())
+            cache.reset(new CompileCache(cacheDir));
+
+        CompileOptions options;
+        options.cache = cache.get();
+        options.optimize = optimize;
+        options.target = target;
+        options.run = run;
+        options.engine = engine;
+        if (batch)
+        {
+            if (printStats || !tracePath.empty())
+                cerr << "--stats and --trace only apply to single-file compiles" << endl;
+            return runBatch(inputs, threadCount, options) == 0 ? 0 : 1;
+        }
+
+        unique_ptr<Profiler> profiler;
+        if (printStats || !tracePath.empty())
+            profiler.reset(new Profiler(!tracePath.empty()));
+
+        options.echoSource = echoSource;
+        options.printIntermediate = printIntermediate;
+        options.incrementalState = incrementalState;
+        options.profiler = profiler.get();
+        options.console = &console->stream();
+
+        unique_ptr<OutputSink> output = outputPath == "-" ? OutputSink::toStdout() : OutputSink::toFile(outputPath);
+        size_t span = profiler ? profiler->begin("compile " + inputs[0]) : 0;
+        CompileStats stats = compileFile(inputs[0], *output, options);
+        if (profiler)
+            profiler->end(span, "\"sourceBytes\":" + to_string(stats.sourceBytes) +
+                                    ",\"instructions\":" + to_string(stats.instructions));
+
+        if (printStats)
+            printPhaseStats(stats, console->stream());
+        if (!tracePath.empty())
+            profiler->writeTrace(tracePath);
+        console->flush();
+    }
+    catch (const exception &e)
+    {
+        console->stream() << e.what() << '\n';
+        console->flush();
+        return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif // PARSER_NO_MAIN